@@ -0,0 +1,868 @@
+#include "aot.h"
+#include <iostream>
+#include <sstream>
+#include <cstdio>
+#include <algorithm>
+#include <unordered_map>
+
+static void collectFunctions(Function* function, std::vector<Function*>& functions) {
+    if (std::find(functions.begin(), functions.end(), function) != functions.end()) return;
+
+    functions.push_back(function);
+    for (Value& constant : function->chunk.constants) {
+        if (constant.isObjectType(ObjectType::Function)) {
+            collectFunctions(constant.getFunction(), functions);
+        }
+    }
+}
+
+bool AotRuntime::install(Function* script, const AotProgram& program) {
+    std::vector<Function*> functions;
+    collectFunctions(script, functions);
+    if (functions.size() != program.count) {
+        std::cerr << "Compiled program does not match its source." << std::endl;
+        return false;
+    }
+
+    for (size_t i = 0; i < functions.size(); i++) {
+        program.functions[i] = functions[i];
+        functions[i]->aotBody = program.bodies[i];
+    }
+    return true;
+}
+
+bool AotRuntime::run(VM* vm, int baseFrame) {
+    while (vm->frameCount > baseFrame) {
+        CallFrame* frame = &vm->frames[vm->frameCount - 1];
+        AotBody body = frame->closure->function->aotBody;
+
+        if (body == nullptr) {
+            if (vm->run(vm->frameCount - 1) != InterpretResult::ok) return false;
+        } else if (body(vm, frame) == AotStatus::error) {
+            return false;
+        }
+    }
+    return true;
+}
+
+AotStatus AotRuntime::error(VM* vm, CallFrame* frame, uint8_t* ip, const char* message) {
+    frame->ip = ip;
+    vm->runtimeError(message);
+    return AotStatus::error;
+}
+
+AotStatus AotRuntime::undefinedVariable(VM* vm, CallFrame* frame, uint8_t* ip, int slot) {
+    frame->ip = ip;
+    vm->runtimeError("Undefined variable '" + vm->globals.names[slot]->chars + "'.");
+    return AotStatus::error;
+}
+
+bool AotRuntime::call(VM* vm, Value* sp, int argCount) {
+    vm->stackTop = sp;
+    int frameCount = vm->frameCount;
+    if (!vm->callValue(sp[-argCount - 1], argCount)) return false;
+    return vm->frameCount == frameCount || run(vm, frameCount);
+}
+
+AotStatus AotRuntime::tailCall(VM* vm, CallFrame* frame, Value* sp, int argCount) {
+    Value callee = sp[-argCount - 1];
+    if (!callee.isObjectType(ObjectType::Closure) || callee.getClosure()->function->arity != argCount) {
+        return call(vm, sp, argCount) ? AotStatus::returned : AotStatus::error;
+    }
+
+    closeUpvalues(vm, frame->slots);
+    std::copy(sp - argCount - 1, sp, frame->slots);
+    frame->closure = callee.getClosure();
+    frame->ip = frame->closure->function->chunk.code.data();
+    vm->stackTop = frame->slots + argCount + 1;
+    return AotStatus::tailCall;
+}
+
+bool AotRuntime::invoke(VM* vm, Value* sp, String* name, int argCount, InlineCache* cache) {
+    vm->stackTop = sp;
+    int frameCount = vm->frameCount;
+    Value receiver = sp[-argCount - 1];
+
+    bool called = false;
+    InlineCacheEntry* hit = nullptr;
+    if (receiver.isObjectType(ObjectType::Instance)) {
+        Instance* instance = receiver.getInstance();
+        for (int i = 0; i < cache->count; i++) {
+            InlineCacheEntry& entry = cache->entries[i];
+            if (entry.shape == instance->shape && entry.klass == instance->klass) {
+                hit = &entry;
+                break;
+            }
+        }
+
+        if (hit != nullptr && hit->method != nullptr) {
+            called = vm->call(hit->method, argCount);
+        } else if (hit != nullptr) {
+            Value value = instance->fields[hit->slot];
+            sp[-argCount - 1] = value;
+            called = vm->callValue(value, argCount);
+        } else {
+            vm->cacheLookup(cache, instance, name);
+        }
+    }
+    if (hit == nullptr) called = vm->invoke(receiver, name, argCount);
+
+    if (!called) return false;
+    return vm->frameCount == frameCount || run(vm, frameCount);
+}
+
+bool AotRuntime::invokeByKey(VM* vm, Value* sp, int argCount) {
+    vm->stackTop = sp;
+    int frameCount = vm->frameCount;
+    Value receiver = sp[-argCount - 2];
+    Value key = sp[-argCount - 1];
+
+    if (receiver.isObjectType(ObjectType::Array)) {
+        size_t index;
+        if (!vm->arrayIndex(receiver.getArray(), key, index)) return false;
+
+        Value element = receiver.getArray()->values[index];
+        std::copy(sp - argCount, sp, sp - argCount - 1);
+        vm->stackTop = sp - 1;
+        sp[-argCount - 2] = element;
+        if (!vm->callValue(element, argCount)) return false;
+        return vm->frameCount == frameCount || run(vm, frameCount);
+    }
+
+    String* name;
+    if (key.isNumber()) {
+        name = vm->garbageCollector.newString(key.stringify());
+    } else if (key.isObjectType(ObjectType::String)) {
+        name = key.getString();
+    } else {
+        vm->runtimeError("A key must be a number or a string.");
+        return false;
+    }
+
+    std::copy(sp - argCount, sp, sp - argCount - 1);
+    vm->stackTop = sp - 1;
+    if (!vm->invoke(receiver, name, argCount)) return false;
+    return vm->frameCount == frameCount || run(vm, frameCount);
+}
+
+bool AotRuntime::add(VM* vm, Value* sp) {
+    vm->stackTop = sp;
+    Value a = sp[-2];
+    Value b = sp[-1];
+    if (!a.isObjectType(ObjectType::String) || !b.isObjectType(ObjectType::String)) {
+        vm->runtimeError("Operands must be two numbers or two strings.");
+        return false;
+    }
+
+    String* result = vm->garbageCollector.newString(a.getString()->chars + b.getString()->chars);
+    if (vm->garbageCollector.outOfMemory) {
+        vm->runtimeError("Out of memory.");
+        return false;
+    }
+    sp[-2] = Value(result);
+    return true;
+}
+
+bool AotRuntime::getProperty(VM* vm, Value* sp, String* name, InlineCache* cache) {
+    vm->stackTop = sp;
+    if (!sp[-1].isObjectType(ObjectType::Instance)) {
+        vm->runtimeError("Only instances have properties.");
+        return false;
+    }
+
+    Instance* instance = sp[-1].getInstance();
+    for (int i = 0; i < cache->count; i++) {
+        InlineCacheEntry& entry = cache->entries[i];
+        if (entry.shape != instance->shape || entry.klass != instance->klass) continue;
+
+        if (entry.method == nullptr) {
+            sp[-1] = instance->fields[entry.slot];
+        } else {
+            sp[-1] = Value(vm->garbageCollector.newBoundMethod(sp[-1], entry.method));
+        }
+        return true;
+    }
+    vm->cacheLookup(cache, instance, name);
+
+    Value value;
+    if (vm->getField(instance, name, value)) {
+        sp[-1] = value;
+        return true;
+    }
+    return vm->bindMethod(instance->klass, name);
+}
+
+bool AotRuntime::setProperty(VM* vm, Value* sp, String* name, InlineCache* cache) {
+    vm->stackTop = sp;
+    if (!sp[-2].isObjectType(ObjectType::Instance)) {
+        vm->runtimeError("Only instances have fields.");
+        return false;
+    }
+
+    Instance* instance = sp[-2].getInstance();
+    Value value = sp[-1];
+    vm->garbageCollector.beforeWrite(&instance->object);
+    vm->garbageCollector.writeBarrier(&instance->object, value);
+
+    for (int i = 0; i < cache->count; i++) {
+        InlineCacheEntry& entry = cache->entries[i];
+        if (entry.shape != instance->shape || entry.klass != instance->klass) continue;
+
+        if (entry.transition == nullptr) {
+            instance->fields[entry.slot] = value;
+        } else {
+            instance->shape = entry.transition;
+            instance->fields.push_back(value);
+        }
+        sp[-2] = value;
+        return true;
+    }
+
+    Shape* shape = instance->shape;
+    vm->setField(instance, name, value);
+    sp[-2] = value;
+    if (shape != nullptr && instance->shape != nullptr) {
+        if (shape == instance->shape) {
+            vm->updateCache(cache, { shape, instance->klass, nullptr, nullptr, shape->slots[name] });
+        } else {
+            vm->updateCache(cache, { shape, instance->klass, instance->shape, nullptr, (uint32_t)instance->fields.size() - 1 });
+        }
+    }
+    return true;
+}
+
+bool AotRuntime::getPropertyByKey(VM* vm, Value* sp) {
+    vm->stackTop = sp;
+    if (sp[-2].isObjectType(ObjectType::Array)) {
+        Array* array = sp[-2].getArray();
+        size_t index;
+        if (!vm->arrayIndex(array, sp[-1], index)) return false;
+
+        sp[-2] = array->values[index];
+        return true;
+    }
+
+    if (!sp[-2].isObjectType(ObjectType::Instance)) {
+        vm->runtimeError("Only instances have properties.");
+        return false;
+    }
+
+    Instance* instance = sp[-2].getInstance();
+    String* name;
+    if (sp[-1].isNumber()) {
+        name = vm->garbageCollector.newString(sp[-1].stringify());
+    } else if (sp[-1].isObjectType(ObjectType::String)) {
+        name = sp[-1].getString();
+    } else {
+        vm->runtimeError("A key must be a number or a string.");
+        return false;
+    }
+
+    Value value;
+    if (vm->getField(instance, name, value)) {
+        sp[-2] = value;
+        return true;
+    }
+
+    vm->stackTop = sp - 1;
+    return vm->bindMethod(instance->klass, name);
+}
+
+bool AotRuntime::setPropertyByKey(VM* vm, Value* sp) {
+    vm->stackTop = sp;
+    if (sp[-3].isObjectType(ObjectType::Array)) {
+        Array* array = sp[-3].getArray();
+        size_t index;
+        if (!vm->arrayIndex(array, sp[-2], index, true)) return false;
+
+        vm->garbageCollector.beforeWrite(&array->object);
+        if (index == array->values.size()) {
+            array->values.push_back(sp[-1]);
+        } else {
+            array->values[index] = sp[-1];
+        }
+        vm->garbageCollector.writeBarrier(&array->object, sp[-1]);
+        sp[-3] = sp[-1];
+        return true;
+    }
+
+    if (!sp[-3].isObjectType(ObjectType::Instance)) {
+        vm->runtimeError("Only instances have fields.");
+        return false;
+    }
+
+    Instance* instance = sp[-3].getInstance();
+    String* name;
+    if (sp[-2].isNumber()) {
+        name = vm->garbageCollector.newString(sp[-2].stringify());
+        if (instance->klass == nullptr && instance->dictionary == nullptr) {
+            vm->makeDictionary(instance);
+        }
+    } else if (sp[-2].isObjectType(ObjectType::String)) {
+        name = sp[-2].getString();
+    } else {
+        vm->runtimeError("A key must be a number or a string.");
+        return false;
+    }
+
+    vm->setField(instance, name, sp[-1]);
+    sp[-3] = sp[-1];
+    return true;
+}
+
+void AotRuntime::closure(VM* vm, CallFrame* frame, Value* sp, Function* function, const uint8_t* upvalues) {
+    vm->stackTop = sp;
+    Closure* closure = vm->garbageCollector.newClosure(function);
+    vm->push(Value(closure));
+    for (int i = 0; i < function->upvalueCount; i++) {
+        uint8_t isLocal = upvalues[2 * i];
+        uint8_t index = upvalues[2 * i + 1];
+        Upvalue* upvalue = isLocal ? vm->captureUpvalue(&frame->slots[index]) : frame->closure->upvalues[index];
+        vm->garbageCollector.beforeWrite(&closure->object);
+        closure->upvalues.push_back(upvalue);
+        vm->garbageCollector.writeBarrier(&closure->object, (Object*)upvalue);
+    }
+}
+
+void AotRuntime::newClass(VM* vm, Value* sp, String* name) {
+    vm->stackTop = sp;
+    *sp = Value(vm->garbageCollector.newClass(name->chars));
+}
+
+void AotRuntime::method(VM* vm, Value* sp, String* name) {
+    vm->stackTop = sp;
+    vm->defineMethod(name);
+}
+
+void AotRuntime::array(VM* vm, Value* sp, int itemCount) {
+    vm->stackTop = sp;
+    Array* array = vm->garbageCollector.newArray();
+    array->values.assign(sp - itemCount, sp);
+    sp[-itemCount] = Value(array);
+}
+
+void AotRuntime::map(VM* vm, Value* sp) {
+    vm->stackTop = sp;
+    *sp = Value(vm->garbageCollector.newInstance(nullptr));
+}
+
+void AotRuntime::key(VM* vm, Value* sp, String* name) {
+    vm->stackTop = sp;
+    vm->setField(sp[-2].getInstance(), name, sp[-1]);
+}
+
+void AotRuntime::print(Value value, bool newline) {
+    std::cout << value.stringify();
+    if (newline) std::cout << std::endl;
+}
+
+int runAot(const char* source, const AotProgram& program) {
+    if (!useHeapEnvironment()) return 64;
+
+    std::string chars = source;
+    switch (interpretAot(chars, program)) {
+    case InterpretResult::ok:
+        break;
+    case InterpretResult::compileError:
+        return 65;
+    case InterpretResult::runtimeError:
+        return 70;
+    }
+    return 0;
+}
+
+// Translates each function's bytecode into straight-line C++ over its frame
+// slots. The stack depth at every instruction is known statically, so operands
+// are addressed as fixed slots and jumps become gotos. A call whose callee is a
+// global bound to a single function declaration is made directly to that
+// function's translation, guarded by a check of the closure it finds.
+class CppEmitter {
+private:
+    std::ostream& out;
+    std::vector<Function*> functions;
+    std::unordered_map<Function*, int> indices;
+    // The function each global is declared as, or -2 when it is also bound some other way.
+    std::unordered_map<int, int> globalFunctions;
+
+    Function* function;
+    int index;
+    std::ostringstream body;
+    bool usesConstants;
+    bool usesCaches;
+    bool usesGlobals;
+    bool usesStart;
+    bool emitting;
+    // The function each stack slot is known to hold a closure of, or -1.
+    std::vector<int> callees;
+
+    static std::string slot(int n) {
+        return "slots[" + std::to_string(n) + "]";
+    }
+
+    std::string ip(size_t offset) {
+        return "code + " + std::to_string(offset);
+    }
+
+    std::string constant(int n) {
+        usesConstants = true;
+        return "k[" + std::to_string(n) + "]";
+    }
+
+    std::string name(int n) {
+        return constant(n) + ".getString()";
+    }
+
+    std::string cache(int n) {
+        usesCaches = true;
+        return "caches + " + std::to_string(n);
+    }
+
+    std::string number(int n) {
+        Value value = function->chunk.constants[n];
+        if (!value.isNumber() || !std::isfinite(value.getNumber())) return constant(n);
+
+        char literal[64];
+        std::snprintf(literal, sizeof(literal), "Value(%a)", value.getNumber());
+        return literal;
+    }
+
+    std::string label(size_t offset) {
+        return "L" + std::to_string(offset);
+    }
+
+    void line(const std::string& text) {
+        if (emitting) body << "    " << text << "\n";
+    }
+
+    void scanGlobals() {
+        for (size_t i = 0; i < functions.size(); i++) {
+            Chunk& chunk = functions[i]->chunk;
+            int declared = -1;
+            for (size_t offset = 0; offset < chunk.code.size(); offset += instructionLength(chunk, offset)) {
+                uint8_t* code = &chunk.code[offset];
+                int global = instructionLength(chunk, offset) == 3 ? (code[1] << 8) | code[2] : -1;
+                switch (code[0]) {
+                case OP_CLOSURE:
+                    declared = indices[chunk.constants[code[1]].getFunction()];
+                    continue;
+                case OP_DEFINE_GLOBAL:
+                    if (declared >= 0 && globalFunctions.count(global) == 0) {
+                        globalFunctions[global] = declared;
+                    } else {
+                        globalFunctions[global] = -2;
+                    }
+                    break;
+                case OP_SET_GLOBAL:
+                case OP_SET_GLOBAL_POP:
+                    globalFunctions[global] = -2;
+                    break;
+                }
+                declared = -1;
+            }
+        }
+    }
+
+    // The function a call at depth with argCount arguments can be made to directly.
+    int directCallee(int depth, int argCount) {
+        int callee = callees[depth - argCount - 1];
+        if (callee < 0 || functions[callee]->arity != argCount) return -1;
+        return callee;
+    }
+
+    // Tracks the closures pushed by the instruction at offset, which leaves
+    // after values on the stack.
+    void trackCallees(size_t offset, int depth, int after) {
+        Chunk& chunk = function->chunk;
+        std::fill(callees.begin() + std::max(after - 1, 0), callees.end(), -1);
+
+        uint8_t* code = &chunk.code[offset];
+        if (code[0] == OP_GET_GLOBAL) {
+            auto declared = globalFunctions.find((code[1] << 8) | code[2]);
+            if (declared != globalFunctions.end()) callees[depth] = declared->second;
+        } else if (code[0] == OP_GET_LOCAL && code[1] == 0) {
+            // Slot 0 holds the running closure; a function refers to itself through it.
+            callees[depth] = index;
+        }
+    }
+
+    void numberOperands(int a, int b, size_t next) {
+        line("if (!AotRuntime::numbers(" + slot(a) + ", " + slot(b) + ")) return AotRuntime::error(vm, frame, " + ip(next) + ", \"Operands must be numbers.\");");
+    }
+
+    void binary(int depth, const char* op, size_t next) {
+        numberOperands(depth - 2, depth - 1, next);
+        line(slot(depth - 2) + " = Value(" + slot(depth - 2) + ".getNumber() " + op + " " + slot(depth - 1) + ".getNumber());");
+    }
+
+    void compare(int depth, const std::string& condition, size_t target, size_t next) {
+        numberOperands(depth - 2, depth - 1, next);
+        line("if (" + condition + ") goto " + label(target) + ";");
+    }
+
+    std::string numbers(int depth, const char* op) {
+        return slot(depth - 2) + ".getNumber() " + op + " " + slot(depth - 1) + ".getNumber()";
+    }
+
+    void checked(const std::string& call, size_t next) {
+        line("frame->ip = " + ip(next) + ";");
+        line("if (!" + call + ") return AotStatus::error;");
+    }
+
+    // Emits the instruction at offset, entered with depth values on the frame,
+    // and returns the depth after it.
+    int emitInstruction(size_t offset, int depth) {
+        Chunk& chunk = function->chunk;
+        uint8_t* code = &chunk.code[offset];
+        size_t next = offset + instructionLength(chunk, offset);
+        int operand = next > offset + 1 ? code[1] : 0;
+        int wide = next > offset + 2 ? (code[1] << 8) | code[2] : 0;
+        int after;
+
+        switch (code[0]) {
+        case OP_CONSTANT:
+            line(slot(depth) + " = " + number(operand) + ";");
+            return depth + 1;
+        case OP_NIL: line(slot(depth) + " = Value();"); return depth + 1;
+        case OP_TRUE: line(slot(depth) + " = Value(true);"); return depth + 1;
+        case OP_FALSE: line(slot(depth) + " = Value(false);"); return depth + 1;
+        case OP_POP: return depth - 1;
+        case OP_GET_LOCAL:
+            line(slot(depth) + " = " + slot(operand) + ";");
+            return depth + 1;
+        case OP_SET_LOCAL:
+            line(slot(operand) + " = " + slot(depth - 1) + ";");
+            callees[operand] = -1;
+            return depth;
+        case OP_SET_LOCAL_POP:
+            line(slot(operand) + " = " + slot(depth - 1) + ";");
+            callees[operand] = -1;
+            return depth - 1;
+        case OP_GET_GLOBAL:
+            usesGlobals = true;
+            line("if (globals[" + std::to_string(wide) + "].isUndefined()) return AotRuntime::undefinedVariable(vm, frame, " + ip(next) + ", " + std::to_string(wide) + ");");
+            line(slot(depth) + " = globals[" + std::to_string(wide) + "];");
+            return depth + 1;
+        case OP_DEFINE_GLOBAL:
+            usesGlobals = true;
+            line("globals[" + std::to_string(wide) + "] = " + slot(depth - 1) + ";");
+            return depth - 1;
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_POP:
+            usesGlobals = true;
+            line("if (globals[" + std::to_string(wide) + "].isUndefined()) return AotRuntime::undefinedVariable(vm, frame, " + ip(next) + ", " + std::to_string(wide) + ");");
+            line("globals[" + std::to_string(wide) + "] = " + slot(depth - 1) + ";");
+            return code[0] == OP_SET_GLOBAL ? depth : depth - 1;
+        case OP_GET_UPVALUE:
+            line(slot(depth) + " = *frame->closure->upvalues[" + std::to_string(operand) + "]->location;");
+            return depth + 1;
+        case OP_SET_UPVALUE:
+            line("AotRuntime::setUpvalue(vm, frame->closure->upvalues[" + std::to_string(operand) + "], " + slot(depth - 1) + ");");
+            return depth;
+        case OP_GET_PROPERTY:
+            checked("AotRuntime::getProperty(vm, slots + " + std::to_string(depth) + ", " + name(operand) + ", " + cache((code[2] << 8) | code[3]) + ")", next);
+            return depth;
+        case OP_SET_PROPERTY:
+            checked("AotRuntime::setProperty(vm, slots + " + std::to_string(depth) + ", " + name(operand) + ", " + cache((code[2] << 8) | code[3]) + ")", next);
+            return depth - 1;
+        case OP_GET_PROPERTY_BY_KEY:
+            checked("AotRuntime::getPropertyByKey(vm, slots + " + std::to_string(depth) + ")", next);
+            return depth - 1;
+        case OP_SET_PROPERTY_BY_KEY:
+            checked("AotRuntime::setPropertyByKey(vm, slots + " + std::to_string(depth) + ")", next);
+            return depth - 2;
+        case OP_EQUAL:
+        case OP_EQUAL_NUM:
+            line(slot(depth - 2) + " = Value(AotRuntime::equal(" + slot(depth - 2) + ", " + slot(depth - 1) + "));");
+            return depth - 1;
+        case OP_NOT_EQUAL:
+            line(slot(depth - 2) + " = Value(!AotRuntime::equal(" + slot(depth - 2) + ", " + slot(depth - 1) + "));");
+            return depth - 1;
+        case OP_GREATER: binary(depth, ">", next); return depth - 1;
+        case OP_LESS: binary(depth, "<", next); return depth - 1;
+        case OP_SUBTRACT: binary(depth, "-", next); return depth - 1;
+        case OP_MULTIPLY: binary(depth, "*", next); return depth - 1;
+        case OP_DIVIDE: binary(depth, "/", next); return depth - 1;
+        case OP_GREATER_EQUAL:
+            numberOperands(depth - 2, depth - 1, next);
+            line(slot(depth - 2) + " = Value(!(" + numbers(depth, "<") + "));");
+            return depth - 1;
+        case OP_LESS_EQUAL:
+            numberOperands(depth - 2, depth - 1, next);
+            line(slot(depth - 2) + " = Value(!(" + numbers(depth, ">") + "));");
+            return depth - 1;
+        case OP_REMAIN:
+            numberOperands(depth - 2, depth - 1, next);
+            line(slot(depth - 2) + " = Value(std::fmod(" + slot(depth - 2) + ".getNumber(), " + slot(depth - 1) + ".getNumber()));");
+            return depth - 1;
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+            line("if (AotRuntime::numbers(" + slot(depth - 2) + ", " + slot(depth - 1) + ")) {");
+            line("    " + slot(depth - 2) + " = Value(" + numbers(depth, "+") + ");");
+            line("} else {");
+            line("    frame->ip = " + ip(next) + ";");
+            line("    if (!AotRuntime::add(vm, slots + " + std::to_string(depth) + ")) return AotStatus::error;");
+            line("}");
+            return depth - 1;
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_SUBTRACT_LOCAL_CONSTANT: {
+            bool add = code[0] == OP_ADD_LOCAL_CONSTANT;
+            std::string message = add ? "Operands must be two numbers or two strings." : "Operands must be numbers.";
+            line("if (!" + slot(operand) + ".isNumber()) return AotRuntime::error(vm, frame, " + ip(next) + ", \"" + message + "\");");
+            line(slot(depth) + " = Value(" + slot(operand) + ".getNumber() " + (add ? "+" : "-") + " " + number(code[2]) + ".getNumber());");
+            return depth + 1;
+        }
+        case OP_NOT:
+            line(slot(depth - 1) + " = Value(AotRuntime::isFalsey(" + slot(depth - 1) + "));");
+            return depth;
+        case OP_NEGATE:
+            line("if (!" + slot(depth - 1) + ".isNumber()) return AotRuntime::error(vm, frame, " + ip(next) + ", \"Operand must be a number.\");");
+            line(slot(depth - 1) + " = Value(-" + slot(depth - 1) + ".getNumber());");
+            return depth;
+        case OP_PRINT:
+        case OP_PRINTL:
+            line("AotRuntime::print(" + slot(depth - 1) + ", " + (code[0] == OP_PRINTL ? "true" : "false") + ");");
+            return depth - 1;
+        case OP_JUMP:
+            line("goto " + label(next + wide) + ";");
+            return -1;
+        case OP_LOOP:
+            line("if (AotRuntime::outOfMemory(vm)) return AotRuntime::error(vm, frame, " + ip(next) + ", \"Out of memory.\");");
+            line("goto " + label(next - wide) + ";");
+            return -1;
+        case OP_JUMP_IF_FALSE:
+            line("if (AotRuntime::isFalsey(" + slot(depth - 1) + ")) goto " + label(next + wide) + ";");
+            return depth;
+        case OP_POP_JUMP_IF_FALSE:
+            line("if (AotRuntime::isFalsey(" + slot(depth - 1) + ")) goto " + label(next + wide) + ";");
+            return depth - 1;
+        case OP_JUMP_IF_EQUAL:
+            line("if (AotRuntime::equal(" + slot(depth - 2) + ", " + slot(depth - 1) + ")) goto " + label(next + wide) + ";");
+            return depth - 2;
+        case OP_JUMP_IF_NOT_EQUAL:
+            line("if (!AotRuntime::equal(" + slot(depth - 2) + ", " + slot(depth - 1) + ")) goto " + label(next + wide) + ";");
+            return depth - 2;
+        case OP_JUMP_IF_LESS: compare(depth, numbers(depth, "<"), next + wide, next); return depth - 2;
+        case OP_JUMP_IF_NOT_LESS: compare(depth, "!(" + numbers(depth, "<") + ")", next + wide, next); return depth - 2;
+        case OP_JUMP_IF_GREATER: compare(depth, numbers(depth, ">"), next + wide, next); return depth - 2;
+        case OP_JUMP_IF_NOT_GREATER: compare(depth, "!(" + numbers(depth, ">") + ")", next + wide, next); return depth - 2;
+        case OP_CALL: {
+            int callee = directCallee(depth, operand);
+            after = depth - operand;
+            line("frame->ip = " + ip(next) + ";");
+            if (callee < 0) {
+                line("if (!AotRuntime::call(vm, slots + " + std::to_string(depth) + ", " + std::to_string(operand) + ")) return AotStatus::error;");
+                return after;
+            }
+            line("if (CallFrame* callee = AotRuntime::enter(vm, slots + " + std::to_string(after - 1) + ", " + std::to_string(operand) + ", functions[" + std::to_string(callee) + "])) {");
+            line("    if (!AotRuntime::finish(vm, frame, f" + std::to_string(callee) + "(vm, callee))) return AotStatus::error;");
+            line("} else if (!AotRuntime::call(vm, slots + " + std::to_string(depth) + ", " + std::to_string(operand) + ")) {");
+            line("    return AotStatus::error;");
+            line("}");
+            return after;
+        }
+        case OP_TAIL_CALL: {
+            int callee = directCallee(depth, operand);
+            after = depth - operand;
+            line("if (AotRuntime::outOfMemory(vm)) return AotRuntime::error(vm, frame, " + ip(next) + ", \"Out of memory.\");");
+            if (callee == index) {
+                // A call to itself restarts the body in the same frame.
+                usesStart = true;
+                line("if (AotRuntime::isClosureOf(" + slot(after - 1) + ", functions[" + std::to_string(index) + "])) {");
+                line("    AotRuntime::closeUpvalues(vm, slots);");
+                for (int i = 0; i <= operand; i++) {
+                    line("    " + slot(i) + " = " + slot(after - 1 + i) + ";");
+                }
+                line("    frame->closure = slots[0].getClosure();");
+                line("    goto start;");
+                line("}");
+            }
+            line("frame->ip = " + ip(next) + ";");
+            line("if (AotStatus status = AotRuntime::tailCall(vm, frame, slots + " + std::to_string(depth) + ", " + std::to_string(operand) + "); status != AotStatus::returned) return status;");
+            return after;
+        }
+        case OP_INVOKE:
+            checked("AotRuntime::invoke(vm, slots + " + std::to_string(depth) + ", " + name(operand) + ", " + std::to_string(code[2]) + ", " + cache((code[3] << 8) | code[4]) + ")", next);
+            return depth - code[2];
+        case OP_INVOKE_BY_KEY:
+            checked("AotRuntime::invokeByKey(vm, slots + " + std::to_string(depth) + ", " + std::to_string(operand) + ")", next);
+            return depth - operand - 1;
+        case OP_CLOSURE:
+            line("frame->ip = " + ip(next) + ";");
+            line("AotRuntime::closure(vm, frame, slots + " + std::to_string(depth) + ", " + constant(operand) + ".getFunction(), " + ip(offset + 2) + ");");
+            return depth + 1;
+        case OP_CLOSE_UPVALUE:
+            line("AotRuntime::closeUpvalues(vm, slots + " + std::to_string(depth - 1) + ");");
+            return depth - 1;
+        case OP_RETURN:
+            line("return AotRuntime::ret(vm, frame, " + slot(depth - 1) + ");");
+            return -1;
+        case OP_CLASS:
+            line("frame->ip = " + ip(next) + ";");
+            line("AotRuntime::newClass(vm, slots + " + std::to_string(depth) + ", " + name(operand) + ");");
+            return depth + 1;
+        case OP_METHOD:
+            line("AotRuntime::method(vm, slots + " + std::to_string(depth) + ", " + name(operand) + ");");
+            return depth - 1;
+        case OP_ARRAY:
+            line("frame->ip = " + ip(next) + ";");
+            line("AotRuntime::array(vm, slots + " + std::to_string(depth) + ", " + std::to_string(operand) + ");");
+            return depth - operand + 1;
+        case OP_MAP:
+            line("frame->ip = " + ip(next) + ";");
+            line("AotRuntime::map(vm, slots + " + std::to_string(depth) + ");");
+            return depth + 1;
+        case OP_KEY:
+            line("AotRuntime::key(vm, slots + " + std::to_string(depth) + ", " + name(operand) + ");");
+            return depth - 1;
+        }
+        return -1;
+    }
+
+    // Jump targets of the instruction at offset.
+    std::vector<size_t> targets(size_t offset) {
+        Chunk& chunk = function->chunk;
+        uint8_t* code = &chunk.code[offset];
+        size_t next = offset + instructionLength(chunk, offset);
+        int wide = next > offset + 2 ? (code[1] << 8) | code[2] : 0;
+
+        switch (code[0]) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_NOT_GREATER:
+            return { next + wide };
+        case OP_LOOP:
+            return { next - wide };
+        default:
+            return {};
+        }
+    }
+
+    void emitFunction() {
+        Chunk& chunk = function->chunk;
+        std::vector<int> depths(chunk.code.size(), -1);
+        std::vector<bool> isTarget(chunk.code.size(), false);
+
+        // Propagate stack depths; the bytecode compiler keeps them consistent
+        // at every join, so the first depth that reaches an offset is its depth.
+        std::vector<size_t> work = { 0 };
+        depths[0] = function->arity + 1;
+        emitting = false;
+        callees.assign(FRAME_SLOTS + 1, -1);
+        while (!work.empty()) {
+            size_t offset = work.back();
+            work.pop_back();
+            int after = emitInstruction(offset, depths[offset]);
+
+            size_t next = offset + instructionLength(chunk, offset);
+            if (after >= 0 && next < chunk.code.size() && depths[next] < 0) {
+                depths[next] = after;
+                work.push_back(next);
+            }
+            for (size_t target : targets(offset)) {
+                isTarget[target] = true;
+                if (depths[target] < 0) {
+                    depths[target] = after >= 0 ? after : depths[offset];
+                    work.push_back(target);
+                }
+            }
+        }
+
+        body.str("");
+        usesConstants = usesCaches = usesGlobals = usesStart = false;
+        emitting = true;
+        callees.assign(FRAME_SLOTS + 1, -1);
+        for (size_t offset = 0; offset < chunk.code.size(); offset += instructionLength(chunk, offset)) {
+            if (depths[offset] < 0) continue;
+            if (isTarget[offset]) {
+                body << label(offset) << ":\n";
+                callees.assign(FRAME_SLOTS + 1, -1);
+            }
+
+            int depth = depths[offset];
+            int after = emitInstruction(offset, depth);
+            if (after >= 0) trackCallees(offset, depth, after);
+        }
+
+        out << "// " << (function->name == "" ? "script" : function->name) << "\n";
+        out << "static AotStatus f" << index << "(VM* vm, CallFrame* frame) {\n";
+        out << "    Value* slots = frame->slots;\n";
+        out << "    uint8_t* code = frame->closure->function->chunk.code.data();\n";
+        if (usesConstants) out << "    Value* k = frame->closure->function->chunk.constants.data();\n";
+        if (usesCaches) out << "    InlineCache* caches = frame->closure->function->chunk.caches.data();\n";
+        if (usesGlobals) out << "    Value* globals = AotRuntime::globals(vm);\n";
+        out << "    (void)code;\n";
+        if (usesStart) out << "start:\n";
+        out << body.str();
+        out << "}\n\n";
+    }
+
+public:
+    CppEmitter(Function* script, std::ostream& out) : out(out) {
+        collectFunctions(script, functions);
+        for (size_t i = 0; i < functions.size(); i++) indices[functions[i]] = (int)i;
+        scanGlobals();
+    }
+
+    void emit(const std::string& source) {
+        out << "// Generated by p++ --emit-cpp. Build it together with the runtime\n";
+        out << "// (every file in src/ except main.cpp), e.g.\n";
+        out << "//   g++ -O2 -Isrc -o program program.cpp $(ls src/*.cpp | grep -v main.cpp)\n";
+        out << "#include \"aot.h\"\n\n";
+
+        out << "static const char source[] =\n    \"";
+        for (char c : source) {
+            switch (c) {
+            case '\\': out << "\\\\"; break;
+            case '"': out << "\\\""; break;
+            // Escaped so that "??=" and the like can't be read as trigraphs.
+            case '?': out << "\\?"; break;
+            case '\t': out << "\\t"; break;
+            case '\r': out << "\\r"; break;
+            case '\n': out << "\\n\"\n    \""; break;
+            default:
+                if ((unsigned char)c < 0x20) {
+                    char escaped[8];
+                    std::snprintf(escaped, sizeof(escaped), "\\%03o", (unsigned char)c);
+                    out << escaped;
+                } else {
+                    out << c;
+                }
+            }
+        }
+        out << "\";\n\n";
+
+        out << "static Function* functions[" << functions.size() << "];\n\n";
+        for (size_t i = 0; i < functions.size(); i++) {
+            out << "static AotStatus f" << i << "(VM* vm, CallFrame* frame);\n";
+        }
+        out << "\n";
+
+        for (size_t i = 0; i < functions.size(); i++) {
+            function = functions[i];
+            index = (int)i;
+            emitFunction();
+        }
+
+        out << "static const AotBody bodies[] = {\n";
+        for (size_t i = 0; i < functions.size(); i++) {
+            out << "    f" << i << ",\n";
+        }
+        out << "};\n\n";
+
+        out << "int main() {\n";
+        out << "    return runAot(source, { bodies, functions, " << functions.size() << " });\n";
+        out << "}\n";
+    }
+};
+
+void writeCpp(Function* script, const std::string& source, std::ostream& out) {
+    CppEmitter emitter(script, out);
+    emitter.emit(source);
+}
@@ -0,0 +1,134 @@
+#ifndef aot_h
+#define aot_h
+
+#include <ostream>
+#include <cmath>
+#include "vm.h"
+
+// p++ --emit-cpp writes a C++ translation unit with one function per p++
+// function. The unit embeds the script's source; at startup the runtime
+// compiles it again, so constants, globals and inline caches are laid out
+// exactly as the generated code expects, and attaches the translated bodies to
+// the compiled functions. Translated code keeps the VM's stack layout, so the
+// collector, runtime errors and natives work on it unchanged.
+
+enum class AotStatus {
+    // The frame returned and its result is on the stack.
+    returned,
+    // A tail call reused the frame for another closure, which the caller runs.
+    tailCall,
+    error
+};
+
+struct AotProgram {
+    const AotBody* bodies;
+    Function** functions;
+    size_t count;
+};
+
+bool valuesEqual(Value a, Value b);
+
+// Writes the C++ translation of a compiled script.
+void writeCpp(Function* script, const std::string& source, std::ostream& out);
+// Entry point of a generated program; returns the same exit codes as p++.
+int runAot(const char* source, const AotProgram& program);
+
+// Helpers called by generated code. Those that take sp store it as the VM's
+// stack top first, so everything below it is a root while they allocate.
+class AotRuntime {
+public:
+    static bool install(Function* script, const AotProgram& program);
+    // Runs the frames above baseFrame until they have returned.
+    static bool run(VM* vm, int baseFrame);
+
+    static Value* globals(VM* vm) {
+        return vm->globals.values.data();
+    }
+
+    static bool numbers(Value a, Value b) {
+        return a.isNumber() && b.isNumber();
+    }
+
+    static bool isFalsey(Value value) {
+        return value.isNil() || (value.isBoolean() && !value.getBoolean());
+    }
+
+    static bool equal(Value a, Value b) {
+        if (numbers(a, b)) return a.getNumber() == b.getNumber();
+        return valuesEqual(a, b);
+    }
+
+    // Pushes a frame for a call the generated code has resolved to function,
+    // or returns nullptr so it falls back to a generic call.
+    static CallFrame* enter(VM* vm, Value* callee, int argCount, Function* function) {
+        if (!callee->isObjectType(ObjectType::Closure) || callee->getClosure()->function != function) return nullptr;
+        if (vm->frameCount == FRAMES_MAX || callee + argCount + 1 + FRAME_SLOTS > vm->stack + STACK_MAX) return nullptr;
+        if (vm->garbageCollector.outOfMemory) return nullptr;
+
+        CallFrame* frame = &vm->frames[vm->frameCount++];
+        frame->closure = callee->getClosure();
+        frame->ip = function->chunk.code.data();
+        frame->slots = callee;
+        frame->pc = nullptr;
+        vm->stackTop = callee + argCount + 1;
+        return frame;
+    }
+
+    // Completes a call made through enter once the callee's body has returned.
+    static bool finish(VM* vm, CallFrame* caller, AotStatus status) {
+        if (status == AotStatus::returned) return true;
+        if (status == AotStatus::error) return false;
+        return run(vm, (int)(caller - vm->frames) + 1);
+    }
+
+    // Checked on loop back edges, which otherwise never reach the VM.
+    static bool outOfMemory(VM* vm) {
+        return vm->garbageCollector.outOfMemory;
+    }
+
+    static bool isClosureOf(Value callee, Function* function) {
+        return callee.isObjectType(ObjectType::Closure) && callee.getClosure()->function == function;
+    }
+
+    static void closeUpvalues(VM* vm, Value* last) {
+        if (vm->openUpvalues != nullptr) vm->closeUpvalues(last);
+    }
+
+    static void setUpvalue(VM* vm, Upvalue* upvalue, Value value) {
+        vm->garbageCollector.beforeWrite(&upvalue->object);
+        *upvalue->location = value;
+        vm->garbageCollector.writeBarrier(&upvalue->object, value);
+    }
+
+    static AotStatus ret(VM* vm, CallFrame* frame, Value result) {
+        closeUpvalues(vm, frame->slots);
+        vm->frameCount--;
+        vm->stackTop = frame->slots;
+        if (vm->frameCount > 0) vm->push(result);
+        return AotStatus::returned;
+    }
+
+    static AotStatus error(VM* vm, CallFrame* frame, uint8_t* ip, const char* message);
+    static AotStatus undefinedVariable(VM* vm, CallFrame* frame, uint8_t* ip, int slot);
+
+    static bool call(VM* vm, Value* sp, int argCount);
+    // Returns tailCall when the frame now belongs to the callee, or returned
+    // once a callee that can't reuse it has been called normally.
+    static AotStatus tailCall(VM* vm, CallFrame* frame, Value* sp, int argCount);
+    static bool invoke(VM* vm, Value* sp, String* name, int argCount, InlineCache* cache);
+    static bool invokeByKey(VM* vm, Value* sp, int argCount);
+    static bool add(VM* vm, Value* sp);
+    static bool getProperty(VM* vm, Value* sp, String* name, InlineCache* cache);
+    static bool setProperty(VM* vm, Value* sp, String* name, InlineCache* cache);
+    static bool getPropertyByKey(VM* vm, Value* sp);
+    static bool setPropertyByKey(VM* vm, Value* sp);
+    static void closure(VM* vm, CallFrame* frame, Value* sp, Function* function, const uint8_t* upvalues);
+    static void newClass(VM* vm, Value* sp, String* name);
+    static void method(VM* vm, Value* sp, String* name);
+    static void array(VM* vm, Value* sp, int itemCount);
+    static void map(VM* vm, Value* sp);
+    static void key(VM* vm, Value* sp, String* name);
+    static void print(Value value, bool newline);
+};
+
+#endif
@@ -1,10 +1,28 @@
 #include "compiler.h"
 #include "value.h"
+#include "optimizer.h"
 #include <iostream>
 #include <sstream>
+#include <cmath>
+#include <unordered_map>
 
 const std::string THIS = "this";
 
+static bool isFalsey(Value value) {
+    return value.isNil() || (value.isBoolean() && !value.getBoolean());
+}
+
+static bool sameConstant(Value a, Value b) {
+    if (a.isNumber() && b.isNumber()) {
+        double x = a.getNumber();
+        double y = b.getNumber();
+        return std::memcmp(&x, &y, sizeof(double)) == 0;
+    }
+    if (a.isBoolean() && b.isBoolean()) return a.getBoolean() == b.getBoolean();
+    if (a.isNil() && b.isNil()) return true;
+    return a.isObjectType(ObjectType::String) && b.isObjectType(ObjectType::String) && a.getString() == b.getString();
+}
+
 Local::Local(Token name, int depth) : name(name), depth(depth) {}
 
 OpenUpvalue::OpenUpvalue(bool isLocal, uint8_t index) : isLocal(isLocal), index(index) {};
@@ -134,6 +152,11 @@ private:
         emitByte(byte2);
     }
 
+    void emitShort(uint16_t value) {
+        emitByte((value >> 8) & 0xff);
+        emitByte(value & 0xff);
+    }
+
     void emitLoop(int loopStart) {
         emitByte(OP_LOOP);
 
@@ -155,8 +178,109 @@ private:
         emitBytes(OP_CONSTANT, makeConstant(value));
     }
 
+    void emitLiteral(Value value) {
+        size_t start = getChunk().code.size();
+        if (value.isNil()) {
+            emitByte(OP_NIL);
+        } else if (value.isBoolean()) {
+            emitByte(value.getBoolean() ? OP_TRUE : OP_FALSE);
+        } else {
+            emitConstant(value);
+        }
+        compiler->literals.push_back({ start, getChunk().code.size(), value });
+    }
+
+    bool popLiterals(int count, Value* values) {
+        std::vector<Literal>& literals = compiler->literals;
+        if ((int)literals.size() < count) return false;
+
+        size_t end = getChunk().code.size();
+        for (int i = 0; i < count; i++) {
+            Literal& literal = literals[literals.size() - 1 - i];
+            if (literal.end != end) return false;
+            end = literal.start;
+        }
+        if (compiler->lastJumpTarget > end) return false;
+
+        for (int i = count - 1; i >= 0; i--) {
+            values[i] = literals.back().value;
+            literals.pop_back();
+        }
+        truncate(end);
+        return true;
+    }
+
+    void truncate(size_t size) {
+        getChunk().code.resize(size);
+        getChunk().lines.resize(size);
+
+        std::vector<Literal>& literals = compiler->literals;
+        while (!literals.empty() && literals.back().end > size) {
+            literals.pop_back();
+        }
+        if (compiler->lastJumpTarget > size) compiler->lastJumpTarget = size;
+        if (compiler->lastCall >= (int)size) compiler->lastCall = -1;
+    }
+
+    void deadStatement() {
+        size_t start = getChunk().code.size();
+        statement();
+        truncate(start);
+    }
+
+    bool foldUnary(TokenType operatorType, Value a, Value& result) {
+        switch (operatorType) {
+        case TOKEN_BANG: result = Value(isFalsey(a)); return true;
+        case TOKEN_MINUS:
+            if (!a.isNumber()) return false;
+            result = Value(-a.getNumber());
+            return true;
+        default: return false;
+        }
+    }
+
+    bool foldBinary(TokenType operatorType, Value a, Value b, Value& result) {
+        if (operatorType == TOKEN_EQUAL_EQUAL || operatorType == TOKEN_BANG_EQUAL) {
+            bool equal;
+            if (a.isNumber() && b.isNumber()) {
+                equal = a.getNumber() == b.getNumber();
+            } else if (a.isBoolean() && b.isBoolean()) {
+                equal = a.getBoolean() == b.getBoolean();
+            } else if (a.isObjectType(ObjectType::String) && b.isObjectType(ObjectType::String)) {
+                equal = a.getString() == b.getString();
+            } else {
+                equal = a.isNil() && b.isNil();
+            }
+            result = Value(operatorType == TOKEN_EQUAL_EQUAL ? equal : !equal);
+            return true;
+        }
+
+        if (operatorType == TOKEN_PLUS && a.isObjectType(ObjectType::String) && b.isObjectType(ObjectType::String)) {
+            result = Value(compiler->garbageCollector->newString(a.getString()->chars + b.getString()->chars));
+            return true;
+        }
+
+        if (!a.isNumber() || !b.isNumber()) return false;
+        double x = a.getNumber();
+        double y = b.getNumber();
+
+        switch (operatorType) {
+        case TOKEN_GREATER: result = Value(x > y); return true;
+        case TOKEN_GREATER_EQUAL: result = Value(!(x < y)); return true;
+        case TOKEN_LESS: result = Value(x < y); return true;
+        case TOKEN_LESS_EQUAL: result = Value(!(x > y)); return true;
+        case TOKEN_PLUS: result = Value(x + y); return true;
+        case TOKEN_MINUS: result = Value(x - y); return true;
+        case TOKEN_STAR: result = Value(x * y); return true;
+        case TOKEN_SLASH: result = Value(x / y); return true;
+        case TOKEN_PERCENT: result = Value(std::fmod(x, y)); return true;
+        default: return false;
+        }
+    }
+
     void patchJump(int offset) {
         int jump = getChunk().code.size() - offset - 2;
+        compiler->lastJumpTarget = getChunk().code.size();
 
         if (jump > 65535) {
             error("Too much code to jump over.");
@@ -167,7 +291,13 @@ private:
     }
 
     uint8_t makeConstant(Value value) {
+        for (size_t i = 0; i < getChunk().constants.size(); i++) {
+            if (sameConstant(getChunk().constants[i], value)) return (uint8_t)i;
+        }
+
+        compiler->garbageCollector->beforeWrite(&compiler->function->object);
         getChunk().constants.push_back(value);
+        compiler->garbageCollector->writeBarrier(&compiler->function->object, value);
         int constant = getChunk().constants.size() - 1;
 
         if (constant > 255) {
@@ -178,6 +308,19 @@ private:
         return (uint8_t)constant;
     }
 
+    uint16_t makeCache() {
+        compiler->garbageCollector->beforeWrite(&compiler->function->object);
+        getChunk().caches.push_back(InlineCache());
+        int cache = getChunk().caches.size() - 1;
+
+        if (cache > 65535) {
+            error("Too many property accesses in one chunk.");
+            return 0;
+        }
+
+        return (uint16_t)cache;
+    }
+
     void declaration() {
         if (match(TOKEN_CLASS)) {
             classDeclaration();
@@ -201,7 +344,7 @@ private:
         declareVariable();
 
         emitBytes(OP_CLASS, nameConstant);
-        defineVariable(nameConstant);
+        defineVariable(compiler->scopeDepth > 0 ? 0 : globalSlot(&className));
 
         ClassCompiler currentClass;
         currentClass.enclosing = classCompiler;
@@ -219,14 +362,14 @@ private:
     }
 
     void funDeclaration() {
-        uint8_t global = parseVariable("Expect function name.");
+        uint16_t global = parseVariable("Expect function name.");
         markInitialized();
         function(TYPE_FUNCTION);
         defineVariable(global);
     }
 
     void varDeclaration() {
-        uint8_t global = parseVariable("Expect variable name.");
+        uint16_t global = parseVariable("Expect variable name.");
 
         if (match(TOKEN_EQUAL)) {
             expression();
@@ -308,7 +451,7 @@ private:
                 if (compiler->function->arity > 255) {
                     errorAtCurrent("Can't have more than 255 parameters.");
                 }
-                uint8_t constant = parseVariable("Expect parameter name.");
+                uint16_t constant = parseVariable("Expect parameter name.");
                 defineVariable(constant);
             } while (match(TOKEN_COMMA));
         }
@@ -322,6 +465,7 @@ private:
             emitByte(OP_NIL);
         }
         emitByte(OP_RETURN);
+        if (!hadError) optimizeChunk(getChunk());
 
         Function* fn = compiler->function;
         compiler = compiler->enclosing;
@@ -376,6 +520,11 @@ private:
 
             expression();
             consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+
+            // A call whose result is returned directly can reuse the frame.
+            if (compiler->lastCall >= 0 && compiler->lastCall + 2 == (int)getChunk().code.size()) {
+                getChunk().code[compiler->lastCall] = OP_TAIL_CALL;
+            }
             emitByte(OP_RETURN);
         }
     }
@@ -429,6 +578,17 @@ private:
         expression();
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
+        Value condition;
+        if (popLiterals(1, &condition)) {
+            if (isFalsey(condition)) {
+                deadStatement();
+            } else {
+                statement();
+                emitLoop(loopStart);
+            }
+            return;
+        }
+
         int exitJump = emitJump(OP_JUMP_IF_FALSE);
         emitByte(OP_POP);
         statement();
@@ -449,6 +609,18 @@ private:
         expression();
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
+        Value condition;
+        if (popLiterals(1, &condition)) {
+            if (isFalsey(condition)) {
+                deadStatement();
+                if (match(TOKEN_ELSE)) statement();
+            } else {
+                statement();
+                if (match(TOKEN_ELSE)) deadStatement();
+            }
+            return;
+        }
+
         int thenJump = emitJump(OP_JUMP_IF_FALSE);
         emitByte(OP_POP);
         statement();
@@ -489,7 +661,7 @@ private:
 
     void number(bool canAssign) {
         double value = std::stod(std::string(previous.start, previous.end));
-        emitConstant(value);
+        emitLiteral(value);
     }
 
     void or_(bool canAssign) {
@@ -525,7 +697,7 @@ private:
 
         std::string string2 = ss.str();
         String* value = compiler->garbageCollector->newString(string2);
-        emitConstant(Value(value));
+        emitLiteral(Value(value));
     }
 
     void variable(bool canAssign) {
@@ -552,16 +724,22 @@ private:
             getOp = OP_GET_UPVALUE;
             setOp = OP_SET_UPVALUE;
         } else {
-            arg = identifierConstant(&name);
+            arg = globalSlot(&name);
             getOp = OP_GET_GLOBAL;
             setOp = OP_SET_GLOBAL;
         }
 
         if (canAssign && match(TOKEN_EQUAL)) {
             expression();
-            emitBytes(setOp, (uint8_t)arg);
+            emitByte(setOp);
         } else {
-            emitBytes(getOp, (uint8_t)arg);
+            emitByte(getOp);
+        }
+
+        if (getOp == OP_GET_GLOBAL) {
+            emitShort((uint16_t)arg);
+        } else {
+            emitByte((uint8_t)arg);
         }
     }
 
@@ -570,6 +748,16 @@ private:
 
         parsePrecedence(PREC_UNARY);
 
+        Value a;
+        Value result;
+        if (popLiterals(1, &a)) {
+            if (foldUnary(operatorType, a, result)) {
+                emitLiteral(result);
+                return;
+            }
+            emitLiteral(a);
+        }
+
         switch (operatorType) {
         case TOKEN_BANG: emitByte(OP_NOT); break;
         case TOKEN_MINUS: emitByte(OP_NEGATE); break;
@@ -582,6 +770,17 @@ private:
         ParseRule* rule = getRule(operatorType);
         parsePrecedence((Precedence)(rule->precedence + 1));
 
+        Value operands[2];
+        Value result;
+        if (popLiterals(2, operands)) {
+            if (foldBinary(operatorType, operands[0], operands[1], result)) {
+                emitLiteral(result);
+                return;
+            }
+            emitLiteral(operands[0]);
+            emitLiteral(operands[1]);
+        }
+
         switch (operatorType) {
         case TOKEN_BANG_EQUAL: emitBytes(OP_EQUAL, OP_NOT); break;
         case TOKEN_EQUAL_EQUAL: emitByte(OP_EQUAL); break;
@@ -600,6 +799,7 @@ private:
 
     void call(bool canAssign) {
         uint8_t argCount = argumentList();
+        compiler->lastCall = getChunk().code.size();
         emitBytes(OP_CALL, argCount);
     }
 
@@ -610,12 +810,15 @@ private:
         if (canAssign && match(TOKEN_EQUAL)) {
             expression();
             emitBytes(OP_SET_PROPERTY, name);
+            emitShort(makeCache());
         } else if (match(TOKEN_LEFT_PAREN)) {
             uint8_t argCount = argumentList();
             emitBytes(OP_INVOKE, name);
             emitByte(argCount);
+            emitShort(makeCache());
         } else {
             emitBytes(OP_GET_PROPERTY, name);
+            emitShort(makeCache());
         }
     }
 
@@ -637,9 +840,9 @@ private:
 
     void literal(bool canAssign) {
         switch (previous.type) {
-        case TOKEN_FALSE: emitByte(OP_FALSE); break;
-        case TOKEN_NIL: emitByte(OP_NIL); break;
-        case TOKEN_TRUE: emitByte(OP_TRUE); break;
+        case TOKEN_FALSE: emitLiteral(false); break;
+        case TOKEN_NIL: emitLiteral(Value()); break;
+        case TOKEN_TRUE: emitLiteral(true); break;
         default: return;
         }
     }
@@ -759,7 +962,7 @@ private:
         }
     }
 
-    uint8_t parseVariable(const std::string& errorMessage) {
+    uint16_t parseVariable(const std::string& errorMessage) {
         consume(TOKEN_IDENTIFIER, errorMessage);
 
         declareVariable();
@@ -767,7 +970,7 @@ private:
             return 0;
         }
 
-        return identifierConstant(&previous);
+        return globalSlot(&previous);
     }
 
     void markInitialized() {
@@ -776,11 +979,24 @@ private:
     }
 
     uint8_t identifierConstant(Token* name) {
-        std::string string = std::string(previous.start, previous.end);
+        std::string string = std::string(name->start, name->end);
         String* value = compiler->garbageCollector->newString(string);
         return makeConstant(Value(value));
     }
 
+    uint16_t globalSlot(Token* name) {
+        std::string string = std::string(name->start, name->end);
+        String* value = compiler->garbageCollector->newString(string);
+        int slot = compiler->garbageCollector->globals->resolve(value);
+
+        if (slot == -1) {
+            error("Too many global variables.");
+            return 0;
+        }
+
+        return (uint16_t)slot;
+    }
+
     void addLocal(Token name) {
         if (compiler->locals.size() == 256) {
             error("Too many local variables in function.");
@@ -860,13 +1076,14 @@ private:
         return -1;
     }
 
-    void defineVariable(uint8_t global) {
+    void defineVariable(uint16_t global) {
         if (compiler->scopeDepth > 0) {
             markInitialized();
             return;
         }
 
-        emitBytes(OP_DEFINE_GLOBAL, global);
+        emitByte(OP_DEFINE_GLOBAL);
+        emitShort(global);
     }
 
     uint8_t argumentList() {
@@ -910,7 +1127,10 @@ public:
 
         emitByte(OP_NIL);
         emitByte(OP_RETURN);
-        return hadError ? nullptr : compiler->function;
+        if (hadError) return nullptr;
+
+        optimizeChunk(getChunk());
+        return compiler->function;
     }
 };
 
@@ -924,4 +1144,396 @@ Function* compile(const std::string& source, GC* garbageCollector) {
     Function* fn = parser.compile();
     garbageCollector->compiler = nullptr;
     return fn;
-}
\ No newline at end of file
+}
+
+// Translates the stack bytecode of a function into register instructions.
+// Stack position p lives in register p. A position is only written when its
+// value can't be named by an existing register or a constant, so pushes of
+// locals and literals cost nothing until something needs them in place.
+
+class RegisterCompiler {
+private:
+    Function* function;
+    Chunk& chunk;
+    HeapVector<RegisterInstruction>& code;
+    HeapVector<int>& lines;
+
+    std::vector<uint16_t> stack;
+    size_t maxDepth = 0;
+    int line = 0;
+    bool retarget = false;
+
+    std::vector<bool> targets;
+    std::unordered_map<size_t, size_t> depths;
+    std::unordered_map<size_t, size_t> labels;
+    std::vector<std::pair<size_t, size_t>> patches;
+
+    size_t emit(uint8_t op, uint8_t n, uint16_t a, uint16_t b = 0, uint16_t c = 0, uint16_t d = 0) {
+        code.push_back({ op, n, a, b, c, d });
+        lines.push_back(line);
+        retarget = false;
+        return code.size() - 1;
+    }
+
+    void produce(uint8_t op, uint8_t n, uint16_t b = 0, uint16_t c = 0, uint16_t d = 0) {
+        uint16_t p = (uint16_t)stack.size();
+        emit(op, n, p, b, c, d);
+        push(p);
+        retarget = true;
+    }
+
+    void push(uint16_t operand) {
+        stack.push_back(operand);
+        if (stack.size() > maxDepth) maxDepth = stack.size();
+    }
+
+    uint16_t pop() {
+        uint16_t operand = stack.back();
+        stack.pop_back();
+        return operand;
+    }
+
+    uint16_t constant(Value value) {
+        for (size_t i = 0; i < chunk.constants.size(); i++) {
+            if (sameConstant(chunk.constants[i], value)) return (uint16_t)(REGISTER_CONSTANT | i);
+        }
+
+        chunk.constants.push_back(value);
+        return (uint16_t)(REGISTER_CONSTANT | (chunk.constants.size() - 1));
+    }
+
+    void materialize(size_t p) {
+        if (stack[p] == p) return;
+        emit(R_MOVE, 0, (uint16_t)p, stack[p]);
+        stack[p] = (uint16_t)p;
+    }
+
+    void flush() {
+        for (size_t p = 0; p < stack.size(); p++) {
+            materialize(p);
+        }
+    }
+
+    void clobber(uint16_t slot, size_t end) {
+        for (size_t p = slot + 1; p < end; p++) {
+            if (stack[p] == slot) materialize(p);
+        }
+    }
+
+    void setLocal(uint16_t slot) {
+        size_t p = stack.size() - 1;
+        clobber(slot, p);
+
+        if (stack[p] == p && retarget && code.back().a == p) {
+            code.back().a = slot;
+            stack[p] = slot;
+        } else if (stack[p] != slot) {
+            emit(R_MOVE, 0, slot, stack[p]);
+        }
+        stack[slot] = slot;
+    }
+
+    void jump(uint8_t op, uint16_t a, uint16_t b, size_t target) {
+        if (labels.find(target) == labels.end()) depths[target] = stack.size();
+        patches.push_back({ emit(op, 0, a, b), target });
+    }
+
+    static bool jumpTarget(const Chunk& chunk, size_t offset, size_t& target) {
+        switch (chunk.code[offset]) {
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_NOT_GREATER:
+            target = offset + 3 + ((chunk.code[offset + 1] << 8) | chunk.code[offset + 2]);
+            return true;
+        case OP_LOOP:
+            target = offset + 3 - ((chunk.code[offset + 1] << 8) | chunk.code[offset + 2]);
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    static uint16_t readShort(const uint8_t* operands) {
+        return (uint16_t)((operands[0] << 8) | operands[1]);
+    }
+
+    uint8_t registerOp(uint8_t op) {
+        switch (op) {
+        case OP_EQUAL: case OP_EQUAL_NUM: return R_EQUAL;
+        case OP_NOT_EQUAL: return R_NOT_EQUAL;
+        case OP_GREATER: return R_GREATER;
+        case OP_GREATER_EQUAL: return R_GREATER_EQUAL;
+        case OP_LESS: return R_LESS;
+        case OP_LESS_EQUAL: return R_LESS_EQUAL;
+        case OP_ADD: case OP_ADD_NUM: case OP_ADD_STR: case OP_ADD_LOCAL_CONSTANT: return R_ADD;
+        case OP_SUBTRACT: case OP_SUBTRACT_LOCAL_CONSTANT: return R_SUBTRACT;
+        case OP_MULTIPLY: return R_MULTIPLY;
+        case OP_DIVIDE: return R_DIVIDE;
+        case OP_REMAIN: return R_REMAIN;
+        case OP_NOT: return R_NOT;
+        case OP_NEGATE: return R_NEGATE;
+        case OP_PRINT: return R_PRINT;
+        case OP_PRINTL: return R_PRINTL;
+        case OP_JUMP_IF_EQUAL: return R_JUMP_IF_EQUAL;
+        case OP_JUMP_IF_NOT_EQUAL: return R_JUMP_IF_NOT_EQUAL;
+        case OP_JUMP_IF_LESS: return R_JUMP_IF_LESS;
+        case OP_JUMP_IF_NOT_LESS: return R_JUMP_IF_NOT_LESS;
+        case OP_JUMP_IF_GREATER: return R_JUMP_IF_GREATER;
+        case OP_JUMP_IF_NOT_GREATER: return R_JUMP_IF_NOT_GREATER;
+        default: return 0;
+        }
+    }
+
+    bool translate(size_t offset) {
+        uint8_t op = chunk.code[offset];
+        uint8_t* operands = chunk.code.data() + offset + 1;
+        size_t target = 0;
+        jumpTarget(chunk, offset, target);
+
+        switch (op) {
+        case OP_CONSTANT: push((uint16_t)(REGISTER_CONSTANT | operands[0])); return true;
+        case OP_NIL: push(constant(Value())); return true;
+        case OP_TRUE: push(constant(Value(true))); return true;
+        case OP_FALSE: push(constant(Value(false))); return true;
+        case OP_POP: pop(); return true;
+        case OP_GET_LOCAL:
+            materialize(operands[0]);
+            push(operands[0]);
+            return true;
+        case OP_SET_LOCAL: setLocal(operands[0]); return true;
+        case OP_SET_LOCAL_POP:
+            setLocal(operands[0]);
+            pop();
+            return true;
+        case OP_GET_GLOBAL: produce(R_GET_GLOBAL, 0, readShort(operands)); return true;
+        case OP_DEFINE_GLOBAL: emit(R_DEFINE_GLOBAL, 0, readShort(operands), pop()); return true;
+        case OP_SET_GLOBAL: emit(R_SET_GLOBAL, 0, readShort(operands), stack.back()); return true;
+        case OP_SET_GLOBAL_POP: emit(R_SET_GLOBAL, 0, readShort(operands), pop()); return true;
+        case OP_GET_UPVALUE: produce(R_GET_UPVALUE, 0, operands[0]); return true;
+        case OP_SET_UPVALUE: emit(R_SET_UPVALUE, 0, operands[0], stack.back()); return true;
+        case OP_GET_PROPERTY: {
+            uint16_t cache = (uint16_t)((operands[1] << 8) | operands[2]);
+            produce(R_GET_PROPERTY, operands[0], pop(), 0, cache);
+            return true;
+        }
+        case OP_SET_PROPERTY: {
+            uint16_t cache = (uint16_t)((operands[1] << 8) | operands[2]);
+            uint16_t value = pop();
+            uint16_t object = pop();
+            emit(R_SET_PROPERTY, operands[0], (uint16_t)stack.size(), object, value, cache);
+            push((uint16_t)stack.size());
+            return true;
+        }
+        case OP_EQUAL:
+        case OP_EQUAL_NUM:
+        case OP_NOT_EQUAL:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_REMAIN: {
+            uint16_t b = pop();
+            uint16_t a = pop();
+            produce(registerOp(op), 0, a, b);
+            return true;
+        }
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+            materialize(operands[0]);
+            produce(registerOp(op), 0, operands[0], (uint16_t)(REGISTER_CONSTANT | operands[1]));
+            return true;
+        case OP_NOT:
+        case OP_NEGATE:
+            produce(registerOp(op), 0, pop());
+            return true;
+        case OP_PRINT:
+        case OP_PRINTL:
+            emit(registerOp(op), 0, pop());
+            return true;
+        case OP_JUMP:
+        case OP_LOOP:
+            flush();
+            jump(R_JUMP, 0, 0, target);
+            return true;
+        case OP_JUMP_IF_FALSE:
+            flush();
+            jump(R_JUMP_IF_FALSE, (uint16_t)(stack.size() - 1), 0, target);
+            return true;
+        case OP_POP_JUMP_IF_FALSE: {
+            uint16_t condition = pop();
+            flush();
+            jump(R_JUMP_IF_FALSE, condition, 0, target);
+            return true;
+        }
+        case OP_JUMP_IF_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_NOT_GREATER: {
+            uint16_t b = pop();
+            uint16_t a = pop();
+            flush();
+            jump(registerOp(op), a, b, target);
+            return true;
+        }
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_INVOKE: {
+            int argCount = op == OP_INVOKE ? operands[1] : operands[0];
+            flush();
+            uint16_t base = (uint16_t)(stack.size() - argCount - 1);
+            if (op != OP_INVOKE) {
+                emit(op == OP_CALL ? R_CALL : R_TAIL_CALL, argCount, base);
+            } else {
+                emit(R_INVOKE, argCount, base, 0, operands[0], (uint16_t)((operands[2] << 8) | operands[3]));
+            }
+            stack.resize(base);
+            push(base);
+            return true;
+        }
+        case OP_CLOSURE: {
+            Function* closure = chunk.constants[operands[0]].getFunction();
+            flush();
+            emit(R_CLOSURE, 0, (uint16_t)stack.size(), operands[0]);
+            push((uint16_t)stack.size());
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                emit(R_CAPTURE, operands[1 + 2 * i], operands[2 + 2 * i]);
+            }
+            return true;
+        }
+        case OP_CLOSE_UPVALUE:
+            materialize(stack.size() - 1);
+            emit(R_CLOSE_UPVALUE, 0, pop());
+            return true;
+        case OP_RETURN: emit(R_RETURN, 0, pop()); return true;
+        case OP_CLASS:
+            emit(R_CLASS, operands[0], (uint16_t)stack.size());
+            push((uint16_t)stack.size());
+            return true;
+        case OP_METHOD: {
+            uint16_t method = pop();
+            emit(R_METHOD, operands[0], stack.back(), method);
+            return true;
+        }
+        case OP_ARRAY: {
+            flush();
+            uint16_t base = (uint16_t)(stack.size() - operands[0]);
+            emit(R_ARRAY, operands[0], base);
+            stack.resize(base);
+            push(base);
+            return true;
+        }
+        case OP_MAP: produce(R_MAP, 0); return true;
+        case OP_KEY: {
+            uint16_t value = pop();
+            emit(R_KEY, operands[0], stack.back(), value);
+            return true;
+        }
+        default:
+            return false;
+        }
+    }
+
+    static bool endsBlock(uint8_t op) {
+        return op == OP_JUMP || op == OP_LOOP || op == OP_RETURN;
+    }
+
+    // A label that is only reached by a later backward jump (the increment
+    // clause of a for loop) has no known depth on the first pass, so passes
+    // repeat until every jump resolves or no new depths are learned.
+    bool pass() {
+        code.clear();
+        lines.clear();
+        labels.clear();
+        patches.clear();
+        stack.clear();
+        for (int i = 0; i <= function->arity; i++) {
+            push((uint16_t)i);
+        }
+
+        bool live = true;
+        for (size_t offset = 0; offset < chunk.code.size(); offset += instructionLength(chunk, offset)) {
+            line = chunk.lines[offset];
+
+            if (targets[offset]) {
+                auto depth = depths.find(offset);
+                if (live) {
+                    flush();
+                    if (depth != depths.end() && depth->second != stack.size()) return false;
+                    depths[offset] = stack.size();
+                } else if (depth != depths.end()) {
+                    stack.clear();
+                    for (size_t p = 0; p < depth->second; p++) {
+                        push((uint16_t)p);
+                    }
+                    live = true;
+                }
+                if (live) labels[offset] = code.size();
+                retarget = false;
+            }
+
+            if (!live) continue;
+            if (!translate(offset)) return false;
+            if (endsBlock(chunk.code[offset])) live = false;
+        }
+        return true;
+    }
+
+public:
+    RegisterCompiler(Function* function) : function(function), chunk(function->chunk), code(function->registerCode), lines(function->registerLines) {}
+
+    bool compile() {
+        targets.assign(chunk.code.size() + 1, false);
+        for (size_t offset = 0; offset < chunk.code.size(); offset += instructionLength(chunk, offset)) {
+            size_t target;
+            if (jumpTarget(chunk, offset, target)) targets[target] = true;
+        }
+
+        size_t known;
+        do {
+            known = depths.size();
+            if (!pass()) return false;
+        } while (depths.size() > known);
+
+        if (code.size() > UINT16_MAX || maxDepth > REGISTER_CONSTANT || chunk.constants.size() > REGISTER_CONSTANT) {
+            return false;
+        }
+
+        for (auto& patch : patches) {
+            auto label = labels.find(patch.second);
+            if (label == labels.end()) return false;
+            code[patch.first].d = (uint16_t)label->second;
+        }
+
+        function->registerCount = (int)maxDepth;
+        return true;
+    }
+};
+
+bool compileRegisters(Function* function, GC* garbageCollector) {
+    if (!function->registersCompiled) {
+        function->registersCompiled = true;
+        // Translation may add constants to the chunk.
+        garbageCollector->beforeWrite(&function->object);
+
+        RegisterCompiler compiler(function);
+        if (!compiler.compile()) {
+            function->registerCode.clear();
+            function->registerLines.clear();
+        }
+    }
+    return !function->registerCode.empty();
+}
@@ -8,5 +8,6 @@
 
 
 Function* compile(const std::string& source, GC* garbageCollector);
+bool compileRegisters(Function* function, GC* garbageCollector);
 
 #endif 
\ No newline at end of file
@@ -0,0 +1,1662 @@
+#include "jit.h"
+#include "vm.h"
+
+#ifdef JIT
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstddef>
+#include <algorithm>
+#include <climits>
+
+// Templates keep the VM's stack layout, so every bytecode boundary is a point
+// where native code and the interpreter can hand over. Guards that fail and
+// instructions without a template leave through a side exit that stores the
+// instruction's ip; the interpreter then executes it with full semantics.
+
+enum Register {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+// Held for the whole function: the stack top, the VM, the frame's slots, the
+// CallFrame, where the stack top is written back on exit and the QNAN mask.
+const Register SP = RBX;
+const Register VMR = R12;
+const Register SLOTS = R13;
+const Register FRAME = R14;
+const Register STACK_TOP = R15;
+const Register MASK = RBP;
+
+enum Condition {
+    CC_B = 0x2, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7, CC_P = 0xA, CC_NP = 0xB, CC_GE = 0xD,
+};
+
+enum AluOp {
+    ALU_ADD = 0x01, ALU_OR = 0x09, ALU_AND = 0x21, ALU_SUB = 0x29, ALU_XOR = 0x31, ALU_CMP = 0x39, ALU_TEST = 0x85,
+};
+
+enum SseOp {
+    SSE_ADD = 0x58, SSE_MUL = 0x59, SSE_SUB = 0x5C, SSE_DIV = 0x5E,
+};
+
+class Assembler {
+private:
+    void rex(bool wide, int reg, int base) {
+        uint8_t prefix = 0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((base & 8) ? 1 : 0);
+        if (prefix != 0x40) byte(prefix);
+    }
+
+    void modrm(int reg, int rm) {
+        byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+    }
+
+    void modrmMemory(int reg, int base, int32_t displacement) {
+        byte(0x80 | ((reg & 7) << 3) | (base & 7));
+        if ((base & 7) == RSP) byte(0x24);
+        int32(displacement);
+    }
+
+public:
+    std::vector<uint8_t> code;
+
+    size_t here() { return code.size(); }
+
+    void byte(uint8_t value) { code.push_back(value); }
+
+    void int32(int32_t value) {
+        for (int i = 0; i < 4; i++) byte((value >> (8 * i)) & 0xff);
+    }
+
+    void int64(uint64_t value) {
+        for (int i = 0; i < 8; i++) byte((value >> (8 * i)) & 0xff);
+    }
+
+    void movImmediate(Register reg, uint64_t value) {
+        rex(true, 0, reg);
+        byte(0xB8 + (reg & 7));
+        int64(value);
+    }
+
+    void movImmediate32(Register reg, uint32_t value) {
+        rex(false, 0, reg);
+        byte(0xB8 + (reg & 7));
+        int32(value);
+    }
+
+    void load(Register reg, Register base, int32_t displacement) {
+        rex(true, reg, base);
+        byte(0x8B);
+        modrmMemory(reg, base, displacement);
+    }
+
+    void store(Register base, int32_t displacement, Register reg) {
+        rex(true, reg, base);
+        byte(0x89);
+        modrmMemory(reg, base, displacement);
+    }
+
+    void alu(AluOp op, Register dst, Register src) {
+        rex(true, src, dst);
+        byte(op);
+        modrm(src, dst);
+    }
+
+    void mov(Register dst, Register src) {
+        rex(true, src, dst);
+        byte(0x89);
+        modrm(src, dst);
+    }
+
+    void addImmediate(Register reg, int32_t value) {
+        rex(true, 0, reg);
+        byte(0x81);
+        modrm(0, reg);
+        int32(value);
+    }
+
+    void subImmediate(Register reg, int32_t value) {
+        rex(true, 0, reg);
+        byte(0x81);
+        modrm(5, reg);
+        int32(value);
+    }
+
+    void addMemory32(Register base, int32_t displacement, int32_t value) {
+        rex(false, 0, base);
+        byte(0x81);
+        modrmMemory(0, base, displacement);
+        int32(value);
+    }
+
+    void cmpMemory32(Register base, int32_t displacement, int32_t value) {
+        rex(false, 0, base);
+        byte(0x81);
+        modrmMemory(7, base, displacement);
+        int32(value);
+    }
+
+    void movqToXmm(int xmm, Register reg) {
+        byte(0x66);
+        rex(true, xmm, reg);
+        byte(0x0F);
+        byte(0x6E);
+        modrm(xmm, reg);
+    }
+
+    void movqFromXmm(Register reg, int xmm) {
+        byte(0x66);
+        rex(true, xmm, reg);
+        byte(0x0F);
+        byte(0x7E);
+        modrm(xmm, reg);
+    }
+
+    void sse(SseOp op, int dst, int src) {
+        byte(0xF2);
+        rex(false, dst, src);
+        byte(0x0F);
+        byte(op);
+        modrm(dst, src);
+    }
+
+    void ucomisd(int a, int b) {
+        byte(0x66);
+        rex(false, a, b);
+        byte(0x0F);
+        byte(0x2E);
+        modrm(a, b);
+    }
+
+    void movsdLoad(int xmm, Register base, int32_t displacement) {
+        byte(0xF2);
+        rex(false, xmm, base);
+        byte(0x0F);
+        byte(0x10);
+        modrmMemory(xmm, base, displacement);
+    }
+
+    void movsdStore(Register base, int32_t displacement, int xmm) {
+        byte(0xF2);
+        rex(false, xmm, base);
+        byte(0x0F);
+        byte(0x11);
+        modrmMemory(xmm, base, displacement);
+    }
+
+    void movapd(int dst, int src) {
+        byte(0x66);
+        rex(false, dst, src);
+        byte(0x0F);
+        byte(0x28);
+        modrm(dst, src);
+    }
+
+    // Sets the low byte of rax, rcx or rdx and zero-extends it.
+    void setcc(Condition condition, Register reg) {
+        byte(0x0F);
+        byte(0x90 + condition);
+        modrm(0, reg);
+        byte(0x0F);
+        byte(0xB6);
+        modrm(reg, reg);
+    }
+
+    void testByte(Register reg) {
+        byte(0x84);
+        modrm(reg, reg);
+    }
+
+    size_t jcc(Condition condition) {
+        byte(0x0F);
+        byte(0x80 + condition);
+        int32(0);
+        return here() - 4;
+    }
+
+    size_t jmp() {
+        byte(0xE9);
+        int32(0);
+        return here() - 4;
+    }
+
+    void jmp(Register reg) {
+        rex(false, 0, reg);
+        byte(0xFF);
+        modrm(4, reg);
+    }
+
+    void patch(size_t at, size_t target) {
+        int32_t relative = (int32_t)(target - (at + 4));
+        std::memcpy(&code[at], &relative, sizeof(relative));
+    }
+
+    void call(void* function) {
+        movImmediate(RAX, (uint64_t)(uintptr_t)function);
+        byte(0xFF);
+        byte(0xD0);
+    }
+
+    void push(Register reg) {
+        rex(false, 0, reg);
+        byte(0x50 + (reg & 7));
+    }
+
+    void pop(Register reg) {
+        rex(false, 0, reg);
+        byte(0x58 + (reg & 7));
+    }
+
+    void ret() { byte(0xC3); }
+};
+
+// Executable memory is handed out from large mmap'd blocks. Code is copied in
+// while the pages are writable and they are made executable again right after.
+const size_t CODE_BLOCK_SIZE = 1024 * 1024;
+
+class CodeArena {
+private:
+    uint8_t* block = nullptr;
+    size_t used = 0;
+    size_t capacity = 0;
+
+public:
+    uint8_t* allocate(const std::vector<uint8_t>& code) {
+        size_t page = sysconf(_SC_PAGESIZE);
+
+        if (block == nullptr || used + code.size() > capacity) {
+            size_t size = std::max(CODE_BLOCK_SIZE, (code.size() + page - 1) / page * page);
+            void* memory = mmap(nullptr, size, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (memory == MAP_FAILED) return nullptr;
+
+            block = (uint8_t*)memory;
+            used = 0;
+            capacity = size;
+        }
+
+        uint8_t* address = block + used;
+        uint8_t* first = block + (used / page) * page;
+        size_t length = address + code.size() - first;
+        if (mprotect(first, length, PROT_READ | PROT_WRITE) != 0) return nullptr;
+        std::memcpy(address, code.data(), code.size());
+        mprotect(first, length, PROT_READ | PROT_EXEC);
+
+        used = (used + code.size() + 15) & ~(size_t)15;
+        return address;
+    }
+};
+
+static CodeArena arena;
+static JitEntry trampoline = nullptr;
+
+// Saves the callee-saved registers, loads the fixed ones and jumps to target.
+// Every function ends in the matching epilogue.
+static bool buildTrampoline() {
+    Assembler a;
+    a.push(RBP);
+    a.push(RBX);
+    a.push(R12);
+    a.push(R13);
+    a.push(R14);
+    a.push(R15);
+    a.subImmediate(RSP, 8);
+
+    a.mov(VMR, RDI);
+    a.mov(FRAME, RSI);
+    a.mov(STACK_TOP, RDX);
+    a.load(SP, RDX, 0);
+    a.load(SLOTS, RSI, offsetof(CallFrame, slots));
+    a.movImmediate(MASK, QNAN);
+    a.jmp(RCX);
+
+    uint8_t* code = arena.allocate(a.code);
+    if (code == nullptr) return false;
+    trampoline = (JitEntry)code;
+    return true;
+}
+
+// Undoes the trampoline, returning the JitStatus in eax.
+static void emitEpilogue(Assembler& a) {
+    a.store(STACK_TOP, 0, SP);
+    a.addImmediate(RSP, 8);
+    a.pop(R15);
+    a.pop(R14);
+    a.pop(R13);
+    a.pop(R12);
+    a.pop(RBX);
+    a.pop(RBP);
+    a.ret();
+}
+
+class JitCompiler {
+private:
+    Function* function;
+    Chunk& chunk;
+    Value* globals;
+    Assembler a;
+
+    size_t offset = 0;
+    std::vector<size_t> native;
+    std::vector<bool> targets;
+    std::vector<std::pair<size_t, size_t>> jumps;
+    std::vector<std::pair<size_t, size_t>> exits;
+    std::vector<size_t> errors;
+    std::vector<size_t> epilogues;
+
+    uint8_t* ip(size_t at) {
+        return chunk.code.data() + at;
+    }
+
+    uint8_t operand(int index) {
+        return chunk.code[offset + 1 + index];
+    }
+
+    uint16_t shortOperand() {
+        return (uint16_t)((operand(0) << 8) | operand(1));
+    }
+
+    size_t jumpTarget() {
+        if (chunk.code[offset] == OP_LOOP) return offset + 3 - shortOperand();
+        return offset + 3 + shortOperand();
+    }
+
+    void push(Register reg) {
+        a.store(SP, 0, reg);
+        a.addImmediate(SP, sizeof(Value));
+    }
+
+    void pop(Register reg) {
+        a.subImmediate(SP, sizeof(Value));
+        a.load(reg, SP, 0);
+    }
+
+    void sideExit(Condition condition) {
+        exits.push_back({ a.jcc(condition), offset });
+    }
+
+    void exitUnlessNumber(Register reg) {
+        a.mov(RDX, reg);
+        a.alu(ALU_AND, RDX, MASK);
+        a.alu(ALU_CMP, RDX, MASK);
+        sideExit(CC_E);
+    }
+
+    void loadNumbers() {
+        a.load(RAX, SP, -16);
+        a.load(RCX, SP, -8);
+        exitUnlessNumber(RAX);
+        exitUnlessNumber(RCX);
+        a.movqToXmm(0, RAX);
+        a.movqToXmm(1, RCX);
+    }
+
+    // Turns 0 or 1 in rax into a boolean Value.
+    void makeBoolean() {
+        a.addImmediate(RAX, TAG_FALSE);
+        a.alu(ALU_OR, RAX, MASK);
+    }
+
+    void storeIp(size_t at) {
+        a.movImmediate(RAX, (uint64_t)(uintptr_t)ip(at));
+        a.store(FRAME, offsetof(CallFrame, ip), RAX);
+    }
+
+    // Helpers return the new stack top, or null after a runtime error.
+    void callHelper(void* helper) {
+        a.call(helper);
+        a.alu(ALU_TEST, RAX, RAX);
+        errors.push_back(a.jcc(CC_E));
+        a.mov(SP, RAX);
+    }
+
+    void leave(JitStatus status) {
+        a.movImmediate32(RAX, (uint32_t)status);
+        epilogues.push_back(a.jmp());
+    }
+
+    void jump(Condition condition) {
+        jumps.push_back({ a.jcc(condition), jumpTarget() });
+    }
+
+    void jumpIfFalsey(Register reg) {
+        a.movImmediate(RDX, QNAN | TAG_NIL);
+        a.alu(ALU_CMP, reg, RDX);
+        jump(CC_E);
+        a.movImmediate(RDX, QNAN | TAG_FALSE);
+        a.alu(ALU_CMP, reg, RDX);
+        jump(CC_E);
+    }
+
+    // Leaves 1 in rax when the two values on top are equal and pops them.
+    void equality() {
+        a.load(RAX, SP, -16);
+        a.load(RCX, SP, -8);
+        a.mov(RDX, RAX);
+        a.alu(ALU_AND, RDX, MASK);
+        a.alu(ALU_CMP, RDX, MASK);
+        size_t slow = a.jcc(CC_E);
+        a.mov(RDX, RCX);
+        a.alu(ALU_AND, RDX, MASK);
+        a.alu(ALU_CMP, RDX, MASK);
+        size_t slow2 = a.jcc(CC_E);
+
+        a.movqToXmm(0, RAX);
+        a.movqToXmm(1, RCX);
+        a.ucomisd(0, 1);
+        a.setcc(CC_E, RAX);
+        a.setcc(CC_NP, RCX);
+        a.alu(ALU_AND, RAX, RCX);
+        size_t done = a.jmp();
+
+        a.patch(slow, a.here());
+        a.patch(slow2, a.here());
+        a.mov(RDI, SP);
+        a.call((void*)&VM::jitEqual);
+        a.testByte(RAX);
+        a.setcc(CC_NE, RAX);
+
+        a.patch(done, a.here());
+        a.subImmediate(SP, 16);
+    }
+
+    void arithmetic(SseOp op) {
+        loadNumbers();
+        a.sse(op, 0, 1);
+        a.movqFromXmm(RAX, 0);
+        a.subImmediate(SP, sizeof(Value));
+        a.store(SP, -8, RAX);
+    }
+
+    void comparison(bool swap, Condition condition) {
+        loadNumbers();
+        if (swap) {
+            a.ucomisd(1, 0);
+        } else {
+            a.ucomisd(0, 1);
+        }
+        a.setcc(condition, RAX);
+        makeBoolean();
+        a.subImmediate(SP, sizeof(Value));
+        a.store(SP, -8, RAX);
+    }
+
+    void compareJump(bool swap, Condition condition) {
+        loadNumbers();
+        a.subImmediate(SP, 16);
+        if (swap) {
+            a.ucomisd(1, 0);
+        } else {
+            a.ucomisd(0, 1);
+        }
+        jump(condition);
+    }
+
+    void localConstant(SseOp op) {
+        a.load(RAX, SLOTS, operand(0) * sizeof(Value));
+        exitUnlessNumber(RAX);
+        a.movqToXmm(0, RAX);
+        a.movImmediate(RCX, chunk.constants[operand(1)].bits);
+        a.movqToXmm(1, RCX);
+        a.sse(op, 0, 1);
+        a.movqFromXmm(RAX, 0);
+        push(RAX);
+    }
+
+    void add() {
+        a.load(RAX, SP, -16);
+        a.load(RCX, SP, -8);
+        a.mov(RDX, RAX);
+        a.alu(ALU_AND, RDX, MASK);
+        a.alu(ALU_CMP, RDX, MASK);
+        size_t slow = a.jcc(CC_E);
+        a.mov(RDX, RCX);
+        a.alu(ALU_AND, RDX, MASK);
+        a.alu(ALU_CMP, RDX, MASK);
+        size_t slow2 = a.jcc(CC_E);
+
+        a.movqToXmm(0, RAX);
+        a.movqToXmm(1, RCX);
+        a.sse(SSE_ADD, 0, 1);
+        a.movqFromXmm(RAX, 0);
+        a.subImmediate(SP, sizeof(Value));
+        a.store(SP, -8, RAX);
+        size_t done = a.jmp();
+
+        a.patch(slow, a.here());
+        a.patch(slow2, a.here());
+        storeIp(offset + 1);
+        a.mov(RDI, VMR);
+        a.mov(RSI, SP);
+        callHelper((void*)&VM::jitAdd);
+
+        a.patch(done, a.here());
+    }
+
+    bool translate() {
+        switch (chunk.code[offset]) {
+        case OP_CONSTANT:
+            a.movImmediate(RAX, chunk.constants[operand(0)].bits);
+            push(RAX);
+            return true;
+        case OP_NIL:
+            a.movImmediate(RAX, Value().bits);
+            push(RAX);
+            return true;
+        case OP_TRUE:
+            a.movImmediate(RAX, Value(true).bits);
+            push(RAX);
+            return true;
+        case OP_FALSE:
+            a.movImmediate(RAX, Value(false).bits);
+            push(RAX);
+            return true;
+        case OP_POP:
+            a.subImmediate(SP, sizeof(Value));
+            return true;
+        case OP_GET_LOCAL:
+            a.load(RAX, SLOTS, operand(0) * sizeof(Value));
+            push(RAX);
+            return true;
+        case OP_SET_LOCAL:
+            a.load(RAX, SP, -8);
+            a.store(SLOTS, operand(0) * sizeof(Value), RAX);
+            return true;
+        case OP_SET_LOCAL_POP:
+            pop(RAX);
+            a.store(SLOTS, operand(0) * sizeof(Value), RAX);
+            return true;
+        case OP_GET_GLOBAL:
+            a.movImmediate(RCX, (uint64_t)(uintptr_t)&globals[shortOperand()]);
+            a.load(RAX, RCX, 0);
+            a.movImmediate(RDX, Value::undefined().bits);
+            a.alu(ALU_CMP, RAX, RDX);
+            sideExit(CC_E);
+            push(RAX);
+            return true;
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_POP:
+            a.movImmediate(RCX, (uint64_t)(uintptr_t)&globals[shortOperand()]);
+            a.load(RAX, RCX, 0);
+            a.movImmediate(RDX, Value::undefined().bits);
+            a.alu(ALU_CMP, RAX, RDX);
+            sideExit(CC_E);
+            a.load(RAX, SP, -8);
+            a.store(RCX, 0, RAX);
+            if (chunk.code[offset] == OP_SET_GLOBAL_POP) a.subImmediate(SP, sizeof(Value));
+            return true;
+        case OP_DEFINE_GLOBAL:
+            a.movImmediate(RCX, (uint64_t)(uintptr_t)&globals[shortOperand()]);
+            pop(RAX);
+            a.store(RCX, 0, RAX);
+            return true;
+        case OP_GET_UPVALUE:
+            a.mov(RDI, VMR);
+            a.mov(RSI, SP);
+            a.movImmediate32(RDX, operand(0));
+            callHelper((void*)&VM::jitGetUpvalue);
+            return true;
+        case OP_SET_UPVALUE:
+            a.mov(RDI, VMR);
+            a.mov(RSI, SP);
+            a.movImmediate32(RDX, operand(0));
+            callHelper((void*)&VM::jitSetUpvalue);
+            return true;
+        case OP_CLOSE_UPVALUE:
+            a.mov(RDI, VMR);
+            a.mov(RSI, SP);
+            callHelper((void*)&VM::jitCloseUpvalue);
+            return true;
+        case OP_EQUAL:
+        case OP_EQUAL_NUM:
+            equality();
+            makeBoolean();
+            push(RAX);
+            return true;
+        case OP_NOT_EQUAL:
+            equality();
+            a.alu(ALU_TEST, RAX, RAX);
+            a.setcc(CC_E, RAX);
+            makeBoolean();
+            push(RAX);
+            return true;
+        case OP_GREATER: comparison(false, CC_A); return true;
+        case OP_GREATER_EQUAL: comparison(true, CC_BE); return true;
+        case OP_LESS: comparison(true, CC_A); return true;
+        case OP_LESS_EQUAL: comparison(false, CC_BE); return true;
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+            add();
+            return true;
+        case OP_SUBTRACT: arithmetic(SSE_SUB); return true;
+        case OP_MULTIPLY: arithmetic(SSE_MUL); return true;
+        case OP_DIVIDE: arithmetic(SSE_DIV); return true;
+        case OP_REMAIN:
+            loadNumbers();
+            a.call((void*)&VM::jitRemain);
+            a.movqFromXmm(RAX, 0);
+            a.subImmediate(SP, sizeof(Value));
+            a.store(SP, -8, RAX);
+            return true;
+        case OP_NOT:
+            a.load(RCX, SP, -8);
+            a.movImmediate(RDX, QNAN | TAG_NIL);
+            a.alu(ALU_CMP, RCX, RDX);
+            a.setcc(CC_E, RAX);
+            a.movImmediate(RDX, QNAN | TAG_FALSE);
+            a.alu(ALU_CMP, RCX, RDX);
+            a.setcc(CC_E, RDX);
+            a.alu(ALU_OR, RAX, RDX);
+            makeBoolean();
+            a.store(SP, -8, RAX);
+            return true;
+        case OP_NEGATE:
+            a.load(RAX, SP, -8);
+            exitUnlessNumber(RAX);
+            a.movImmediate(RCX, SIGN_BIT);
+            a.alu(ALU_XOR, RAX, RCX);
+            a.store(SP, -8, RAX);
+            return true;
+        case OP_PRINT:
+        case OP_PRINTL:
+            a.mov(RDI, SP);
+            a.movImmediate32(RSI, chunk.code[offset] == OP_PRINTL);
+            a.call((void*)&VM::jitPrint);
+            a.subImmediate(SP, sizeof(Value));
+            return true;
+        case OP_JUMP:
+            jumps.push_back({ a.jmp(), jumpTarget() });
+            return true;
+        case OP_LOOP:
+            // Leaves for the interpreter when the loop is hot enough to be
+            // recorded, and for its trace once there is one.
+            a.movImmediate(RAX, (uint64_t)(uintptr_t)&function->loops[jumpTarget()]);
+            a.load(RCX, RAX, offsetof(LoopTrace, code));
+            a.alu(ALU_TEST, RCX, RCX);
+            exits.push_back({ a.jcc(CC_NE), jumpTarget() });
+            a.addMemory32(RAX, offsetof(LoopTrace, hotness), 1);
+            a.cmpMemory32(RAX, offsetof(LoopTrace, hotness), TRACE_THRESHOLD - 1);
+            exits.push_back({ a.jcc(CC_GE), jumpTarget() });
+            jumps.push_back({ a.jmp(), jumpTarget() });
+            return true;
+        case OP_JUMP_IF_FALSE:
+            a.load(RAX, SP, -8);
+            jumpIfFalsey(RAX);
+            return true;
+        case OP_POP_JUMP_IF_FALSE:
+            pop(RAX);
+            jumpIfFalsey(RAX);
+            return true;
+        case OP_JUMP_IF_EQUAL:
+            equality();
+            a.alu(ALU_TEST, RAX, RAX);
+            jump(CC_NE);
+            return true;
+        case OP_JUMP_IF_NOT_EQUAL:
+            equality();
+            a.alu(ALU_TEST, RAX, RAX);
+            jump(CC_E);
+            return true;
+        case OP_JUMP_IF_LESS: compareJump(true, CC_A); return true;
+        case OP_JUMP_IF_NOT_LESS: compareJump(true, CC_BE); return true;
+        case OP_JUMP_IF_GREATER: compareJump(false, CC_A); return true;
+        case OP_JUMP_IF_NOT_GREATER: compareJump(false, CC_BE); return true;
+        case OP_ADD_LOCAL_CONSTANT: localConstant(SSE_ADD); return true;
+        case OP_SUBTRACT_LOCAL_CONSTANT: localConstant(SSE_SUB); return true;
+        case OP_CALL:
+            storeIp(offset + 2);
+            a.mov(RDI, VMR);
+            a.mov(RSI, SP);
+            a.movImmediate32(RDX, operand(0));
+            callHelper((void*)&VM::jitCall);
+            return true;
+        case OP_TAIL_CALL:
+            storeIp(offset + 2);
+            a.mov(RDI, VMR);
+            a.mov(RSI, SP);
+            a.movImmediate32(RDX, operand(0));
+            callHelper((void*)&VM::jitTailCall);
+            leave(JitStatus::tailCall);
+            return true;
+        case OP_INVOKE:
+            storeIp(offset + 5);
+            a.mov(RDI, VMR);
+            a.mov(RSI, SP);
+            a.movImmediate(RDX, (uint64_t)(uintptr_t)chunk.constants[operand(0)].getString());
+            a.movImmediate32(RCX, operand(1));
+            callHelper((void*)&VM::jitInvoke);
+            return true;
+        case OP_RETURN:
+            a.mov(RDI, VMR);
+            a.mov(RSI, SP);
+            a.call((void*)&VM::jitReturn);
+            a.mov(SP, RAX);
+            leave(JitStatus::returned);
+            return true;
+        default:
+            return false;
+        }
+    }
+
+public:
+    JitCompiler(Function* function, Value* globals) : function(function), chunk(function->chunk), globals(globals) {}
+
+    bool compile() {
+        targets.assign(chunk.code.size() + 1, false);
+        targets[0] = true;
+        for (offset = 0; offset < chunk.code.size(); offset += instructionLength(chunk, offset)) {
+            switch (chunk.code[offset]) {
+            case OP_JUMP:
+            case OP_JUMP_IF_FALSE:
+            case OP_LOOP:
+            case OP_POP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_EQUAL:
+            case OP_JUMP_IF_NOT_EQUAL:
+            case OP_JUMP_IF_LESS:
+            case OP_JUMP_IF_NOT_LESS:
+            case OP_JUMP_IF_GREATER:
+            case OP_JUMP_IF_NOT_GREATER:
+                targets[jumpTarget()] = true;
+                break;
+            }
+        }
+
+        native.assign(chunk.code.size() + 1, SIZE_MAX);
+        std::vector<bool> supported(chunk.code.size() + 1, false);
+        for (offset = 0; offset < chunk.code.size(); offset += instructionLength(chunk, offset)) {
+            native[offset] = a.here();
+            size_t start = a.here();
+            supported[offset] = translate();
+            if (!supported[offset]) {
+                a.code.resize(start);
+                exits.push_back({ a.jmp(), offset });
+            }
+        }
+
+        for (auto& jump : jumps) {
+            a.patch(jump.first, native[jump.second]);
+        }
+
+        for (auto& exit : exits) {
+            a.patch(exit.first, a.here());
+            storeIp(exit.second);
+            leave(JitStatus::exit);
+        }
+
+        size_t error = a.here();
+        a.movImmediate32(RAX, (uint32_t)JitStatus::error);
+        for (size_t at : errors) {
+            a.patch(at, error);
+        }
+
+        size_t epilogue = a.here();
+        for (size_t at : epilogues) {
+            a.patch(at, epilogue);
+        }
+        emitEpilogue(a);
+
+        uint8_t* code = arena.allocate(a.code);
+        if (code == nullptr) return false;
+
+        function->jitEntries.assign(chunk.code.size(), nullptr);
+        for (size_t at = 0; at < chunk.code.size(); at++) {
+            if (targets[at] && supported[at]) function->jitEntries[at] = code + native[at];
+        }
+        return true;
+    }
+};
+
+bool compileJit(Function* function, Value* globals) {
+    function->jitCompiled = true;
+    function->jitGlobals = globals;
+    function->jitEntries.clear();
+    if (function->loops.empty()) function->loops.resize(function->chunk.code.size());
+
+    if (trampoline == nullptr && !buildTrampoline()) return false;
+
+    JitCompiler compiler(function, globals);
+    return compiler.compile();
+}
+
+JitStatus enterJit(VM* vm, CallFrame* frame, Value** stackTop, uint8_t* target) {
+    return trampoline(vm, frame, stackTop, target);
+}
+
+// The tracing tier records one iteration of a hot loop as the interpreter
+// executes it. The recording is straight-line SSA over unboxed doubles: loads
+// and stores of the frame's slots and of globals, arithmetic, and guards that
+// pin the branches the iteration took. Type guards on everything read run once
+// before the loop, together with any value the loop doesn't change. Values live
+// in xmm registers, and each guard carries a snapshot of the operand stack
+// that its exit writes back before the interpreter resumes at the untaken path.
+
+enum class IrOp {
+    constant, loadSlot, loadGlobal, storeSlot, storeGlobal,
+    add, subtract, multiply, divide, negate,
+    less, greater, equal, guard,
+};
+
+enum class IrType {
+    number, boolean, other,
+};
+
+struct IrInstruction {
+    IrOp op;
+    IrType type;
+    int a = -1;
+    int b = -1;
+    int slot = 0;
+    Value* address = nullptr;
+    Value value;
+    // Conditions: the comparison's result is inverted.
+    bool negated = false;
+    // Guards: the truthiness condition a had while recording.
+    bool expected = false;
+    int snapshot = -1;
+
+    IrInstruction(IrOp op, IrType type) : op(op), type(type) {}
+
+    bool isCondition() const {
+        return op == IrOp::less || op == IrOp::greater || op == IrOp::equal;
+    }
+};
+
+// Where a guard's exit resumes and the operand stack above the loop's base.
+struct Snapshot {
+    size_t ip;
+    std::vector<int> stack;
+};
+
+static IrType typeOf(Value value) {
+    if (value.isNumber()) return IrType::number;
+    if (value.isBoolean()) return IrType::boolean;
+    return IrType::other;
+}
+
+static bool falsey(Value value) {
+    return value.isNil() || (value.isBoolean() && !value.getBoolean());
+}
+
+class TraceRecorder {
+private:
+    friend class TraceCompiler;
+
+    Function* function;
+    Chunk& chunk;
+    CallFrame* frame;
+    Value* globals;
+    size_t header;
+    int base;
+    int length = 0;
+    bool closed = false;
+
+    std::vector<IrInstruction> ir;
+    std::vector<Snapshot> snapshots;
+    std::vector<int> stack;
+    std::vector<int> slotValues;
+    std::unordered_map<Value*, int> globalValues;
+    std::vector<bool> visited;
+
+    // A conditional jump is resolved by the next instruction's offset.
+    bool branchPending = false;
+    int branchCondition = -1;
+    bool jumpIfTruthy = false;
+    size_t branchTarget = 0;
+    size_t branchFallthrough = 0;
+
+    uint16_t shortOperand(size_t offset) {
+        return (uint16_t)((chunk.code[offset + 1] << 8) | chunk.code[offset + 2]);
+    }
+
+    int emit(const IrInstruction& instruction) {
+        ir.push_back(instruction);
+        return (int)ir.size() - 1;
+    }
+
+    // Reuses an earlier pure instruction with the same operands.
+    int find(const IrInstruction& instruction) {
+        for (size_t i = 0; i < ir.size(); i++) {
+            const IrInstruction& other = ir[i];
+            if (other.op == instruction.op && other.a == instruction.a && other.b == instruction.b &&
+                other.negated == instruction.negated) {
+                return (int)i;
+            }
+        }
+        return emit(instruction);
+    }
+
+    int constant(Value value) {
+        for (size_t i = 0; i < ir.size(); i++) {
+            if (ir[i].op == IrOp::constant && ir[i].value.bits == value.bits) return (int)i;
+        }
+
+        IrInstruction instruction(IrOp::constant, typeOf(value));
+        instruction.value = value;
+        return emit(instruction);
+    }
+
+    bool isNumber(int ref) {
+        return ref >= 0 && ir[ref].type == IrType::number;
+    }
+
+    bool isConstant(int ref) {
+        return ir[ref].op == IrOp::constant;
+    }
+
+    int pop() {
+        if (stack.empty()) return -1;
+        int ref = stack.back();
+        stack.pop_back();
+        return ref;
+    }
+
+    int arithmetic(IrOp op, int a, int b) {
+        if (!isNumber(a) || !isNumber(b)) return -1;
+
+        if (isConstant(a) && isConstant(b)) {
+            double x = ir[a].value.getNumber();
+            double y = ir[b].value.getNumber();
+            switch (op) {
+            case IrOp::add: return constant(Value(x + y));
+            case IrOp::subtract: return constant(Value(x - y));
+            case IrOp::multiply: return constant(Value(x * y));
+            default: return constant(Value(x / y));
+            }
+        }
+
+        IrInstruction instruction(op, IrType::number);
+        instruction.a = a;
+        instruction.b = b;
+        return find(instruction);
+    }
+
+    int negate(int a) {
+        if (!isNumber(a)) return -1;
+        if (isConstant(a)) return constant(Value(-ir[a].value.getNumber()));
+
+        IrInstruction instruction(IrOp::negate, IrType::number);
+        instruction.a = a;
+        return find(instruction);
+    }
+
+    int compare(IrOp op, int a, int b, bool negated) {
+        if (!isNumber(a) || !isNumber(b)) return -1;
+
+        if (isConstant(a) && isConstant(b)) {
+            double x = ir[a].value.getNumber();
+            double y = ir[b].value.getNumber();
+            bool result = op == IrOp::less ? x < y : op == IrOp::greater ? x > y : x == y;
+            return constant(Value(result != negated));
+        }
+
+        IrInstruction instruction(op, IrType::boolean);
+        instruction.a = a;
+        instruction.b = b;
+        instruction.negated = negated;
+        return find(instruction);
+    }
+
+    int invert(int a) {
+        if (a < 0) return -1;
+        if (isConstant(a)) return constant(Value(falsey(ir[a].value)));
+        if (ir[a].type == IrType::number) return constant(Value(false));
+        if (!ir[a].isCondition()) return -1;
+        return compare(ir[a].op, ir[a].a, ir[a].b, !ir[a].negated);
+    }
+
+    // Slots below the loop's base live in memory across iterations; the ones
+    // above it are the iteration's own temporaries and locals.
+    int loadLocal(int slot) {
+        if (slot >= base) {
+            if (slot - base >= (int)stack.size()) return -1;
+            return stack[slot - base];
+        }
+        if (slotValues[slot] >= 0) return slotValues[slot];
+        if (!frame->slots[slot].isNumber()) return -1;
+
+        IrInstruction instruction(IrOp::loadSlot, IrType::number);
+        instruction.slot = slot;
+        return slotValues[slot] = emit(instruction);
+    }
+
+    bool storeLocal(int slot, int ref) {
+        if (ref < 0) return false;
+        if (slot >= base) {
+            if (slot - base >= (int)stack.size()) return false;
+            stack[slot - base] = ref;
+            return true;
+        }
+        if (!isNumber(ref)) return false;
+
+        IrInstruction instruction(IrOp::storeSlot, IrType::other);
+        instruction.slot = slot;
+        instruction.a = ref;
+        emit(instruction);
+        slotValues[slot] = ref;
+        return true;
+    }
+
+    int loadGlobal(uint16_t index) {
+        Value* address = &globals[index];
+        auto found = globalValues.find(address);
+        if (found != globalValues.end()) return found->second;
+        if (!address->isNumber()) return -1;
+
+        IrInstruction instruction(IrOp::loadGlobal, IrType::number);
+        instruction.address = address;
+        return globalValues[address] = emit(instruction);
+    }
+
+    bool storeGlobal(uint16_t index, int ref) {
+        Value* address = &globals[index];
+        if (!isNumber(ref) || address->isUndefined()) return false;
+
+        IrInstruction instruction(IrOp::storeGlobal, IrType::other);
+        instruction.address = address;
+        instruction.a = ref;
+        emit(instruction);
+        globalValues[address] = ref;
+        return true;
+    }
+
+    bool push(int ref) {
+        if (ref < 0) return false;
+        stack.push_back(ref);
+        return true;
+    }
+
+    bool binary(IrOp op) {
+        int b = pop();
+        int a = pop();
+        return push(arithmetic(op, a, b));
+    }
+
+    bool comparison(IrOp op, bool negated) {
+        int b = pop();
+        int a = pop();
+        return push(compare(op, a, b, negated));
+    }
+
+    bool branch(size_t offset, int condition, bool ifTruthy) {
+        if (condition < 0) return false;
+        branchPending = true;
+        branchCondition = condition;
+        jumpIfTruthy = ifTruthy;
+        branchFallthrough = offset + 3;
+        branchTarget = offset + 3 + shortOperand(offset);
+        return true;
+    }
+
+    bool compareBranch(size_t offset, IrOp op, bool ifTruthy) {
+        int b = pop();
+        int a = pop();
+        return branch(offset, compare(op, a, b, false), ifTruthy);
+    }
+
+    // Numbers, constants and conditions are the only things an exit can
+    // write back; the condition being guarded is known to have flipped.
+    int snapshot(size_t ip, int guarded) {
+        for (int ref : stack) {
+            if (ir[ref].isCondition() && ref != guarded) return -1;
+        }
+
+        snapshots.push_back({ ip, stack });
+        return (int)snapshots.size() - 1;
+    }
+
+    bool resolveBranch(size_t offset) {
+        branchPending = false;
+        bool taken = offset == branchTarget;
+        if (!taken && offset != branchFallthrough) return false;
+        if (!ir[branchCondition].isCondition()) return true;
+
+        int exit = snapshot(taken ? branchFallthrough : branchTarget, branchCondition);
+        if (exit < 0) return false;
+
+        IrInstruction guard(IrOp::guard, IrType::other);
+        guard.a = branchCondition;
+        guard.expected = taken == jumpIfTruthy;
+        guard.snapshot = exit;
+        emit(guard);
+        return true;
+    }
+
+public:
+    TraceRecorder(CallFrame* frame, Value* globals) : function(frame->closure->function), chunk(function->chunk),
+        frame(frame), globals(globals) {
+        header = frame->ip - chunk.code.data();
+        base = 0;
+        visited.assign(chunk.code.size(), false);
+    }
+
+    bool record(CallFrame* current, uint8_t* ip, Value* sp);
+    void finish();
+};
+
+bool TraceRecorder::record(CallFrame* current, uint8_t* ip, Value* sp) {
+    if (current != frame || current->closure->function != function) return false;
+
+    if (snapshots.empty()) {
+        // Recording starts at the loop header. Exit 0 leaves before the first
+        // iteration and has nothing to restore.
+        base = (int)(sp - frame->slots);
+        slotValues.assign(base, -1);
+        snapshots.push_back({ header, {} });
+    }
+
+    size_t offset = ip - chunk.code.data();
+    if (offset >= chunk.code.size()) return false;
+    if (branchPending && !resolveBranch(offset)) return false;
+    if (sp - frame->slots != base + (int)stack.size()) return false;
+    if (visited[offset] || ++length > TRACE_MAX_LENGTH) return false;
+    visited[offset] = true;
+
+    switch (chunk.code[offset]) {
+    case OP_CONSTANT: return push(constant(chunk.constants[ip[1]]));
+    case OP_NIL: return push(constant(Value()));
+    case OP_TRUE: return push(constant(Value(true)));
+    case OP_FALSE: return push(constant(Value(false)));
+    case OP_POP: return pop() >= 0;
+    case OP_GET_LOCAL: return push(loadLocal(ip[1]));
+    case OP_SET_LOCAL: return !stack.empty() && storeLocal(ip[1], stack.back());
+    case OP_SET_LOCAL_POP: return storeLocal(ip[1], pop());
+    case OP_GET_GLOBAL: return push(loadGlobal(shortOperand(offset)));
+    case OP_SET_GLOBAL: return !stack.empty() && storeGlobal(shortOperand(offset), stack.back());
+    case OP_SET_GLOBAL_POP: return storeGlobal(shortOperand(offset), pop());
+    case OP_ADD:
+    case OP_ADD_NUM: return binary(IrOp::add);
+    case OP_SUBTRACT: return binary(IrOp::subtract);
+    case OP_MULTIPLY: return binary(IrOp::multiply);
+    case OP_DIVIDE: return binary(IrOp::divide);
+    case OP_NEGATE: return push(negate(pop()));
+    case OP_NOT: return push(invert(pop()));
+    case OP_LESS: return comparison(IrOp::less, false);
+    case OP_GREATER: return comparison(IrOp::greater, false);
+    case OP_EQUAL:
+    case OP_EQUAL_NUM: return comparison(IrOp::equal, false);
+    case OP_NOT_EQUAL: return comparison(IrOp::equal, true);
+    case OP_GREATER_EQUAL: return comparison(IrOp::less, true);
+    case OP_LESS_EQUAL: return comparison(IrOp::greater, true);
+    case OP_ADD_LOCAL_CONSTANT:
+        return push(arithmetic(IrOp::add, loadLocal(ip[1]), constant(chunk.constants[ip[2]])));
+    case OP_SUBTRACT_LOCAL_CONSTANT:
+        return push(arithmetic(IrOp::subtract, loadLocal(ip[1]), constant(chunk.constants[ip[2]])));
+    case OP_JUMP: return true;
+    case OP_JUMP_IF_FALSE: return !stack.empty() && branch(offset, stack.back(), false);
+    case OP_POP_JUMP_IF_FALSE: return branch(offset, pop(), false);
+    case OP_JUMP_IF_EQUAL: return compareBranch(offset, IrOp::equal, true);
+    case OP_JUMP_IF_NOT_EQUAL: return compareBranch(offset, IrOp::equal, false);
+    case OP_JUMP_IF_LESS: return compareBranch(offset, IrOp::less, true);
+    case OP_JUMP_IF_NOT_LESS: return compareBranch(offset, IrOp::less, false);
+    case OP_JUMP_IF_GREATER: return compareBranch(offset, IrOp::greater, true);
+    case OP_JUMP_IF_NOT_GREATER: return compareBranch(offset, IrOp::greater, false);
+    case OP_LOOP:
+        // for loops jump back to their increment and then to the condition;
+        // only the jump to where recording started closes the trace.
+        if (offset + 3 - shortOperand(offset) != header) return true;
+        closed = stack.empty();
+        return false;
+    default:
+        return false;
+    }
+}
+
+// xmm0 and xmm1 are left as scratch.
+const int TRACE_FIRST_XMM = 2;
+const int TRACE_XMM_COUNT = 14;
+
+class TraceCompiler {
+private:
+    TraceRecorder& trace;
+    std::vector<IrInstruction>& ir;
+    Assembler a;
+
+    std::vector<bool> live;
+    std::vector<bool> invariant;
+    std::vector<int> lastUse;
+    std::vector<int> registers;
+    std::vector<std::vector<size_t>> exits;
+    bool inPreheader = false;
+
+    bool isBody(int ref) {
+        return live[ref] && !invariant[ref];
+    }
+
+    bool isArithmetic(const IrInstruction& instruction) {
+        switch (instruction.op) {
+        case IrOp::add:
+        case IrOp::subtract:
+        case IrOp::multiply:
+        case IrOp::divide:
+        case IrOp::negate:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // The values instruction i reads from registers. A guard reads its
+    // condition's operands and the numbers its exit writes back.
+    std::vector<int> uses(int i) {
+        std::vector<int> refs;
+        IrInstruction& instruction = ir[i];
+        if (instruction.op == IrOp::guard) {
+            refs.push_back(ir[instruction.a].a);
+            refs.push_back(ir[instruction.a].b);
+            for (int ref : trace.snapshots[instruction.snapshot].stack) {
+                if (ir[ref].op != IrOp::constant && !ir[ref].isCondition()) refs.push_back(ref);
+            }
+        } else if (!instruction.isCondition()) {
+            if (instruction.a >= 0) refs.push_back(instruction.a);
+            if (instruction.b >= 0) refs.push_back(instruction.b);
+        }
+        return refs;
+    }
+
+    // Keeps what the stores and guards depend on and finds the values that
+    // don't change inside the loop.
+    void analyze() {
+        size_t count = ir.size();
+        live.assign(count, false);
+        lastUse.assign(count, -1);
+
+        for (int i = (int)count - 1; i >= 0; i--) {
+            IrOp op = ir[i].op;
+            if (op == IrOp::storeSlot || op == IrOp::storeGlobal || op == IrOp::guard) live[i] = true;
+            if (!live[i]) continue;
+
+            for (int ref : uses(i)) {
+                live[ref] = true;
+                lastUse[ref] = std::max(lastUse[ref], i);
+            }
+        }
+
+        std::vector<bool> storedSlots(trace.base, false);
+        std::unordered_map<Value*, bool> storedGlobals;
+        for (IrInstruction& instruction : ir) {
+            if (instruction.op == IrOp::storeSlot) storedSlots[instruction.slot] = true;
+            if (instruction.op == IrOp::storeGlobal) storedGlobals[instruction.address] = true;
+        }
+
+        invariant.assign(count, false);
+        for (size_t i = 0; i < count; i++) {
+            IrInstruction& instruction = ir[i];
+            switch (instruction.op) {
+            case IrOp::constant: invariant[i] = true; break;
+            case IrOp::loadSlot: invariant[i] = !storedSlots[instruction.slot]; break;
+            case IrOp::loadGlobal: invariant[i] = storedGlobals.count(instruction.address) == 0; break;
+            case IrOp::negate: invariant[i] = invariant[instruction.a]; break;
+            default:
+                if (isArithmetic(instruction)) invariant[i] = invariant[instruction.a] && invariant[instruction.b];
+                break;
+            }
+        }
+    }
+
+    void release(std::vector<int>& active, std::vector<int>& free, int at) {
+        for (size_t j = 0; j < active.size();) {
+            if (lastUse[active[j]] <= at) {
+                free.push_back(registers[active[j]]);
+                active[j] = active.back();
+                active.pop_back();
+            } else {
+                j++;
+            }
+        }
+    }
+
+    // Invariant values the body reads keep a register for the whole trace;
+    // the rest are allocated linearly and freed after their last use.
+    // Constants get whatever registers the body never touches and are
+    // otherwise loaded into a scratch register where they are used.
+    bool allocate() {
+        size_t count = ir.size();
+        registers.assign(count, -1);
+
+        std::vector<bool> permanent(count, false);
+        for (size_t i = 0; i < count; i++) {
+            if (!isBody(i)) continue;
+            for (int ref : uses(i)) {
+                if (invariant[ref]) permanent[ref] = true;
+            }
+        }
+
+        std::vector<int> free;
+        for (int r = TRACE_FIRST_XMM + TRACE_XMM_COUNT - 1; r >= TRACE_FIRST_XMM; r--) free.push_back(r);
+
+        std::vector<int> active;
+        for (size_t i = 0; i < count; i++) {
+            if (!live[i] || !invariant[i] || ir[i].op == IrOp::constant) continue;
+            if (free.empty()) return false;
+            registers[i] = free.back();
+            free.pop_back();
+            if (!permanent[i]) active.push_back(i);
+            release(active, free, i);
+        }
+        for (int ref : active) free.push_back(registers[ref]);
+        active.clear();
+
+        std::vector<bool> touched(TRACE_FIRST_XMM + TRACE_XMM_COUNT, false);
+        for (size_t i = 0; i < count; i++) {
+            if (isBody(i) && ir[i].type == IrType::number) {
+                if (free.empty()) return false;
+                registers[i] = free.back();
+                free.pop_back();
+                touched[registers[i]] = true;
+                active.push_back(i);
+            }
+            release(active, free, i);
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            if (ir[i].op != IrOp::constant || !permanent[i] || ir[i].type != IrType::number) continue;
+            for (size_t j = 0; j < free.size(); j++) {
+                if (touched[free[j]]) continue;
+                registers[i] = free[j];
+                free.erase(free.begin() + j);
+                break;
+            }
+        }
+        return true;
+    }
+
+    // The register holding ref, loading a constant into scratch if needed.
+    int operand(int ref, int scratch) {
+        if (registers[ref] >= 0 && !(inPreheader && ir[ref].op == IrOp::constant)) return registers[ref];
+
+        a.movImmediate(RAX, ir[ref].value.bits);
+        a.movqToXmm(scratch, RAX);
+        return scratch;
+    }
+
+    void exitIf(Condition condition, int snapshot) {
+        exits[snapshot].push_back(a.jcc(condition));
+    }
+
+    void guardNumber(int snapshot) {
+        a.mov(RDX, RAX);
+        a.alu(ALU_AND, RDX, MASK);
+        a.alu(ALU_CMP, RDX, MASK);
+        exitIf(CC_E, snapshot);
+    }
+
+    // Checks the types the recording saw and computes the invariant values.
+    void emitPreheader() {
+        inPreheader = true;
+        std::unordered_map<Value*, bool> loadedGlobals;
+        for (size_t i = 0; i < ir.size(); i++) {
+            IrInstruction& instruction = ir[i];
+            if (!live[i]) continue;
+
+            switch (instruction.op) {
+            case IrOp::loadSlot:
+                a.load(RAX, SLOTS, instruction.slot * sizeof(Value));
+                guardNumber(0);
+                if (registers[i] >= 0 && invariant[i]) a.movqToXmm(registers[i], RAX);
+                break;
+            case IrOp::loadGlobal:
+                loadedGlobals[instruction.address] = true;
+                a.movImmediate(RCX, (uint64_t)(uintptr_t)instruction.address);
+                a.load(RAX, RCX, 0);
+                guardNumber(0);
+                if (registers[i] >= 0 && invariant[i]) a.movqToXmm(registers[i], RAX);
+                break;
+            case IrOp::storeGlobal:
+                if (loadedGlobals.count(instruction.address)) break;
+                loadedGlobals[instruction.address] = true;
+                a.movImmediate(RCX, (uint64_t)(uintptr_t)instruction.address);
+                a.load(RAX, RCX, 0);
+                a.movImmediate(RDX, Value::undefined().bits);
+                a.alu(ALU_CMP, RAX, RDX);
+                exitIf(CC_E, 0);
+                break;
+            default:
+                if (invariant[i] && registers[i] >= 0 && instruction.op != IrOp::constant) emitValue(i);
+                break;
+            }
+        }
+
+        inPreheader = false;
+        for (size_t i = 0; i < ir.size(); i++) {
+            if (ir[i].op == IrOp::constant && registers[i] >= 0) emitValue(i);
+        }
+    }
+
+    void emitValue(int i) {
+        IrInstruction& instruction = ir[i];
+        int dst = registers[i];
+
+        switch (instruction.op) {
+        case IrOp::constant:
+            a.movImmediate(RAX, instruction.value.bits);
+            a.movqToXmm(dst, RAX);
+            break;
+        case IrOp::loadSlot:
+            a.movsdLoad(dst, SLOTS, instruction.slot * sizeof(Value));
+            break;
+        case IrOp::loadGlobal:
+            a.movImmediate(RAX, (uint64_t)(uintptr_t)instruction.address);
+            a.movsdLoad(dst, RAX, 0);
+            break;
+        case IrOp::storeSlot:
+            a.movsdStore(SLOTS, instruction.slot * sizeof(Value), operand(instruction.a, 0));
+            break;
+        case IrOp::storeGlobal: {
+            int value = operand(instruction.a, 0);
+            a.movImmediate(RAX, (uint64_t)(uintptr_t)instruction.address);
+            a.movsdStore(RAX, 0, value);
+            break;
+        }
+        case IrOp::add:
+        case IrOp::subtract:
+        case IrOp::multiply:
+        case IrOp::divide: {
+            SseOp op = instruction.op == IrOp::add ? SSE_ADD : instruction.op == IrOp::subtract ? SSE_SUB :
+                instruction.op == IrOp::multiply ? SSE_MUL : SSE_DIV;
+            int x = operand(instruction.a, 0);
+            int y = operand(instruction.b, 1);
+            if (dst != x) a.movapd(dst, x);
+            a.sse(op, dst, y);
+            break;
+        }
+        case IrOp::negate:
+            a.movqFromXmm(RAX, operand(instruction.a, 0));
+            a.movImmediate(RDX, SIGN_BIT);
+            a.alu(ALU_XOR, RAX, RDX);
+            a.movqToXmm(dst, RAX);
+            break;
+        case IrOp::guard:
+            emitGuard(instruction);
+            break;
+        default:
+            break;
+        }
+    }
+
+    // ucomisd sets CF/ZF like an unsigned compare and PF when either side is NaN.
+    void emitGuard(IrInstruction& guard) {
+        IrInstruction& condition = ir[guard.a];
+        int x = operand(condition.a, 0);
+        int y = operand(condition.b, 1);
+        bool holds = guard.expected != condition.negated;
+
+        if (condition.op == IrOp::equal) {
+            a.ucomisd(x, y);
+            if (holds) {
+                exitIf(CC_P, guard.snapshot);
+                exitIf(CC_NE, guard.snapshot);
+            } else {
+                size_t unordered = a.jcc(CC_P);
+                exitIf(CC_E, guard.snapshot);
+                a.patch(unordered, a.here());
+            }
+            return;
+        }
+
+        if (condition.op == IrOp::less) {
+            a.ucomisd(y, x);
+        } else {
+            a.ucomisd(x, y);
+        }
+        exitIf(holds ? CC_BE : CC_A, guard.snapshot);
+    }
+
+    void emitExit(int index, int guarded, bool expected) {
+        Snapshot& snapshot = trace.snapshots[index];
+        for (size_t i = 0; i < snapshot.stack.size(); i++) {
+            int ref = snapshot.stack[i];
+            int32_t displacement = (trace.base + i) * sizeof(Value);
+            if (ir[ref].op == IrOp::constant) {
+                a.movImmediate(RAX, ir[ref].value.bits);
+                a.store(SLOTS, displacement, RAX);
+            } else if (ref == guarded) {
+                a.movImmediate(RAX, Value(!expected).bits);
+                a.store(SLOTS, displacement, RAX);
+            } else {
+                a.movsdStore(SLOTS, displacement, registers[ref]);
+            }
+        }
+
+        a.mov(SP, SLOTS);
+        a.addImmediate(SP, (trace.base + snapshot.stack.size()) * sizeof(Value));
+        a.movImmediate(RAX, (uint64_t)(uintptr_t)(trace.chunk.code.data() + snapshot.ip));
+        a.store(FRAME, offsetof(CallFrame, ip), RAX);
+        a.movImmediate32(RAX, (uint32_t)JitStatus::exit);
+    }
+
+public:
+    TraceCompiler(TraceRecorder& trace) : trace(trace), ir(trace.ir) {}
+
+    uint8_t* compile() {
+        analyze();
+        if (!allocate()) {
+            // Too much to keep across the loop: recompute invariant
+            // arithmetic in every iteration instead.
+            for (size_t i = 0; i < ir.size(); i++) {
+                if (isArithmetic(ir[i])) invariant[i] = false;
+            }
+            if (!allocate()) return nullptr;
+        }
+
+        exits.assign(trace.snapshots.size(), {});
+        emitPreheader();
+
+        size_t loop = a.here();
+        for (size_t i = 0; i < ir.size(); i++) {
+            if (isBody(i)) emitValue(i);
+        }
+        a.patch(a.jmp(), loop);
+
+        std::vector<size_t> epilogues;
+        for (size_t index = 0; index < exits.size(); index++) {
+            if (exits[index].empty()) continue;
+            for (size_t at : exits[index]) {
+                a.patch(at, a.here());
+            }
+
+            int guarded = -1;
+            bool expected = false;
+            for (IrInstruction& instruction : ir) {
+                if (instruction.op == IrOp::guard && instruction.snapshot == (int)index) {
+                    guarded = instruction.a;
+                    expected = instruction.expected;
+                }
+            }
+            emitExit(index, guarded, expected);
+            epilogues.push_back(a.jmp());
+        }
+
+        for (size_t at : epilogues) {
+            a.patch(at, a.here());
+        }
+        emitEpilogue(a);
+
+        return arena.allocate(a.code);
+    }
+};
+
+void TraceRecorder::finish() {
+    LoopTrace& loop = function->loops[header];
+    uint8_t* code = nullptr;
+    if (closed && (trampoline != nullptr || buildTrampoline())) {
+        TraceCompiler compiler(*this);
+        code = compiler.compile();
+    }
+
+    if (code == nullptr) {
+        loop.aborts++;
+        return;
+    }
+    loop.code = code;
+    loop.globals = globals;
+}
+
+TraceRecorder* countLoop(CallFrame* frame, Value* globals) {
+    Function* function = frame->closure->function;
+    if (function->loops.empty()) function->loops.resize(function->chunk.code.size());
+
+    LoopTrace& loop = function->loops[frame->ip - function->chunk.code.data()];
+    if (loop.code != nullptr) return nullptr;
+    if (loop.aborts >= TRACE_MAX_ABORTS) {
+        // Keeps baseline code from leaving at this loop's back-edge.
+        loop.hotness = INT_MIN;
+        return nullptr;
+    }
+    if (++loop.hotness < TRACE_THRESHOLD) return nullptr;
+
+    loop.hotness = 0;
+    return new TraceRecorder(frame, globals);
+}
+
+bool recordTrace(TraceRecorder* recorder, CallFrame* frame, uint8_t* ip, Value* sp) {
+    if (recorder->record(frame, ip, sp)) return true;
+
+    recorder->finish();
+    delete recorder;
+    return false;
+}
+
+void abortTrace(TraceRecorder* recorder) {
+    recorder->finish();
+    delete recorder;
+}
+
+uint8_t* traceAt(CallFrame* frame, Value* globals) {
+    Function* function = frame->closure->function;
+    size_t offset = frame->ip - function->chunk.code.data();
+    if (offset >= function->loops.size()) return nullptr;
+
+    LoopTrace& loop = function->loops[offset];
+    if (loop.code != nullptr && loop.globals != globals) {
+        loop.code = nullptr;
+        loop.hotness = 0;
+    }
+    return loop.code;
+}
+
+#else
+
+bool compileJit(Function* function, Value* globals) {
+    function->jitCompiled = true;
+    return false;
+}
+
+JitStatus enterJit(VM* vm, CallFrame* frame, Value** stackTop, uint8_t* target) {
+    return JitStatus::exit;
+}
+
+TraceRecorder* countLoop(CallFrame* frame, Value* globals) {
+    return nullptr;
+}
+
+bool recordTrace(TraceRecorder* recorder, CallFrame* frame, uint8_t* ip, Value* sp) {
+    return false;
+}
+
+void abortTrace(TraceRecorder* recorder) {}
+
+uint8_t* traceAt(CallFrame* frame, Value* globals) {
+    return nullptr;
+}
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef jit_h
+#define jit_h
+
+#include "value.h"
+
+// The baseline JIT emits x86-64 machine code and relies on NaN-boxed values.
+// Define NO_JIT to build without it.
+#if defined(__x86_64__) && defined(__linux__) && defined(NAN_BOXING) && !defined(NO_JIT)
+#define JIT
+#endif
+
+// Calls plus loop back-edges a function runs before it is compiled.
+const int JIT_THRESHOLD = 1000;
+// Back-edges to one loop header before an iteration is recorded as a trace.
+const int TRACE_THRESHOLD = 50;
+// Failed recordings after which a loop is left alone.
+const int TRACE_MAX_ABORTS = 3;
+const int TRACE_MAX_LENGTH = 500;
+
+enum class JitStatus {
+    returned, exit, tailCall, error
+};
+
+struct CallFrame;
+class TraceRecorder;
+
+// Native code runs on the VM stack. It is entered at a bytecode offset that
+// has an entry in Function::jitEntries and leaves with the frame's ip and the
+// stack top stored back, so the interpreter can pick up where it stopped.
+typedef JitStatus (*JitEntry)(VM* vm, CallFrame* frame, Value** stackTop, uint8_t* target);
+
+bool compileJit(Function* function, Value* globals);
+JitStatus enterJit(VM* vm, CallFrame* frame, Value** stackTop, uint8_t* target);
+
+// Counts a back-edge to the loop header at frame->ip and returns a recorder
+// once the loop is hot. The interpreter then passes every instruction it is
+// about to execute to recordTrace until it returns false; by then the
+// recorder is freed and the trace, if any, is installed.
+TraceRecorder* countLoop(CallFrame* frame, Value* globals);
+bool recordTrace(TraceRecorder* recorder, CallFrame* frame, uint8_t* ip, Value* sp);
+void abortTrace(TraceRecorder* recorder);
+// The trace for the loop header at frame->ip, entered like any JIT entry.
+uint8_t* traceAt(CallFrame* frame, Value* globals);
+
+#endif
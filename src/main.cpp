@@ -2,6 +2,7 @@
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <cstdlib>
 #include "vm.h"
 
 void repl() {
@@ -17,18 +18,24 @@ void repl() {
     }
 }
 
-int runFile(const char* path) {
+bool readFile(const char* path, std::string& source) {
     std::ifstream file(path);
 
     if (!file) {
         std::cerr << "Could not open file \"" << path << "\"." << std::endl;
-        return 74;
+        return false;
     }
 
     std::stringstream buffer;
     buffer << file.rdbuf();
     file.close();
-    std::string source = buffer.str();
+    source = buffer.str();
+    return true;
+}
+
+int runFile(const char* path) {
+    std::string source;
+    if (!readFile(path, source)) return 74;
 
     switch (interpret(source)) {
     case InterpretResult::compileError:
@@ -39,16 +46,67 @@ int runFile(const char* path) {
     return 0;
 }
 
+// Writes the script's C++ translation to stdout.
+int emitFile(const char* path) {
+    std::string source;
+    if (!readFile(path, source)) return 74;
+
+    return emitCpp(source, std::cout) ? 0 : 65;
+}
+
 int main(int argc, const char* argv[]) {
-    if (argc == 1) {
+    if (!useHeapEnvironment()) return 64;
+
+    int arg = 1;
+    bool emit = false;
+    for (; arg < argc; arg++) {
+        std::string flag = argv[arg];
+        if (flag == "--registers") {
+            useRegisterTier(true);
+        } else if (flag == "--no-jit") {
+            useJit(false);
+        } else if (flag == "--emit-cpp") {
+            emit = true;
+        } else if (flag == "--gc-stats") {
+            useGCStats(true);
+        } else if (flag == "--cache-stats") {
+            useCacheStats(true);
+        } else if (flag.rfind("--heap-snapshot=", 0) == 0) {
+            useHeapSnapshot(flag.substr(16));
+        } else if (flag == "--alloc-profile") {
+            useAllocationProfile(1);
+        } else if (flag.rfind("--alloc-profile=", 0) == 0) {
+            char* end;
+            long rate = std::strtol(flag.c_str() + 16, &end, 10);
+            if (end == flag.c_str() + 16 || *end != '\0' || rate < 1) {
+                std::cerr << "Invalid value for --alloc-profile: " << flag.substr(16) << std::endl;
+                return 64;
+            }
+            useAllocationProfile(rate);
+        } else if (flag.rfind("--alloc-profile-json=", 0) == 0) {
+            useAllocationProfileJson(flag.substr(21));
+        } else if (flag == "--gc-concurrent") {
+            useConcurrentGC(true);
+        } else if (flag.rfind("--gc-pause=", 0) == 0 || flag.rfind("--gc-threshold=", 0) == 0 || flag.rfind("--gc-growth=", 0) == 0 || flag.rfind("--heap-max=", 0) == 0 || flag.rfind("--gc-compact=", 0) == 0) {
+            size_t equals = flag.find('=');
+            if (!useHeapOption(flag.substr(2, equals - 2), flag.c_str() + equals + 1)) {
+                std::cerr << "Invalid value for " << flag.substr(0, equals) << ": " << flag.substr(equals + 1) << std::endl;
+                return 64;
+            }
+        } else {
+            break;
+        }
+    }
+
+    if (argc == arg) {
         repl();
         return 0;
     }
 
-    if (argc == 2) {
-        return runFile(argv[1]);
+    if (argc == arg + 1) {
+        return emit ? emitFile(argv[arg]) : runFile(argv[arg]);
     }
 
-    std::cerr << "Usage: clox [path]" << std::endl;
+    std::cerr << "Usage: clox [--registers] [--no-jit] [--emit-cpp] [--gc-pause=ms] [--gc-concurrent] [--gc-stats] [--cache-stats] [--heap-snapshot=file] [--alloc-profile[=rate]] [--alloc-profile-json=file] [--gc-threshold=size] [--gc-growth=factor] [--heap-max=size] [--gc-compact=fraction] [path]" << std::endl;
     return 64;
 }
\ No newline at end of file
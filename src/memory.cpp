@@ -1,12 +1,238 @@
 #include "memory.h"
+#include "profiler.h"
 #include <iostream>
+#include <chrono>
+#include <cstdio>
+#include <algorithm>
+#include <fstream>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 const bool debugAllocation = false;
 const bool debugGC = false;
 
+static size_t classIndex(size_t size) {
+    return (size + POOL_GRANULE - 1) / POOL_GRANULE - 1;
+}
+
+size_t GC::bytesAllocated = 0;
+
+void heapBufferAllocated(size_t size) {
+    GC::bytesAllocated += size;
+}
+
+void heapBufferFreed(size_t size) {
+    GC::bytesAllocated -= size;
+}
+
+// Bytes a string keeps outside the object that holds it; none when its
+// characters fit inside the std::string itself.
+static size_t charsSize(const std::string& chars) {
+    const char* data = chars.data();
+    if (data >= (const char*)&chars && data < (const char*)(&chars + 1)) return 0;
+    return chars.capacity() + 1;
+}
+
+static double now() {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+const int GC_WORK_BATCH = 64;
+const size_t GC_SWEEP_BATCH = 4;
+
+const double PAUSE_BUCKET_LIMITS[PAUSE_BUCKETS - 1] = {0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1, 2, 5, 10, 20, 50, 100};
+
+void PauseStats::record(double ms) {
+    count++;
+    total += ms;
+    if (ms > max) max = ms;
+
+    int bucket = 0;
+    while (bucket < PAUSE_BUCKETS - 1 && ms > PAUSE_BUCKET_LIMITS[bucket]) {
+        bucket++;
+    }
+    buckets[bucket]++;
+}
+
+static PoolPage* mapPage() {
+#ifdef _WIN32
+    // Windows places allocations on 64 KB boundaries.
+    void* page = VirtualAlloc(nullptr, POOL_PAGE_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (page == nullptr) throw std::bad_alloc();
+    return (PoolPage*)page;
+#else
+    // mmap only aligns to the system page size, so map twice as much.
+    char* memory = (char*)mmap(nullptr, 2 * POOL_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) throw std::bad_alloc();
+    char* page = (char*)(((uintptr_t)memory + POOL_PAGE_SIZE - 1) & ~(uintptr_t)(POOL_PAGE_SIZE - 1));
+    if (page > memory) munmap(memory, page - memory);
+    munmap(page + POOL_PAGE_SIZE, memory + POOL_PAGE_SIZE - page);
+    return (PoolPage*)page;
+#endif
+}
+
+static void unmapPage(PoolPage* page) {
+#ifdef _WIN32
+    VirtualFree(page, 0, MEM_RELEASE);
+#else
+    munmap(page, POOL_PAGE_SIZE);
+#endif
+}
+
+void PoolPage::clearMarks() {
+    for (size_t i = 0; i < POOL_BITMAP_WORDS; i++) {
+        markBits[i].store(0, std::memory_order_relaxed);
+        claimBits[i].store(0, std::memory_order_relaxed);
+        scannedBits[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void* PoolAllocator::allocate(size_t size) {
+    SizeClass& sizeClass = classes[classIndex(size)];
+    char* cell;
+    if (sizeClass.freeList != nullptr) {
+        cell = (char*)sizeClass.freeList;
+        sizeClass.freeList = sizeClass.freeList->next;
+    } else {
+        size_t cellSize = (classIndex(size) + 1) * POOL_GRANULE;
+        if (sizeClass.cursor == nullptr || sizeClass.cursor + cellSize > sizeClass.limit) {
+            PoolPage* page = new (mapPage()) PoolPage();
+            page->cellSize = cellSize;
+            pages.push_back(page);
+            sizeClass.cursor = (char*)page + POOL_PAGE_HEADER;
+            sizeClass.limit = (char*)page + POOL_PAGE_SIZE;
+        }
+        cell = sizeClass.cursor;
+        sizeClass.cursor += cellSize;
+    }
+
+    size_t granule = PoolPage::granule(cell);
+    PoolPage::of(cell)->objectBits[granule / 64] |= PoolPage::bit(granule);
+    return cell;
+}
+
+void PoolAllocator::release(void* memory, size_t size) {
+    size_t granule = PoolPage::granule(memory);
+    PoolPage::of(memory)->objectBits[granule / 64] &= ~PoolPage::bit(granule);
+
+    SizeClass& sizeClass = classes[classIndex(size)];
+    FreeCell* cell = (FreeCell*)memory;
+    cell->next = sizeClass.freeList;
+    sizeClass.freeList = cell;
+}
+
+void PoolAllocator::clearMarks() {
+    for (PoolPage* page : pages) {
+        page->clearMarks();
+    }
+}
+
+static size_t cellsPerPage(size_t cellSize) {
+    return (POOL_PAGE_SIZE - POOL_PAGE_HEADER) / cellSize;
+}
+
+void PoolAllocator::rebuildFreeLists() {
+    std::vector<PoolPage*> used;
+    for (PoolPage* page : pages) {
+        bool empty = true;
+        for (size_t word = 0; word < POOL_BITMAP_WORDS && empty; word++) {
+            empty = page->objectBits[word] == 0;
+        }
+        if (empty) {
+            unmapPage(page);
+        } else {
+            used.push_back(page);
+        }
+    }
+    pages.swap(used);
+
+    for (SizeClass& sizeClass : classes) {
+        sizeClass = SizeClass();
+    }
+    for (size_t i = pages.size(); i-- > 0;) {
+        PoolPage* page = pages[i];
+        SizeClass& sizeClass = classes[classIndex(page->cellSize)];
+        for (size_t cell = cellsPerPage(page->cellSize); cell-- > 0;) {
+            char* memory = (char*)page + POOL_PAGE_HEADER + cell * page->cellSize;
+            size_t granule = PoolPage::granule(memory);
+            if (page->objectBits[granule / 64] & PoolPage::bit(granule)) continue;
+
+            FreeCell* freeCell = (FreeCell*)memory;
+            freeCell->next = sizeClass.freeList;
+            sizeClass.freeList = freeCell;
+        }
+    }
+}
+
+PoolAllocator::~PoolAllocator() {
+    for (PoolPage* page : pages) {
+        unmapPage(page);
+    }
+}
+
+String* StringTable::find(const std::string& chars, uint32_t hash) {
+    if (entries.empty()) return nullptr;
+
+    size_t mask = entries.size() - 1;
+    for (size_t index = hash & mask;; index = (index + 1) & mask) {
+        String* string = entries[index];
+        if (string == nullptr) return nullptr;
+        if (string->hash == hash && string->chars == chars) return string;
+    }
+}
+
+void StringTable::insert(String* string) {
+    if ((count + 1) * 4 > entries.size() * 3) {
+        std::vector<String*> old(entries.size() < 8 ? 8 : entries.size() * 2, nullptr);
+        old.swap(entries);
+        count = 0;
+        for (String* entry : old) {
+            if (entry != nullptr) insert(entry);
+        }
+    }
+
+    size_t mask = entries.size() - 1;
+    size_t index = string->hash & mask;
+    while (entries[index] != nullptr) {
+        index = (index + 1) & mask;
+    }
+    entries[index] = string;
+    count++;
+}
+
+void StringTable::removeUnmarked(bool youngOnly) {
+    std::vector<String*> old(entries.size(), nullptr);
+    old.swap(entries);
+    count = 0;
+    for (String* entry : old) {
+        if (entry == nullptr) continue;
+        if (GC::isMarked(&entry->object) || (youngOnly && entry->object.isOld)) insert(entry);
+    }
+}
+
+int Globals::resolve(String* name) {
+    auto slot = slots.find(name);
+    if (slot != slots.end()) return slot->second;
+
+    if (values.size() == 65536) return -1;
+
+    slots.insert({ name, (uint16_t)values.size() });
+    names.push_back(name);
+    values.push_back(Value::undefined());
+    return values.size() - 1;
+}
+
 void GC::markObject(Object* object) {
     if (object == nullptr) return;
-    if (object->isMarked) return;
+    if (minorCollection && object->isOld) return;
+    PoolPage* page = PoolPage::of(object);
+    if (page->isMarked(object)) return;
     if (debugGC) {
         if (object->type == ObjectType::String) {
             std::cout << object << " mark: `" << Value(object).stringify() << "`" << std::endl;
@@ -14,29 +240,30 @@ void GC::markObject(Object* object) {
             std::cout << object << " mark: " << Value(object).stringify() << std::endl;
         }
     }
-    object->isMarked = true;
+    page->mark(object);
     grayObjects.push_back(object);
 }
 
 void GC::markValue(Value value) {
-    if (value.type == ValueType::object) markObject(value.as.object);
+    if (value.isObject()) markObject(value.getObject());
 }
 
 void GC::markRoots() {
-    for (Value slot : *stack) {
-        markValue(slot);
+    for (Value* slot = stack; slot < *stackTop; slot++) {
+        markValue(*slot);
     }
 
     for (Upvalue* upvalue = *openUpvalues; upvalue != nullptr; upvalue = upvalue->next) {
         markObject((Object*)upvalue);
     }
 
-    for (auto global : *globals) {
-        markValue(global.second);
+    for (size_t i = 0; i < globals->values.size(); i++) {
+        markObject((Object*)globals->names[i]);
+        markValue(globals->values[i]);
     }
 
-    for (CallFrame frame : *frames) {
-        markObject((Object*)frame.closure);
+    for (int i = 0; i < *frameCount; i++) {
+        markObject((Object*)frames[i].closure);
     }
 
     Compiler* current = compiler;
@@ -48,55 +275,77 @@ void GC::markRoots() {
     if (*initString != nullptr) {
         markObject((Object*)*initString);
     }
-}
 
-void GC::blackenObject(Object* object) {
-    if (debugGC) {
-        if (object->type == ObjectType::String) {
-            std::cout << object << " blacken: `" << Value(object).stringify() << "`" << std::endl;
-        } else {
-            std::cout << object << " blacken: " << Value(object).stringify() << std::endl;
-        }
+    for (Shape* shape : shapes) {
+        markObject((Object*)shape->name);
     }
+}
 
+template <typename Mark>
+static void markValue(Mark& mark, Value value) {
+    if (value.isObject()) mark(value.getObject());
+}
+
+template <typename Mark>
+static void forEachReference(Object* object, Mark mark) {
     switch (object->type) {
     case ObjectType::Closure: {
         Closure* closure = (Closure*)object;
-        markObject((Object*)closure->function);
+        mark((Object*)closure->function);
         for (Upvalue* upvalue : closure->upvalues) {
-            markObject((Object*)upvalue);
+            mark((Object*)upvalue);
         }
         break;
     }
     case ObjectType::Function: {
         Function* function = (Function*)object;
         for (Value constant : function->chunk.constants) {
-            markValue(constant);
+            markValue(mark, constant);
+        }
+        for (InlineCache& cache : function->chunk.caches) {
+            for (int i = 0; i < cache.count; i++) {
+                mark((Object*)cache.entries[i].klass);
+                mark((Object*)cache.entries[i].method);
+            }
         }
         break;
     }
     case ObjectType::Upvalue:
-        markValue(((Upvalue*)object)->closed);
+        markValue(mark, ((Upvalue*)object)->closed);
         break;
     case ObjectType::Class: {
         Class* klass = (Class*)object;
-        for (auto method : klass->methods) {
-            markValue(method.second);
+        for (auto& method : klass->methods) {
+            mark((Object*)method.first);
+            markValue(mark, method.second);
         }
         break;
     }
     case ObjectType::Instance: {
         Instance* instance = (Instance*)object;
-        markObject((Object*)instance->klass);
-        for (auto field : instance->fields) {
-            markValue(field.second);
+        mark((Object*)instance->klass);
+        for (Value field : instance->fields) {
+            markValue(mark, field);
+        }
+        if (instance->dictionary != nullptr) {
+            for (auto& field : *instance->dictionary) {
+                mark((Object*)field.first);
+                markValue(mark, field.second);
+            }
         }
         break;
     }
     case ObjectType::BoundMethod: {
         BoundMethod* bound = (BoundMethod*)object;
-        markValue(bound->receiver);
-        markObject((Object*)bound->method);
+        markValue(mark, bound->receiver);
+        mark((Object*)bound->method);
+        break;
+    }
+    case ObjectType::Array: {
+        Array* array = (Array*)object;
+        for (Value value : array->values) {
+            markValue(mark, value);
+        }
         break;
     }
     case ObjectType::Native:
@@ -105,6 +354,18 @@ void GC::blackenObject(Object* object) {
     }
 }
 
+void GC::blackenObject(Object* object) {
+    if (debugGC) {
+        if (object->type == ObjectType::String) {
+            std::cout << object << " blacken: `" << Value(object).stringify() << "`" << std::endl;
+        } else {
+            std::cout << object << " blacken: " << Value(object).stringify() << std::endl;
+        }
+    }
+
+    forEachReference(object, [this](Object* reference) { markObject(reference); });
+}
+
 void GC::traceReferences() {
     while (grayObjects.size() > 0) {
         Object* object = grayObjects[grayObjects.size() - 1];
@@ -114,43 +375,150 @@ void GC::traceReferences() {
 }
 
 void GC::sweep() {
-    Object* previous = nullptr;
-    Object* object = objects;
-    while (object != nullptr) {
-        if (object->isMarked) {
-            object->isMarked = false;
-            previous = object;
-            object = object->next;
+    for (size_t index = 0; index < allocator.pages.size() * POOL_BITMAP_WORDS; index++) {
+        sweepWord(index);
+    }
+}
+
+// Survivors keep their marks until the next major collection clears them;
+// young objects are left to sweepYoung.
+void GC::sweepWord(size_t index) {
+    PoolPage* page = allocator.pages[index / POOL_BITMAP_WORDS];
+    size_t word = index % POOL_BITMAP_WORDS;
+    uint64_t unmarked = page->objectBits[word] & ~page->markBits[word].load(std::memory_order_relaxed);
+    size_t before = bytesAllocated;
+    for (; unmarked != 0; unmarked &= unmarked - 1) {
+        Object* object = page->objectAt(word * 64 + __builtin_ctzll(unmarked));
+        if (object->isOld) freeObject(object);
+    }
+    oldBytesReclaimed += before - bytesAllocated;
+}
+
+void GC::sweepYoung() {
+    size_t before = bytesAllocated;
+    for (Object* object : youngObjects) {
+        if (isMarked(object)) {
+            object->isOld = true;
         } else {
-            Object* unreached = object;
-            object = object->next;
-            if (previous != nullptr) {
-                previous->next = object;
+            freeObject(object);
+        }
+    }
+    youngObjects.clear();
+    youngBytesReclaimed += before - bytesAllocated;
+}
+
+void GC::collectGarbage() {
+    if (heapMax != 0 && bytesAllocated > heapMax && !outOfMemory) {
+        count(GCTrigger::heapMax);
+        collectAll();
+        if (bytesAllocated > heapMax) {
+            outOfMemory = true;
+            // What fills the heap is still reachable from the stack now; by
+            // the time the program ends the error has unwound it.
+            if (!heapSnapshotPath.empty() && !heapSnapshotWritten) writeHeapSnapshot();
+        }
+        return;
+    }
+
+    if (debugGC || (pauseTarget == 0 && bytesAllocated >= nextGC)) {
+        count(GCTrigger::threshold);
+        collectAll();
+        return;
+    }
+
+    switch (phase) {
+    case GCPhase::idle:
+        if (bytesAllocated >= nextGC) {
+            count(GCTrigger::threshold);
+            if (concurrent) {
+                startConcurrentCycle();
             } else {
-                objects = object;
+                startCycle();
             }
+            return;
+        }
+        break;
+    case GCPhase::marking:
+        if (bytesAllocated >= nextStep) step();
+        break;
+    case GCPhase::concurrentMarking:
+        handOff();
+        // Wait for the marker rather than let the heap keep growing.
+        if (markerDone || bytesAllocated >= nextGC * 2) remarkConcurrent();
+        break;
+    case GCPhase::sweeping:
+        if (concurrent) {
+            sweepLazily();
+        } else if (bytesAllocated >= nextStep) {
+            step();
+        }
+        break;
+    }
 
-            freeObject(unreached);
+    // A minor collection would leave marks the major marking takes as done.
+    if (phase == GCPhase::idle || phase == GCPhase::sweeping) {
+        if (bytesAllocated >= bytesSurvived + NURSERY_SIZE) {
+            count(GCTrigger::nursery);
+            collectYoung();
         }
     }
 }
 
-void GC::collectGarbage() {
-    if (bytesAllocated < nextGC && !debugGC) {
-        return;
+void GC::collectYoung() {
+    if (debugGC) {
+        std::cout << std::endl << "-- minor gc begin" << std::endl;
     }
 
+    double start = now();
+    size_t before = bytesAllocated;
+    minorCollection = true;
+
+    markRoots();
+    for (Object* object : rememberedSet) {
+        object->isRemembered = false;
+        blackenObject(object);
+    }
+    rememberedSet.clear();
+    traceReferences();
+    strings.removeUnmarked(true);
+    sweepYoung();
+
+    minorCollection = false;
+    bytesSurvived = bytesAllocated;
+    minorPauses.record(now() - start);
+
+    if (debugGC) {
+        std::cout << "-- minor gc end" << std::endl;
+        std::cout << "   collected " << before - bytesAllocated << " bytes (from " << before << " to " << bytesAllocated << ")" << std::endl;
+    }
+}
+
+void GC::collectAll() {
+    if (phase != GCPhase::idle) finishCycle();
+
     if (debugGC) {
         std::cout << std::endl << "-- gc begin" << std::endl;
     }
 
+    double start = now();
     size_t before = bytesAllocated;
 
+    // Every survivor will be old, so nothing old can point at a young object.
+    for (Object* object : rememberedSet) {
+        object->isRemembered = false;
+    }
+    rememberedSet.clear();
+
+    allocator.clearMarks();
     markRoots();
     traceReferences();
+    strings.removeUnmarked(false);
     sweep();
+    sweepYoung();
 
-    nextGC = bytesAllocated * 2;
+    bytesSurvived = bytesAllocated;
+    fullPauses.record(now() - start);
+    endCycle();
 
     if (debugGC) {
         std::cout << "-- gc end" << std::endl;
@@ -158,14 +526,876 @@ void GC::collectGarbage() {
     }
 }
 
-String* GC::newString(std::string& chars) {
+void GC::startCycle() {
+    double start = now();
+
+    allocator.clearMarks();
+    markRoots();
+    phase = GCPhase::marking;
+    nextStep = bytesAllocated + GC_STEP_BYTES;
+
+    markPauses.record(now() - start);
+}
+
+bool GC::markStep(double deadline) {
+    while (grayObjects.size() > 0) {
+        for (int i = 0; i < GC_WORK_BATCH && grayObjects.size() > 0; i++) {
+            Object* object = grayObjects[grayObjects.size() - 1];
+            grayObjects.pop_back();
+            blackenObject(object);
+        }
+        if (now() >= deadline) return grayObjects.size() == 0;
+    }
+    return true;
+}
+
+// The stack and globals have no write barrier, so they are marked again.
+void GC::remark() {
+    double start = now();
+
+    markRoots();
+    traceReferences();
+    strings.removeUnmarked(false);
+
+    for (Object* object : rememberedSet) {
+        object->isRemembered = false;
+    }
+    rememberedSet.clear();
+
+    sweepCursor = 0;
+    sweepYoung();
+    bytesSurvived = bytesAllocated;
+    phase = GCPhase::sweeping;
+
+    remarkPauses.record(now() - start);
+}
+
+bool GC::sweepStep(double deadline) {
+    size_t before = bytesAllocated;
+    size_t end = allocator.pages.size() * POOL_BITMAP_WORDS;
+
+    while (sweepCursor < end) {
+        for (size_t i = 0; i < GC_SWEEP_BATCH && sweepCursor < end; i++) {
+            sweepWord(sweepCursor++);
+        }
+        if (now() >= deadline) break;
+    }
+
+    // Freed bytes were counted when the nursery was last emptied.
+    bytesSurvived -= before - bytesAllocated;
+    if (sweepCursor < end) return false;
+
+    endCycle();
+    return true;
+}
+
+void GC::step() {
+    double start = now();
+    double deadline = start + pauseTarget;
+
+    if (phase == GCPhase::marking) {
+        bool marked = markStep(deadline);
+        markPauses.record(now() - start);
+        if (marked) remark();
+    } else {
+        sweepStep(deadline);
+        sweepPauses.record(now() - start);
+    }
+
+    nextStep = bytesAllocated + GC_STEP_BYTES;
+}
+
+void GC::finishCycle() {
+    if (phase == GCPhase::marking) {
+        traceReferences();
+        remark();
+    } else if (phase == GCPhase::concurrentMarking) {
+        remarkConcurrent();
+    }
+    while (!sweepStep(now() + 1000)) {}
+}
+
+void GC::startConcurrentCycle() {
+    double start = now();
+
+    collectYoung();
+    allocator.clearMarks();
+    markRoots();
+    phase = GCPhase::concurrentMarking;
+    markerDone = false;
+    marker = std::thread(&GC::traceConcurrently, this);
+
+    markPauses.record(now() - start);
+}
+
+// Runs on the marker thread, which owns grayObjects until remark joins it.
+void GC::traceConcurrently() {
+    for (;;) {
+        while (grayObjects.size() > 0) {
+            Object* object = grayObjects[grayObjects.size() - 1];
+            grayObjects.pop_back();
+            scanObject(object, grayObjects);
+        }
+
+        std::lock_guard<std::mutex> lock(handoffMutex);
+        if (handoff.empty()) {
+            markerDone = true;
+            return;
+        }
+        grayObjects.swap(handoff);
+    }
+}
+
+void GC::scanObject(Object* object, std::vector<Object*>& gray) {
+    PoolPage* page = PoolPage::of(object);
+    if (!page->claim(object)) return;
+
+    forEachReference(object, [&gray](Object* reference) {
+        if (reference != nullptr && PoolPage::of(reference)->markAtomically(reference)) gray.push_back(reference);
+    });
+    page->setScanned(object);
+}
+
+void GC::snapshot(Object* object) {
+    PoolPage* page = PoolPage::of(object);
+    if (page->isScanned(object)) return;
+
+    // Anything the program can write to was reachable when marking started.
+    page->markAtomically(object);
+    scanObject(object, snapshotObjects);
+    while (!page->isScanned(object)) {
+        std::this_thread::yield();
+    }
+}
+
+void GC::handOff() {
+    if (snapshotObjects.empty()) return;
+
+    std::lock_guard<std::mutex> lock(handoffMutex);
+    if (markerDone) return;
+    handoff.insert(handoff.end(), snapshotObjects.begin(), snapshotObjects.end());
+    snapshotObjects.clear();
+}
+
+// The stack and globals need no second look: anything they reference now was
+// reachable when marking started or is young.
+void GC::remarkConcurrent() {
+    double start = now();
+
+    marker.join();
+    grayObjects.insert(grayObjects.end(), handoff.begin(), handoff.end());
+    grayObjects.insert(grayObjects.end(), snapshotObjects.begin(), snapshotObjects.end());
+    handoff.clear();
+    snapshotObjects.clear();
+    while (grayObjects.size() > 0) {
+        Object* object = grayObjects[grayObjects.size() - 1];
+        grayObjects.pop_back();
+        scanObject(object, grayObjects);
+    }
+
+    minorCollection = true;
+    markRoots();
+    for (Object* object : rememberedSet) {
+        object->isRemembered = false;
+        blackenObject(object);
+    }
+    rememberedSet.clear();
+    traceReferences();
+    minorCollection = false;
+    strings.removeUnmarked(false);
+
+    sweepCursor = 0;
+    sweepYoung();
+    bytesSurvived = bytesAllocated;
+    phase = GCPhase::sweeping;
+
+    remarkPauses.record(now() - start);
+}
+
+void GC::sweepLazily() {
+    size_t before = bytesAllocated;
+    size_t end = allocator.pages.size() * POOL_BITMAP_WORDS;
+
+    for (size_t i = 0; i < GC_SWEEP_BATCH && sweepCursor < end; i++) {
+        sweepWord(sweepCursor++);
+    }
+
+    bytesSurvived -= before - bytesAllocated;
+    if (sweepCursor == end) endCycle();
+}
+
+void GC::endCycle() {
+    phase = GCPhase::idle;
+    if (shouldCompact()) compact();
+    if (profiler != nullptr) profiler->measureRetained();
+    nextGC = (size_t)(bytesAllocated * growthFactor);
+}
+
+// Cells that compaction has moved an object out of hold its new address.
+static Object* forwarded(Object* object) {
+    if (object == nullptr) return nullptr;
+    PoolPage* page = PoolPage::of(object);
+    size_t granule = PoolPage::granule(object);
+    if (page->objectBits[granule / 64] & PoolPage::bit(granule)) return object;
+    return *(Object**)object;
+}
+
+template <typename T>
+static void forward(T*& object) {
+    object = (T*)forwarded((Object*)object);
+}
+
+static void forward(Value& value) {
+    if (value.isObject()) value = Value(forwarded(value.getObject()));
+}
+
+static void forward(Table& table) {
+    // Keys can't change in place. A moved string keeps its hash, so its entry
+    // goes back into the same bucket.
+    std::vector<Table::node_type> moved;
+    for (auto entry = table.begin(); entry != table.end();) {
+        forward(entry->second);
+        String* key = (String*)forwarded((Object*)entry->first);
+        if (key == entry->first) {
+            ++entry;
+            continue;
+        }
+        Table::node_type node = table.extract(entry++);
+        node.key() = key;
+        moved.push_back(std::move(node));
+    }
+    for (Table::node_type& node : moved) {
+        table.insert(std::move(node));
+    }
+}
+
+static void updateReferences(Object* object) {
+    switch (object->type) {
+    case ObjectType::Closure: {
+        Closure* closure = (Closure*)object;
+        forward(closure->function);
+        for (Upvalue*& upvalue : closure->upvalues) {
+            forward(upvalue);
+        }
+        break;
+    }
+    case ObjectType::Function: {
+        Function* function = (Function*)object;
+        for (Value& constant : function->chunk.constants) {
+            forward(constant);
+        }
+        for (InlineCache& cache : function->chunk.caches) {
+            for (int i = 0; i < cache.count; i++) {
+                forward(cache.entries[i].klass);
+                forward(cache.entries[i].method);
+            }
+        }
+        break;
+    }
+    case ObjectType::Upvalue: {
+        Upvalue* upvalue = (Upvalue*)object;
+        forward(upvalue->closed);
+        // A closed upvalue's link is left over from when it was open.
+        if (upvalue->location != &upvalue->closed) forward(upvalue->next);
+        break;
+    }
+    case ObjectType::Class:
+        forward(((Class*)object)->methods);
+        break;
+    case ObjectType::Instance: {
+        Instance* instance = (Instance*)object;
+        forward(instance->klass);
+        for (Value& field : instance->fields) {
+            forward(field);
+        }
+        if (instance->dictionary != nullptr) forward(*instance->dictionary);
+        break;
+    }
+    case ObjectType::BoundMethod: {
+        BoundMethod* bound = (BoundMethod*)object;
+        forward(bound->receiver);
+        forward(bound->method);
+        break;
+    }
+    case ObjectType::Array:
+        for (Value& value : ((Array*)object)->values) {
+            forward(value);
+        }
+        break;
+    case ObjectType::Native:
+    case ObjectType::String:
+        break;
+    }
+}
+
+template <typename T>
+static void moveObject(Object* from, void* to) {
+    new (to) T(std::move(*(T*)from));
+    ((T*)from)->~T();
+}
+
+static void relocate(Object* from, Object* to) {
+    switch (from->type) {
+    case ObjectType::String: moveObject<String>(from, to); break;
+    case ObjectType::Function: moveObject<Function>(from, to); break;
+    case ObjectType::Native: moveObject<Native>(from, to); break;
+    case ObjectType::Closure: moveObject<Closure>(from, to); break;
+    case ObjectType::Class: moveObject<Class>(from, to); break;
+    case ObjectType::Instance: moveObject<Instance>(from, to); break;
+    case ObjectType::BoundMethod: moveObject<BoundMethod>(from, to); break;
+    case ObjectType::Array: moveObject<Array>(from, to); break;
+    case ObjectType::Upvalue: {
+        Upvalue* upvalue = (Upvalue*)from;
+        bool closed = upvalue->location == &upvalue->closed;
+        moveObject<Upvalue>(from, to);
+        if (closed) ((Upvalue*)to)->location = &((Upvalue*)to)->closed;
+        break;
+    }
+    }
+
+    PoolPage* fromPage = PoolPage::of(from);
+    PoolPage* toPage = PoolPage::of(to);
+    size_t fromGranule = PoolPage::granule(from);
+    size_t toGranule = PoolPage::granule(to);
+    fromPage->objectBits[fromGranule / 64] &= ~PoolPage::bit(fromGranule);
+    toPage->objectBits[toGranule / 64] |= PoolPage::bit(toGranule);
+    if (fromPage->isMarked(from)) {
+        fromPage->markBits[fromGranule / 64].fetch_and(~PoolPage::bit(fromGranule), std::memory_order_relaxed);
+        toPage->mark(to);
+    }
+    *(Object**)from = to;
+}
+
+// Boxed values count as the object they hold.
+static Object* objectContaining(const std::vector<PoolPage*>& sortedPages, uintptr_t address) {
+#ifdef NAN_BOXING
+    if ((address & (SIGN_BIT | QNAN)) == (SIGN_BIT | QNAN)) address &= ~(SIGN_BIT | QNAN);
+#endif
+    PoolPage* page = PoolPage::of((void*)address);
+    if (!std::binary_search(sortedPages.begin(), sortedPages.end(), page)) return nullptr;
+
+    size_t offset = address - (uintptr_t)page;
+    if (offset < POOL_PAGE_HEADER) return nullptr;
+    size_t cell = (offset - POOL_PAGE_HEADER) / page->cellSize;
+    if (cell >= cellsPerPage(page->cellSize)) return nullptr;
+
+    Object* object = (Object*)((char*)page + POOL_PAGE_HEADER + cell * page->cellSize);
+    size_t granule = PoolPage::granule(object);
+    if (!(page->objectBits[granule / 64] & PoolPage::bit(granule))) return nullptr;
+    return object;
+}
+
+// Reads every word from this function's frame up to base. Most of them are
+// other frames' locals, which AddressSanitizer would report.
+__attribute__((noinline, no_sanitize_address))
+static void pinStackWords(const std::vector<PoolPage*>& sortedPages, void* base, std::unordered_set<Object*>& pinned) {
+    uintptr_t* word = (uintptr_t*)((uintptr_t)__builtin_frame_address(0) & ~(uintptr_t)(sizeof(uintptr_t) - 1));
+    for (; word < (uintptr_t*)base; word++) {
+        Object* object = objectContaining(sortedPages, *word);
+        if (object != nullptr) pinned.insert(object);
+    }
+}
+
+// C++ locals and registers can't be updated, so every object that a word on the
+// stack between here and VM::interpret may point at, or into, stays put.
+void GC::pinStack(const std::vector<PoolPage*>& sortedPages, std::unordered_set<Object*>& pinned) {
+    // Spills the registers, so pointers only they hold are on the stack too.
+    __builtin_unwind_init();
+    pinStackWords(sortedPages, stackBase, pinned);
+}
+
+bool GC::shouldCompact() {
+    if (compactThreshold == 0 || stackBase == nullptr) return false;
+
+    size_t objects[POOL_CLASSES] = {};
+    size_t pageCount[POOL_CLASSES] = {};
+    for (PoolPage* page : allocator.pages) {
+        size_t index = classIndex(page->cellSize);
+        pageCount[index]++;
+        for (size_t word = 0; word < POOL_BITMAP_WORDS; word++) {
+            objects[index] += __builtin_popcountll(page->objectBits[word]);
+        }
+    }
+
+    size_t spare = 0;
+    for (size_t index = 0; index < POOL_CLASSES; index++) {
+        size_t cells = cellsPerPage((index + 1) * POOL_GRANULE);
+        spare += pageCount[index] - (objects[index] + cells - 1) / cells;
+    }
+    return spare > 0 && spare >= compactThreshold * allocator.pages.size();
+}
+
+void GC::compact() {
+    double start = now();
+
+    std::vector<PoolPage*> sortedPages = allocator.pages;
+    std::sort(sortedPages.begin(), sortedPages.end());
+    std::unordered_set<Object*> pinned;
+    pinStack(sortedPages, pinned);
+    // Compiled code embeds the addresses of functions and their constants, and
+    // globals and shapes are looked up by their names' addresses.
+    allocator.forEachObject([&pinned](Object* object) {
+        if (object->type != ObjectType::Function) return;
+        for (Value constant : ((Function*)object)->chunk.constants) {
+            if (constant.isObject()) pinned.insert(constant.getObject());
+        }
+    });
+    for (String* name : globals->names) {
+        pinned.insert((Object*)name);
+    }
+    for (Shape* shape : shapes) {
+        if (shape->name != nullptr) pinned.insert((Object*)shape->name);
+    }
+
+    auto movable = [&pinned](Object* object) {
+        return object->type != ObjectType::Function && pinned.count(object) == 0;
+    };
+
+    size_t moved = 0;
+    for (size_t index = 0; index < POOL_CLASSES; index++) {
+        size_t cellSize = (index + 1) * POOL_GRANULE;
+        std::vector<PoolPage*> pages;
+        for (PoolPage* page : allocator.pages) {
+            if (page->cellSize == cellSize) pages.push_back(page);
+        }
+
+        size_t cells = cellsPerPage(cellSize);
+        auto cellAt = [&](size_t position) {
+            return (Object*)((char*)pages[position / cells] + POOL_PAGE_HEADER + position % cells * cellSize);
+        };
+        auto isFree = [&](size_t position) {
+            Object* cell = cellAt(position);
+            size_t granule = PoolPage::granule(cell);
+            return !(PoolPage::of(cell)->objectBits[granule / 64] & PoolPage::bit(granule));
+        };
+
+        size_t hole = 0;
+        size_t last = pages.size() * cells;
+        for (;;) {
+            while (hole < last && !isFree(hole)) hole++;
+            while (last > hole && (isFree(last - 1) || !movable(cellAt(last - 1)))) last--;
+            if (last <= hole) break;
+
+            relocate(cellAt(last - 1), cellAt(hole));
+            moved++;
+            hole++;
+            last--;
+        }
+    }
+
+    if (moved > 0) {
+        for (Value* slot = stack; slot < *stackTop; slot++) {
+            forward(*slot);
+        }
+        forward(*openUpvalues);
+        for (Value& value : globals->values) {
+            forward(value);
+        }
+        for (int i = 0; i < *frameCount; i++) {
+            forward(frames[i].closure);
+        }
+        forward(*initString);
+        for (Object*& object : youngObjects) {
+            forward(object);
+        }
+        for (Object*& object : rememberedSet) {
+            forward(object);
+        }
+        for (String*& string : strings.entries) {
+            forward(string);
+        }
+        if (profiler != nullptr) profiler->forwardObjects(forwarded);
+        allocator.forEachObject(updateReferences);
+    }
+    allocator.rebuildFreeLists();
+#ifdef __GLIBC__
+    // Return the whole pages freed object buffers left in malloc's free lists.
+    malloc_trim(0);
+#endif
+
+    compactPauses.record(now() - start);
+}
+
+template <typename T>
+static size_t bufferSize(const HeapVector<T>& vector) {
+    return vector.capacity() * sizeof(T);
+}
+
+// A node of a hash table holds its entry, the address of the next node and the
+// key's hash.
+template <typename Map>
+static size_t tableSize(const Map& table) {
+    return table.size() * (sizeof(typename Map::value_type) + 2 * sizeof(void*)) + table.bucket_count() * sizeof(void*);
+}
+
+size_t GC::sizeOf(Object* object) {
+    switch (object->type) {
+    case ObjectType::String:
+        return sizeof(String) + charsSize(((String*)object)->chars);
+    case ObjectType::Function: {
+        Function* function = (Function*)object;
+        Chunk& chunk = function->chunk;
+        return sizeof(Function) + charsSize(function->name) + bufferSize(chunk.code) + bufferSize(chunk.constants) + bufferSize(chunk.lines) + bufferSize(chunk.caches) + bufferSize(function->registerCode) + bufferSize(function->registerLines);
+    }
+    case ObjectType::Native:
+        return sizeof(Native);
+    case ObjectType::Upvalue:
+        return sizeof(Upvalue);
+    case ObjectType::Closure:
+        return sizeof(Closure) + bufferSize(((Closure*)object)->upvalues);
+    case ObjectType::Class: {
+        Class* klass = (Class*)object;
+        return sizeof(Class) + charsSize(klass->name) + tableSize(klass->methods);
+    }
+    case ObjectType::Instance: {
+        Instance* instance = (Instance*)object;
+        size_t size = sizeof(Instance) + bufferSize(instance->fields);
+        if (instance->dictionary != nullptr) size += sizeof(Table) + tableSize(*instance->dictionary);
+        return size;
+    }
+    case ObjectType::BoundMethod:
+        return sizeof(BoundMethod);
+    case ObjectType::Array:
+        return sizeof(Array) + bufferSize(((Array*)object)->values);
+    }
+    return 0;
+}
+
+static std::string describeFunction(Function* function) {
+    return function->name == "" ? "script" : function->name + "()";
+}
+
+template <typename Edge>
+static void valueEdge(Edge& edge, Value value, const std::string& name) {
+    if (value.isObject()) edge(value.getObject(), name);
+}
+
+template <typename Edge>
+static void forEachEdge(Object* object, Edge edge) {
+    switch (object->type) {
+    case ObjectType::Closure: {
+        Closure* closure = (Closure*)object;
+        edge((Object*)closure->function, "function");
+        for (size_t i = 0; i < closure->upvalues.size(); i++) {
+            edge((Object*)closure->upvalues[i], "upvalue " + std::to_string(i));
+        }
+        break;
+    }
+    case ObjectType::Function: {
+        Function* function = (Function*)object;
+        for (size_t i = 0; i < function->chunk.constants.size(); i++) {
+            valueEdge(edge, function->chunk.constants[i], "constant " + std::to_string(i));
+        }
+        for (InlineCache& cache : function->chunk.caches) {
+            for (int i = 0; i < cache.count; i++) {
+                edge((Object*)cache.entries[i].klass, "inline cache");
+                edge((Object*)cache.entries[i].method, "inline cache");
+            }
+        }
+        break;
+    }
+    case ObjectType::Upvalue:
+        valueEdge(edge, ((Upvalue*)object)->closed, "value");
+        break;
+    case ObjectType::Class: {
+        Class* klass = (Class*)object;
+        for (auto& method : klass->methods) {
+            edge((Object*)method.first, "key");
+            valueEdge(edge, method.second, method.first->chars + "()");
+        }
+        break;
+    }
+    case ObjectType::Instance: {
+        Instance* instance = (Instance*)object;
+        edge((Object*)instance->klass, "class");
+        if (instance->shape != nullptr) {
+            for (auto& slot : instance->shape->slots) {
+                valueEdge(edge, instance->fields[slot.second], "." + slot.first->chars);
+            }
+        }
+        if (instance->dictionary != nullptr) {
+            for (auto& field : *instance->dictionary) {
+                edge((Object*)field.first, "key");
+                valueEdge(edge, field.second, "." + field.first->chars);
+            }
+        }
+        break;
+    }
+    case ObjectType::BoundMethod: {
+        BoundMethod* bound = (BoundMethod*)object;
+        valueEdge(edge, bound->receiver, "receiver");
+        edge((Object*)bound->method, "method");
+        break;
+    }
+    case ObjectType::Array: {
+        Array* array = (Array*)object;
+        for (size_t i = 0; i < array->values.size(); i++) {
+            valueEdge(edge, array->values[i], "[" + std::to_string(i) + "]");
+        }
+        break;
+    }
+    case ObjectType::Native:
+    case ObjectType::String:
+        break;
+    }
+}
+
+// Reads the objects only, so it can run in any phase of a collection.
+void GC::walkHeap(HeapGraph& graph) {
+    size_t retainer = HeapGraph::NO_RETAINER;
+    auto reach = [&graph, &retainer](Object* object, const std::string& edge) {
+        if (object == nullptr || graph.index.count(object) > 0) return;
+        graph.index.insert({ object, graph.nodes.size() });
+        graph.nodes.push_back({ object, retainer, edge });
+    };
+
+    int frame = 0;
+    for (Value* slot = stack; slot < *stackTop; slot++) {
+        while (frame + 1 < *frameCount && slot >= frames[frame + 1].slots) {
+            frame++;
+        }
+        if (*frameCount == 0) {
+            valueEdge(reach, *slot, "stack " + std::to_string(slot - stack));
+        } else {
+            valueEdge(reach, *slot, "local " + std::to_string(slot - frames[frame].slots) + " in " + describeFunction(frames[frame].closure->function));
+        }
+    }
+
+    for (Upvalue* upvalue = *openUpvalues; upvalue != nullptr; upvalue = upvalue->next) {
+        reach((Object*)upvalue, "open upvalue");
+    }
+
+    for (size_t i = 0; i < globals->values.size(); i++) {
+        valueEdge(reach, globals->values[i], "global " + globals->names[i]->chars);
+    }
+    for (String* name : globals->names) {
+        reach((Object*)name, "global name");
+    }
+
+    for (int i = 0; i < *frameCount; i++) {
+        reach((Object*)frames[i].closure, "frame of " + describeFunction(frames[i].closure->function));
+    }
+
+    for (Compiler* current = compiler; current != nullptr; current = current->enclosing) {
+        reach((Object*)current->function, "compiler");
+    }
+
+    reach((Object*)*initString, "init string");
+
+    for (Shape* shape : shapes) {
+        reach((Object*)shape->name, "shape key");
+    }
+
+    for (size_t i = 0; i < graph.nodes.size(); i++) {
+        retainer = i;
+        forEachEdge(graph.nodes[i].object, reach);
+    }
+}
+
+void HeapGraph::census(TypeCensus (&types)[OBJECT_TYPES]) {
+    for (Node& node : nodes) {
+        TypeCensus& type = types[(size_t)node.object->type];
+        type.count++;
+        type.bytes += GC::sizeOf(node.object);
+    }
+}
+
+void GC::printStats(std::ostream& out) {
+    struct {
+        const char* name;
+        PauseStats* stats;
+    } kinds[] = {
+        {"minor", &minorPauses},
+        {"mark", &markPauses},
+        {"remark", &remarkPauses},
+        {"sweep", &sweepPauses},
+        {"full", &fullPauses},
+        {"compact", &compactPauses},
+    };
+    const char* triggers[GC_TRIGGERS] = { "nursery", "threshold", "heap-max", "collect()" };
+    char line[128];
+
+    out << "gc heap (bytes)" << std::endl;
+    std::snprintf(line, sizeof(line), "  %-10s %12zu", "size", bytesAllocated);
+    out << line << std::endl;
+    std::snprintf(line, sizeof(line), "  %-10s %12zu", "next major", nextGC);
+    out << line << std::endl;
+    std::snprintf(line, sizeof(line), "  %-10s %12zu", "pages", allocator.pages.size() * POOL_PAGE_SIZE);
+    out << line << std::endl;
+
+    out << "gc collections by trigger" << std::endl;
+    for (size_t i = 0; i < GC_TRIGGERS; i++) {
+        std::snprintf(line, sizeof(line), "  %-10s %12zu", triggers[i], collections[i]);
+        out << line << std::endl;
+    }
+
+    out << "gc reclaimed (bytes)" << std::endl;
+    std::snprintf(line, sizeof(line), "  %-10s %12zu", "nursery", youngBytesReclaimed);
+    out << line << std::endl;
+    std::snprintf(line, sizeof(line), "  %-10s %12zu", "old", oldBytesReclaimed);
+    out << line << std::endl;
+
+    out << "gc pauses (ms)      count       total        mean         max" << std::endl;
+    for (auto& kind : kinds) {
+        PauseStats& stats = *kind.stats;
+        double mean = stats.count > 0 ? stats.total / stats.count : 0;
+        std::snprintf(line, sizeof(line), "  %-10s %10zu %11.3f %11.3f %11.3f", kind.name, stats.count, stats.total, mean, stats.max);
+        out << line << std::endl;
+    }
+
+    int first = PAUSE_BUCKETS, last = -1;
+    for (auto& kind : kinds) {
+        for (int i = 0; i < PAUSE_BUCKETS; i++) {
+            if (kind.stats->buckets[i] == 0) continue;
+            first = std::min(first, i);
+            last = std::max(last, i);
+        }
+    }
+    out << "gc pause histogram (ms)";
+    for (auto& kind : kinds) {
+        std::snprintf(line, sizeof(line), " %8s", kind.name);
+        out << line;
+    }
+    out << std::endl;
+    for (int i = first; i <= last; i++) {
+        if (i < PAUSE_BUCKETS - 1) {
+            std::snprintf(line, sizeof(line), "  <= %-18g", PAUSE_BUCKET_LIMITS[i]);
+        } else {
+            std::snprintf(line, sizeof(line), "  >  %-18g", PAUSE_BUCKET_LIMITS[i - 1]);
+        }
+        out << line;
+        for (auto& kind : kinds) {
+            std::snprintf(line, sizeof(line), " %8zu", kind.stats->buckets[i]);
+            out << line;
+        }
+        out << std::endl;
+    }
+
+    HeapGraph graph;
+    walkHeap(graph);
+    TypeCensus types[OBJECT_TYPES];
+    graph.census(types);
+    TypeCensus total;
+    out << "live objects       count        bytes" << std::endl;
+    for (size_t i = 0; i < OBJECT_TYPES; i++) {
+        std::snprintf(line, sizeof(line), "  %-11s %10zu %12zu", stringifyObjectType((ObjectType)i).c_str(), types[i].count, types[i].bytes);
+        out << line << std::endl;
+        total.count += types[i].count;
+        total.bytes += types[i].bytes;
+    }
+    std::snprintf(line, sizeof(line), "  %-11s %10zu %12zu", "total", total.count, total.bytes);
+    out << line << std::endl;
+}
+
+void writeJsonString(std::ostream& out, const std::string& string) {
+    out << '"';
+    for (char c : string) {
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if ((unsigned char)c < 0x20) {
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)c);
+            out << escaped;
+        } else {
+            out << c;
+        }
+    }
+    out << '"';
+}
+
+static std::string describeObject(Object* object) {
+    switch (object->type) {
+    case ObjectType::String: {
+        const std::string& chars = ((String*)object)->chars;
+        return chars.size() <= 64 ? chars : chars.substr(0, 64) + "...";
+    }
+    case ObjectType::Function: return describeFunction((Function*)object);
+    case ObjectType::Closure: return describeFunction(((Closure*)object)->function);
+    case ObjectType::BoundMethod: return describeFunction(((BoundMethod*)object)->method->function);
+    case ObjectType::Class: return ((Class*)object)->name;
+    case ObjectType::Instance: {
+        Class* klass = ((Instance*)object)->klass;
+        return klass != nullptr ? klass->name : "map";
+    }
+    default: return "";
+    }
+}
+
+void GC::writeHeapSnapshot() {
+    heapSnapshotWritten = true;
+    std::ofstream out(heapSnapshotPath);
+    if (!out) {
+        std::cerr << "Could not open file \"" << heapSnapshotPath << "\"." << std::endl;
+        return;
+    }
+
+    HeapGraph graph;
+    walkHeap(graph);
+    TypeCensus types[OBJECT_TYPES];
+    graph.census(types);
+
+    out << "{\"types\": {";
+    for (size_t i = 0; i < OBJECT_TYPES; i++) {
+        if (i > 0) out << ", ";
+        writeJsonString(out, stringifyObjectType((ObjectType)i));
+        out << ": {\"count\": " << types[i].count << ", \"bytes\": " << types[i].bytes << "}";
+    }
+    out << "},\n\"nodes\": [\n";
+
+    for (size_t i = 0; i < graph.nodes.size(); i++) {
+        HeapGraph::Node& node = graph.nodes[i];
+        out << "{\"id\": " << i << ", \"type\": ";
+        writeJsonString(out, stringifyObjectType(node.object->type));
+        out << ", \"size\": " << sizeOf(node.object);
+        std::string name = describeObject(node.object);
+        if (name != "") {
+            out << ", \"name\": ";
+            writeJsonString(out, name);
+        }
+        out << ", \"retainer\": ";
+        if (node.retainer == HeapGraph::NO_RETAINER) {
+            out << "null";
+        } else {
+            out << node.retainer;
+        }
+        out << ", \"edge\": ";
+        writeJsonString(out, node.edge);
+
+        out << ", \"references\": [";
+        bool first = true;
+        forEachEdge(node.object, [&](Object* reference, const std::string& edge) {
+            if (reference == nullptr) return;
+            if (!first) out << ", ";
+            first = false;
+            out << "[";
+            writeJsonString(out, edge);
+            out << ", " << graph.index[reference] << "]";
+        });
+        out << "]}" << (i + 1 < graph.nodes.size() ? ",\n" : "\n");
+    }
+    out << "]}" << std::endl;
+}
+
+String* GC::newString(const std::string& chars) {
+    uint32_t hash = hashString(chars);
+    String* interned = strings.find(chars, hash);
+    if (interned != nullptr) {
+        // The string may have been unreachable when marking started; it is in
+        // use again, so it must survive. Strings reference nothing to trace.
+        if (phase == GCPhase::concurrentMarking) PoolPage::of(interned)->markAtomically(interned);
+        return interned;
+    }
+
     collectGarbage();
     bytesAllocated += sizeof(String);
-    String* string = new String;
+    String* string = allocateObject<String>();
     string->object.type = ObjectType::String;
-    string->object.next = objects;
-    objects = &string->object;
+    youngObjects.push_back(&string->object);
     string->chars = chars;
+    string->hash = hash;
+    bytesAllocated += charsSize(string->chars);
+    strings.insert(string);
+    if (profiler != nullptr) profiler->sample(&string->object);
     if (debugAllocation) {
         std::cout << string << " allocate for: `" << Value(string).stringify() << "`" << std::endl;
     }
@@ -175,13 +1405,14 @@ String* GC::newString(std::string& chars) {
 Function* GC::newFunction(std::string& name) {
     collectGarbage();
     bytesAllocated += sizeof(Function);
-    Function* function = new Function;
+    Function* function = allocateObject<Function>();
     function->object.type = ObjectType::Function;
-    function->object.next = objects;
-    objects = &function->object;
+    youngObjects.push_back(&function->object);
     function->name = name;
+    bytesAllocated += charsSize(function->name);
     function->arity = 0;
     function->upvalueCount = 0;
+    if (profiler != nullptr) profiler->sample(&function->object);
     if (debugAllocation) {
         std::cout << function << " allocate for: `" << Value(function).stringify() << "`" << std::endl;
     }
@@ -191,11 +1422,11 @@ Function* GC::newFunction(std::string& name) {
 Native* GC::newNative(NativeFn function) {
     collectGarbage();
     bytesAllocated += sizeof(Native);
-    Native* native = new Native;
+    Native* native = allocateObject<Native>();
     native->object.type = ObjectType::Native;
-    native->object.next = objects;
-    objects = &native->object;
+    youngObjects.push_back(&native->object);
     native->function = function;
+    if (profiler != nullptr) profiler->sample(&native->object);
     if (debugAllocation) {
         std::cout << native << " allocate for: `" << Value(native).stringify() << "`" << std::endl;
     }
@@ -205,11 +1436,11 @@ Native* GC::newNative(NativeFn function) {
 Closure* GC::newClosure(Function* function) {
     collectGarbage();
     bytesAllocated += sizeof(Closure);
-    Closure* closure = new Closure;
+    Closure* closure = allocateObject<Closure>();
     closure->object.type = ObjectType::Closure;
-    closure->object.next = objects;
-    objects = &closure->object;
+    youngObjects.push_back(&closure->object);
     closure->function = function;
+    if (profiler != nullptr) profiler->sample(&closure->object);
     if (debugAllocation) {
         std::cout << closure << " allocate for: `" << Value(closure).stringify() << "`" << std::endl;
     }
@@ -219,12 +1450,12 @@ Closure* GC::newClosure(Function* function) {
 Upvalue* GC::newUpvalue(Value* location, Upvalue* next) {
     collectGarbage();
     bytesAllocated += sizeof(Upvalue);
-    Upvalue* upvalue = new Upvalue;
+    Upvalue* upvalue = allocateObject<Upvalue>();
     upvalue->object.type = ObjectType::Upvalue;
-    upvalue->object.next = objects;
-    objects = &upvalue->object;
+    youngObjects.push_back(&upvalue->object);
     upvalue->location = location;
     upvalue->next = next;
+    if (profiler != nullptr) profiler->sample(&upvalue->object);
     if (debugAllocation) {
         std::cout << upvalue << " allocate for: `" << Value(upvalue).stringify() << "`" << std::endl;
     }
@@ -234,11 +1465,12 @@ Upvalue* GC::newUpvalue(Value* location, Upvalue* next) {
 Class* GC::newClass(std::string& name) {
     collectGarbage();
     bytesAllocated += sizeof(Class);
-    Class* klass = new Class;
+    Class* klass = allocateObject<Class>();
     klass->object.type = ObjectType::Class;
-    klass->object.next = objects;
-    objects = &klass->object;
+    youngObjects.push_back(&klass->object);
     klass->name = name;
+    bytesAllocated += charsSize(klass->name);
+    if (profiler != nullptr) profiler->sample(&klass->object);
     if (debugAllocation) {
         std::cout << klass << " allocate for: `" << Value(klass).stringify() << "`" << std::endl;
     }
@@ -248,11 +1480,12 @@ Class* GC::newClass(std::string& name) {
 Instance* GC::newInstance(Class* klass) {
     collectGarbage();
     bytesAllocated += sizeof(Instance);
-    Instance* instance = new Instance;
+    Instance* instance = allocateObject<Instance>();
     instance->object.type = ObjectType::Instance;
-    instance->object.next = objects;
-    objects = &instance->object;
+    youngObjects.push_back(&instance->object);
     instance->klass = klass;
+    instance->shape = emptyShape;
+    if (profiler != nullptr) profiler->sample(&instance->object);
     if (debugAllocation) {
         std::cout << instance << " allocate for: `" << Value(instance).stringify() << "`" << std::endl;
     }
@@ -262,71 +1495,119 @@ Instance* GC::newInstance(Class* klass) {
 BoundMethod* GC::newBoundMethod(Value receiver, Closure* method) {
     collectGarbage();
     bytesAllocated += sizeof(BoundMethod);
-    BoundMethod* boundMethod = new BoundMethod;
+    BoundMethod* boundMethod = allocateObject<BoundMethod>();
     boundMethod->object.type = ObjectType::BoundMethod;
-    boundMethod->object.next = objects;
-    objects = &boundMethod->object;
+    youngObjects.push_back(&boundMethod->object);
     boundMethod->receiver = receiver;
     boundMethod->method = method;
+    if (profiler != nullptr) profiler->sample(&boundMethod->object);
     if (debugAllocation) {
         std::cout << boundMethod << " allocate for: `" << Value(boundMethod).stringify() << "`" << std::endl;
     }
     return boundMethod;
 }
 
+Array* GC::newArray() {
+    collectGarbage();
+    bytesAllocated += sizeof(Array);
+    Array* array = allocateObject<Array>();
+    array->object.type = ObjectType::Array;
+    youngObjects.push_back(&array->object);
+    if (profiler != nullptr) profiler->sample(&array->object);
+    if (debugAllocation) {
+        std::cout << array << " allocate for: `" << Value(array).stringify() << "`" << std::endl;
+    }
+    return array;
+}
+
+Shape* GC::newShape(Shape* parent, String* name) {
+    Shape* shape = new Shape;
+    shape->parent = parent;
+    shape->name = name;
+    if (parent != nullptr) {
+        shape->slots = parent->slots;
+        shape->slots.insert({ name, (uint32_t)parent->slots.size() });
+    }
+    shapes.push_back(shape);
+    return shape;
+}
+
+Shape* GC::transition(Shape* shape, String* name) {
+    auto x = shape->transitions.find(name);
+    if (x != shape->transitions.end()) return x->second;
+
+    if (shape->slots.size() >= MAX_SHAPE_FIELDS || shape->transitions.size() >= MAX_SHAPE_TRANSITIONS) {
+        return nullptr;
+    }
+
+    Shape* next = newShape(shape, name);
+    shape->transitions.insert({ name, next });
+    return next;
+}
+
 void GC::freeObject(Object* object) {
+    if (profiler != nullptr) profiler->freed(object);
     switch (object->type) {
     case ObjectType::String: {
-        bytesAllocated -= sizeof(String);
+        bytesAllocated -= sizeof(String) + charsSize(((String*)object)->chars);
         if (debugAllocation) std::cout << object << " free for: " << Value((String*)object).stringify() << std::endl;
-        delete (String*)object; break;
+        releaseObject((String*)object); break;
     }
     case ObjectType::Function: {
-        bytesAllocated -= sizeof(Function);
+        bytesAllocated -= sizeof(Function) + charsSize(((Function*)object)->name);
         if (debugAllocation) std::cout << object << " free for: " << Value((Function*)object).stringify() << std::endl;
-        delete (Function*)object; break;
+        releaseObject((Function*)object); break;
     }
     case ObjectType::Native: {
         bytesAllocated -= sizeof(Native);
         if (debugAllocation) std::cout << object << " free for: " << Value((Native*)object).stringify() << std::endl;
-        delete (Native*)object; break;
+        releaseObject((Native*)object); break;
     }
     case ObjectType::Closure: {
         bytesAllocated -= sizeof(Closure);
         if (debugAllocation) std::cout << object << " free for: " << Value((Closure*)object).stringify() << std::endl;
-        delete (Closure*)object; break;
+        releaseObject((Closure*)object); break;
     }
     case ObjectType::Upvalue: {
         bytesAllocated -= sizeof(Upvalue);
         if (debugAllocation) std::cout << object << " free for: " << Value((Upvalue*)object).stringify() << std::endl;
-        delete (Upvalue*)object; break;
+        releaseObject((Upvalue*)object); break;
     }
     case ObjectType::Class: {
-        bytesAllocated -= sizeof(Class);
+        bytesAllocated -= sizeof(Class) + charsSize(((Class*)object)->name);
         if (debugAllocation) std::cout << object << " free for: " << Value((Class*)object).stringify() << std::endl;
-        delete (Class*)object; break;
+        releaseObject((Class*)object); break;
     }
     case ObjectType::Instance: {
         bytesAllocated -= sizeof(Instance);
         if (debugAllocation) std::cout << object << " free for: " << Value((Instance*)object).stringify() << std::endl;
-        delete (Instance*)object; break;
+        releaseObject((Instance*)object); break;
     case ObjectType::BoundMethod: {
         bytesAllocated -= sizeof(BoundMethod);
         if (debugAllocation) std::cout << object << " free for: " << Value((BoundMethod*)object).stringify() << std::endl;
-        delete (BoundMethod*)object; break;
+        releaseObject((BoundMethod*)object); break;
+    }
+    case ObjectType::Array: {
+        bytesAllocated -= sizeof(Array);
+        if (debugAllocation) std::cout << object << " free for: " << Value((Array*)object).stringify() << std::endl;
+        releaseObject((Array*)object); break;
     }
     }
     }
 }
 
 void GC::freeObjects() {
+    if (marker.joinable()) marker.join();
+
     if (debugAllocation) {
         std::cout << std::endl << "Freeing objects:" << std::endl;
     }
 
-    while (objects != nullptr) {
-        Object* next = objects->next;
-        freeObject(objects);
-        objects = next;
+    allocator.forEachObject([this](Object* object) { freeObject(object); });
+    youngObjects.clear();
+
+    for (Shape* shape : shapes) {
+        delete shape;
     }
+    shapes.clear();
 }
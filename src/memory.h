@@ -4,16 +4,23 @@
 #include "value.h"
 #include "scanner.h"
 #include <vector>
+#include <new>
+#include <ostream>
+#include <thread>
+#include <mutex>
+#include <atomic>
 #include <unordered_map>
+#include <unordered_set>
 
 typedef struct GC GC;
+class AllocationProfiler;
 
 struct CallFrame {
     Closure* closure;
-    std::vector<uint8_t>::iterator ip;
-    int slots;
-
-    CallFrame(Closure* closure, int slots);
+    uint8_t* ip;
+    Value* slots;
+    RegisterInstruction* pc;
+    Value* top;
 };
 
 struct Local {
@@ -37,6 +44,12 @@ enum FunctionType {
     TYPE_SCRIPT
 };
 
+struct Literal {
+    size_t start;
+    size_t end;
+    Value value;
+};
+
 struct Compiler {
     Compiler* enclosing;
     Function* function;
@@ -47,19 +60,267 @@ struct Compiler {
     std::vector<OpenUpvalue> upvalues;
     int scopeDepth = 0;
 
+    std::vector<Literal> literals;
+    size_t lastJumpTarget = 0;
+    int lastCall = -1;
+
     Compiler(Compiler* enclosing, Token name, FunctionType type, GC* garbageCollector);
 };
 
+struct StringTable {
+    size_t count = 0;
+    std::vector<String*> entries;
+
+    String* find(const std::string& chars, uint32_t hash);
+    void insert(String* string);
+    void removeUnmarked(bool youngOnly);
+};
+
+struct Globals {
+    std::vector<Value> values;
+    std::vector<String*> names;
+    std::unordered_map<String*, uint16_t, StringHash> slots;
+
+    int resolve(String* name);
+};
+
+const size_t POOL_GRANULE = 16;
+const size_t POOL_MAX_SIZE = 512;
+const size_t POOL_CLASSES = POOL_MAX_SIZE / POOL_GRANULE;
+const size_t POOL_PAGE_SIZE = 64 * 1024;
+// Words in a bitmap with one bit per granule of a page.
+const size_t POOL_BITMAP_WORDS = POOL_PAGE_SIZE / POOL_GRANULE / 64;
+
+// Bytes allocated since the last collection that trigger a minor collection.
+const size_t NURSERY_SIZE = 256 * 1024;
+const size_t GC_STEP_BYTES = 64 * 1024;
+
+enum class GCPhase {
+    idle,
+    marking,
+    concurrentMarking,
+    sweeping
+};
+
+// The last bucket holds the pauses longer than the last limit.
+const int PAUSE_BUCKETS = 14;
+extern const double PAUSE_BUCKET_LIMITS[PAUSE_BUCKETS - 1];
+
+struct PauseStats {
+    size_t count = 0;
+    double total = 0;
+    double max = 0;
+    size_t buckets[PAUSE_BUCKETS] = {};
+
+    void record(double ms);
+};
+
+enum class GCTrigger {
+    nursery,
+    threshold,
+    heapMax,
+    collectCall
+};
+
+const size_t GC_TRIGGERS = (size_t)GCTrigger::collectCall + 1;
+
+struct TypeCensus {
+    size_t count = 0;
+    size_t bytes = 0;
+};
+
+// Nodes are in breadth-first order, so retainers lie on shortest paths.
+struct HeapGraph {
+    static const size_t NO_RETAINER = (size_t)-1;
+
+    struct Node {
+        Object* object;
+        size_t retainer;
+        std::string edge;
+    };
+
+    std::vector<Node> nodes;
+    std::unordered_map<Object*, size_t> index;
+
+    void census(TypeCensus (&types)[OBJECT_TYPES]);
+};
+
+// Pages are aligned to their size, so an object's page is found by masking its
+// address. Its bitmaps have a bit per granule, set for the granule an object
+// starts at.
+struct PoolPage {
+    size_t cellSize;
+    // Only the program's thread uses it.
+    uint64_t objectBits[POOL_BITMAP_WORDS];
+    // Atomic because concurrent marking sets them from the marker thread.
+    std::atomic<uint64_t> markBits[POOL_BITMAP_WORDS];
+    std::atomic<uint64_t> claimBits[POOL_BITMAP_WORDS];
+    std::atomic<uint64_t> scannedBits[POOL_BITMAP_WORDS];
+
+    static PoolPage* of(const void* memory) {
+        return (PoolPage*)((uintptr_t)memory & ~(uintptr_t)(POOL_PAGE_SIZE - 1));
+    }
+
+    static size_t granule(const void* memory) {
+        return ((uintptr_t)memory & (POOL_PAGE_SIZE - 1)) / POOL_GRANULE;
+    }
+
+    static uint64_t bit(size_t granule) {
+        return (uint64_t)1 << (granule % 64);
+    }
+
+    Object* objectAt(size_t granule) {
+        return (Object*)((char*)this + granule * POOL_GRANULE);
+    }
+
+    static bool test(std::atomic<uint64_t>* bits, const void* memory, std::memory_order order) {
+        size_t index = granule(memory);
+        return bits[index / 64].load(order) & bit(index);
+    }
+
+    // Sets the bit of memory and returns whether it was clear, even while
+    // another thread sets bits in the same word.
+    static bool testAndSet(std::atomic<uint64_t>* bits, const void* memory, std::memory_order order) {
+        size_t index = granule(memory);
+        uint64_t mask = bit(index);
+        if (bits[index / 64].load(std::memory_order_relaxed) & mask) return false;
+        return !(bits[index / 64].fetch_or(mask, order) & mask);
+    }
+
+    bool isMarked(const void* memory) {
+        return test(markBits, memory, std::memory_order_relaxed);
+    }
+
+    // For marking on the program's thread while no marker is running.
+    void mark(const void* memory) {
+        size_t index = granule(memory);
+        std::atomic<uint64_t>& word = markBits[index / 64];
+        word.store(word.load(std::memory_order_relaxed) | bit(index), std::memory_order_relaxed);
+    }
+
+    bool markAtomically(const void* memory) {
+        return testAndSet(markBits, memory, std::memory_order_relaxed);
+    }
+
+    bool claim(const void* memory) {
+        return testAndSet(claimBits, memory, std::memory_order_acquire);
+    }
+
+    bool isScanned(const void* memory) {
+        return test(scannedBits, memory, std::memory_order_acquire);
+    }
+
+    void setScanned(const void* memory) {
+        size_t index = granule(memory);
+        scannedBits[index / 64].fetch_or(bit(index), std::memory_order_release);
+    }
+
+    void clearMarks();
+};
+
+const size_t POOL_PAGE_HEADER = (sizeof(PoolPage) + POOL_GRANULE - 1) / POOL_GRANULE * POOL_GRANULE;
+
+struct PoolAllocator {
+    struct FreeCell {
+        FreeCell* next;
+    };
+
+    struct SizeClass {
+        FreeCell* freeList = nullptr;
+        char* cursor = nullptr;
+        char* limit = nullptr;
+    };
+
+    SizeClass classes[POOL_CLASSES];
+    std::vector<PoolPage*> pages;
+
+    void* allocate(size_t size);
+    void release(void* memory, size_t size);
+    void clearMarks();
+    void rebuildFreeLists();
+    ~PoolAllocator();
+
+    // f may free the object.
+    template <typename F>
+    void forEachObject(F f) {
+        for (size_t i = 0; i < pages.size(); i++) {
+            PoolPage* page = pages[i];
+            for (size_t word = 0; word < POOL_BITMAP_WORDS; word++) {
+                for (uint64_t bits = page->objectBits[word]; bits != 0; bits &= bits - 1) {
+                    f(page->objectAt(word * 64 + __builtin_ctzll(bits)));
+                }
+            }
+        }
+    }
+};
+
+// Writes string as a quoted JSON string.
+void writeJsonString(std::ostream& out, const std::string& string);
+
 struct GC {
-    size_t bytesAllocated = 0;
+    PoolAllocator allocator;
+    // Counts objects together with the buffers of their strings and
+    // containers. Static because HeapAllocator has no collector to report to.
+    static size_t bytesAllocated;
     size_t nextGC = 1024 * 1024;
-    Object* objects = nullptr;
+    // After a major collection the next one starts when the heap has grown
+    // this many times over.
+    double growthFactor = 2;
+    // The heap may not stay above this many bytes; 0 leaves it unlimited.
+    size_t heapMax = 0;
+    // Fraction of the pages compaction must be able to free; 0 never compacts.
+    double compactThreshold = 0;
+    // The frame of VM::interpret. Compaction pins the objects the native stack
+    // below it may point at, and can't run outside of it.
+    void* stackBase = nullptr;
+    // Set when the heap is still above heapMax after a full collection. The
+    // VM reports it as a runtime error at the next call, loop or string
+    // concatenation.
+    bool outOfMemory = false;
+    // Objects allocated since the last collection. A minor collection marks
+    // only young objects, from the roots and the remembered set, and promotes
+    // the survivors in place. Old objects are only found through the pages.
+    std::vector<Object*> youngObjects;
+    size_t bytesSurvived = 0;
+    bool minorCollection = false;
+    // Old objects that may point at young ones, recorded by writeBarrier.
+    std::vector<Object*> rememberedSet;
+    GCPhase phase = GCPhase::idle;
+    // In milliseconds; 0 runs major collections without interruption.
+    double pauseTarget = 1.0;
+    size_t nextStep = 0;
+    // Counts bitmap words from the first word of the first page.
+    size_t sweepCursor = 0;
+    bool concurrent = false;
+    std::thread marker;
+    std::atomic<bool> markerDone{false};
+    std::vector<Object*> snapshotObjects;
+    std::vector<Object*> handoff;
+    std::mutex handoffMutex;
+    PauseStats minorPauses;
+    PauseStats markPauses;
+    PauseStats remarkPauses;
+    PauseStats sweepPauses;
+    PauseStats fullPauses;
+    PauseStats compactPauses;
+    size_t collections[GC_TRIGGERS] = {};
+    size_t youngBytesReclaimed = 0;
+    size_t oldBytesReclaimed = 0;
+    std::string heapSnapshotPath;
+    bool heapSnapshotWritten = false;
+    // Records where objects are allocated, if profiling allocations.
+    AllocationProfiler* profiler = nullptr;
     std::vector<Object*> grayObjects;
+    StringTable strings;
+    Shape* emptyShape = nullptr;
+    std::vector<Shape*> shapes;
 
-    std::vector<Value>* stack;
+    Value* stack;
+    Value** stackTop;
     Upvalue** openUpvalues;
-    std::unordered_map<std::string, Value>* globals;
-    std::vector<CallFrame>* frames;
+    Globals* globals;
+    CallFrame* frames;
+    int* frameCount;
     Compiler* compiler = nullptr;
     String** initString;
 
@@ -69,9 +330,66 @@ struct GC {
     void blackenObject(Object* object);
     void traceReferences();
     void sweep();
+    void sweepWord(size_t index);
+    void sweepYoung();
     void collectGarbage();
+    void collectYoung();
+    void collectAll();
+    void startCycle();
+    bool markStep(double deadline);
+    void remark();
+    bool sweepStep(double deadline);
+    void step();
+    void finishCycle();
+    void startConcurrentCycle();
+    void traceConcurrently();
+    void scanObject(Object* object, std::vector<Object*>& gray);
+    void snapshot(Object* object);
+    void handOff();
+    void remarkConcurrent();
+    void sweepLazily();
+    void endCycle();
+    bool shouldCompact();
+    void compact();
+    void pinStack(const std::vector<PoolPage*>& sortedPages, std::unordered_set<Object*>& pinned);
+    void printStats(std::ostream& out);
+    void walkHeap(HeapGraph& graph);
+    void writeHeapSnapshot();
+
+    // Hash tables are estimated from their size and bucket count.
+    static size_t sizeOf(Object* object);
 
-    String* newString(std::string& chars);
+    void count(GCTrigger trigger) {
+        collections[(size_t)trigger]++;
+    }
+
+    static bool isMarked(Object* object) {
+        return PoolPage::of(object)->isMarked(object);
+    }
+
+    // Must be called before the references held by object change, so that
+    // concurrent marking sees the object as it was when marking started.
+    void beforeWrite(Object* object) {
+        if (phase == GCPhase::concurrentMarking && object->isOld) snapshot(object);
+    }
+
+    // Must be called when a reference to target is stored into object.
+    void writeBarrier(Object* object, Object* target) {
+        if (target == nullptr) return;
+        if (object->isOld && !object->isRemembered && !target->isOld) {
+            object->isRemembered = true;
+            rememberedSet.push_back(object);
+        }
+        // While marking, an object that has been reached must not point at
+        // one that hasn't, or the target could be freed while still in use.
+        if (phase == GCPhase::marking && isMarked(object) && !isMarked(target)) markObject(target);
+    }
+
+    void writeBarrier(Object* object, Value value) {
+        if (value.isObject()) writeBarrier(object, value.getObject());
+    }
+
+    String* newString(const std::string& chars);
     Function* newFunction(std::string& name);
     Native* newNative(NativeFn function);
     Upvalue* newUpvalue(Value* location, Upvalue* next);
@@ -79,8 +397,23 @@ struct GC {
     Class* newClass(std::string& name);
     Instance* newInstance(Class* klass);
     BoundMethod* newBoundMethod(Value receiver, Closure* method);
+    Array* newArray();
+    Shape* newShape(Shape* parent, String* name);
+    Shape* transition(Shape* shape, String* name);
     void freeObject(Object* object);
     void freeObjects();
+
+    template <typename T>
+    T* allocateObject() {
+        static_assert(sizeof(T) <= POOL_MAX_SIZE, "objects must fit in a pool cell");
+        return new (allocator.allocate(sizeof(T))) T;
+    }
+
+    template <typename T>
+    void releaseObject(T* object) {
+        object->~T();
+        allocator.release(object, sizeof(T));
+    }
 };
 
 
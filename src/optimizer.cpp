@@ -0,0 +1,199 @@
+#include "optimizer.h"
+#include <unordered_map>
+
+// Jumps refer to their target instruction while the chunk is decoded, so fusing
+// instructions only needs the offsets recomputed when it is encoded again.
+
+struct Instruction {
+    uint8_t op;
+    std::vector<uint8_t> operands;
+    int line;
+    int id;
+    int target = -1;
+};
+
+static bool isJump(uint8_t op) {
+    switch (op) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_GREATER:
+    case OP_JUMP_IF_NOT_GREATER:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static std::vector<Instruction> decode(const Chunk& chunk) {
+    std::vector<Instruction> code;
+    std::unordered_map<size_t, int> ids;
+
+    for (size_t offset = 0; offset < chunk.code.size();) {
+        size_t length = instructionLength(chunk, offset);
+
+        Instruction instruction;
+        instruction.op = chunk.code[offset];
+        instruction.line = chunk.lines[offset];
+        instruction.id = code.size();
+
+        if (isJump(instruction.op)) {
+            uint16_t jump = (uint16_t)((chunk.code[offset + 1] << 8) | chunk.code[offset + 2]);
+            instruction.target = instruction.op == OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+        } else {
+            instruction.operands.assign(chunk.code.begin() + offset + 1, chunk.code.begin() + offset + length);
+        }
+
+        ids[offset] = instruction.id;
+        code.push_back(instruction);
+        offset += length;
+    }
+
+    for (Instruction& instruction : code) {
+        if (instruction.target >= 0) instruction.target = ids.at(instruction.target);
+    }
+    return code;
+}
+
+static void encode(Chunk& chunk, const std::vector<Instruction>& code) {
+    std::unordered_map<int, size_t> offsets;
+    size_t offset = 0;
+    for (const Instruction& instruction : code) {
+        offsets[instruction.id] = offset;
+        offset += 1 + (isJump(instruction.op) ? 2 : instruction.operands.size());
+    }
+
+    chunk.code.clear();
+    chunk.lines.clear();
+    for (const Instruction& instruction : code) {
+        chunk.code.push_back(instruction.op);
+
+        if (isJump(instruction.op)) {
+            size_t next = chunk.code.size() + 2;
+            size_t target = offsets.at(instruction.target);
+            uint16_t jump = (uint16_t)(instruction.op == OP_LOOP ? next - target : target - next);
+            chunk.code.push_back((jump >> 8) & 0xff);
+            chunk.code.push_back(jump & 0xff);
+        } else {
+            chunk.code.insert(chunk.code.end(), instruction.operands.begin(), instruction.operands.end());
+        }
+
+        chunk.lines.resize(chunk.code.size(), instruction.line);
+    }
+}
+
+static uint8_t negatedCompare(uint8_t op) {
+    switch (op) {
+    case OP_EQUAL: return OP_NOT_EQUAL;
+    case OP_LESS: return OP_GREATER_EQUAL;
+    case OP_GREATER: return OP_LESS_EQUAL;
+    default: return 0;
+    }
+}
+
+static uint8_t compareJump(uint8_t op) {
+    switch (op) {
+    case OP_EQUAL: return OP_JUMP_IF_NOT_EQUAL;
+    case OP_NOT_EQUAL: return OP_JUMP_IF_EQUAL;
+    case OP_LESS: return OP_JUMP_IF_NOT_LESS;
+    case OP_GREATER_EQUAL: return OP_JUMP_IF_LESS;
+    case OP_GREATER: return OP_JUMP_IF_NOT_GREATER;
+    case OP_LESS_EQUAL: return OP_JUMP_IF_GREATER;
+    default: return 0;
+    }
+}
+
+static bool fuse(const Chunk& chunk, const std::vector<Instruction>& code, size_t i,
+    const std::vector<bool>& targets, const std::vector<uint8_t>& ops, std::vector<Instruction>& out, size_t& length) {
+    auto at = [&](size_t k, uint8_t op) {
+        return i + k < code.size() && code[i + k].op == op && !targets[code[i + k].id];
+    };
+    const Instruction& first = code[i];
+    Instruction fused = first;
+
+    if (first.op == OP_GET_LOCAL && at(1, OP_CONSTANT) && chunk.constants[code[i + 1].operands[0]].isNumber()) {
+        if (at(2, OP_ADD) || at(2, OP_SUBTRACT)) {
+            fused.op = code[i + 2].op == OP_ADD ? OP_ADD_LOCAL_CONSTANT : OP_SUBTRACT_LOCAL_CONSTANT;
+            fused.operands.push_back(code[i + 1].operands[0]);
+            fused.line = code[i + 2].line;
+            length = 3;
+            out.push_back(fused);
+            return true;
+        }
+    }
+
+    if (first.op == OP_JUMP_IF_FALSE && at(1, OP_POP) && ops[first.target] == OP_POP) {
+        fused.op = OP_POP_JUMP_IF_FALSE;
+        fused.target = first.target + 1;
+        length = 2;
+        out.push_back(fused);
+        return true;
+    }
+
+    if (compareJump(first.op) != 0 && at(1, OP_POP_JUMP_IF_FALSE)) {
+        fused.op = compareJump(first.op);
+        fused.target = code[i + 1].target;
+        length = 2;
+        out.push_back(fused);
+        return true;
+    }
+
+    if (negatedCompare(first.op) != 0 && at(1, OP_NOT)) {
+        fused.op = negatedCompare(first.op);
+        length = 2;
+        out.push_back(fused);
+        return true;
+    }
+
+    if ((first.op == OP_SET_LOCAL || first.op == OP_SET_GLOBAL) && at(1, OP_POP)) {
+        fused.op = first.op == OP_SET_LOCAL ? OP_SET_LOCAL_POP : OP_SET_GLOBAL_POP;
+        length = 2;
+        out.push_back(fused);
+        return true;
+    }
+
+    return false;
+}
+
+void optimizeChunk(Chunk& chunk) {
+    std::vector<Instruction> code = decode(chunk);
+
+    // Only the first instruction of a fused group may be jumped to. A jump
+    // that skips the POP at its target lands on the instruction after it.
+    std::vector<bool> targets(code.size() + 1, false);
+    std::vector<uint8_t> ops;
+    for (const Instruction& instruction : code) {
+        ops.push_back(instruction.op);
+    }
+    for (const Instruction& instruction : code) {
+        if (instruction.target < 0) continue;
+        targets[instruction.target] = true;
+        if (instruction.op == OP_JUMP_IF_FALSE && ops[instruction.target] == OP_POP) {
+            targets[instruction.target + 1] = true;
+        }
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        std::vector<Instruction> out;
+        for (size_t i = 0; i < code.size();) {
+            size_t length;
+            if (fuse(chunk, code, i, targets, ops, out, length)) {
+                changed = true;
+                i += length;
+            } else {
+                out.push_back(code[i]);
+                i++;
+            }
+        }
+        code = out;
+    }
+
+    encode(chunk, code);
+}
@@ -0,0 +1,8 @@
+#ifndef optimizer_h
+#define optimizer_h
+
+#include "value.h"
+
+void optimizeChunk(Chunk& chunk);
+
+#endif
@@ -0,0 +1,258 @@
+#include "profiler.h"
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <climits>
+#include <algorithm>
+
+AllocationProfiler::AllocationProfiler(GC* garbageCollector, size_t rate) : garbageCollector(garbageCollector) {
+    setRate(rate);
+}
+
+void AllocationProfiler::setRate(size_t rate) {
+    this->rate = rate;
+    countdown = nextCountdown();
+}
+
+// Allocations until the next one recorded: from 1 to 2 * rate - 1, rate on
+// average.
+size_t AllocationProfiler::nextCountdown() {
+    if (rate == 1) return 1;
+    random ^= random << 13;
+    random ^= random >> 7;
+    random ^= random << 17;
+    return 1 + random % (2 * rate - 1);
+}
+
+// The site of the allocation being made. The interpreter stores the frame's ip
+// or pc before anything that allocates, pointing past the instruction.
+size_t AllocationProfiler::currentSite() {
+    GC& gc = *garbageCollector;
+    Function* function = nullptr;
+    int line;
+    if (*gc.frameCount > 0) {
+        CallFrame* frame = &gc.frames[*gc.frameCount - 1];
+        function = frame->closure->function;
+        if (frame->pc != nullptr) {
+            size_t offset = frame->pc - function->registerCode.data();
+            line = function->registerLines[offset > 0 ? offset - 1 : 0];
+        } else {
+            size_t offset = frame->ip - function->chunk.code.data();
+            line = function->chunk.lines[offset > 0 ? offset - 1 : 0];
+        }
+    } else {
+        // Without a frame it is the compiler, or the VM itself, allocating.
+        line = gc.compiler != nullptr ? 0 : -1;
+    }
+
+    auto found = siteIndex.find({ function, line });
+    if (found != siteIndex.end()) return found->second;
+
+    std::string name;
+    if (function != nullptr) {
+        name = function->name == "" ? "script" : function->name + "()";
+    } else {
+        name = line == 0 ? "<compiler>" : "<vm>";
+    }
+
+    size_t index;
+    auto named = siteByName.find({ name, line });
+    if (named != siteByName.end()) {
+        index = named->second;
+    } else {
+        index = sites.size();
+        sites.push_back({ name, line, {}, {} });
+        siteByName.insert({ { name, line }, index });
+    }
+    siteIndex.insert({ { function, line }, index });
+    return index;
+}
+
+void AllocationProfiler::record(Object* object) {
+    countdown = nextCountdown();
+
+    size_t site = currentSite();
+    TypeCensus& allocated = sites[site].allocated[(size_t)object->type];
+    allocated.count += rate;
+    allocated.bytes += GC::sizeOf(object) * rate;
+    sampled[object] = site;
+    object->isSampled = true;
+}
+
+void AllocationProfiler::forget(Object* object) {
+    if (object->isSampled) sampled.erase(object);
+    if (object->type != ObjectType::Function) return;
+
+    Function* function = (Function*)object;
+    auto entry = siteIndex.lower_bound({ function, INT_MIN });
+    while (entry != siteIndex.end() && entry->first.first == function) {
+        entry = siteIndex.erase(entry);
+    }
+}
+
+void AllocationProfiler::forwardObjects(Object* (*forwarded)(Object*)) {
+    std::unordered_map<Object*, size_t> moved;
+    moved.reserve(sampled.size());
+    for (auto& entry : sampled) {
+        moved.insert({ forwarded(entry.first), entry.second });
+    }
+    sampled.swap(moved);
+}
+
+// Young objects are left out: they were allocated after the collection
+// started and haven't been through one yet.
+void AllocationProfiler::measureRetained() {
+    majorCollections++;
+    for (Site& site : sites) {
+        for (TypeCensus& retained : site.retained) {
+            retained = TypeCensus();
+        }
+    }
+
+    for (auto& entry : sampled) {
+        Object* object = entry.first;
+        if (!object->isOld) continue;
+        TypeCensus& retained = sites[entry.second].retained[(size_t)object->type];
+        retained.count += rate;
+        retained.bytes += GC::sizeOf(object) * rate;
+    }
+}
+
+static TypeCensus total(const TypeCensus (&types)[OBJECT_TYPES]) {
+    TypeCensus sum;
+    for (const TypeCensus& type : types) {
+        sum.count += type.count;
+        sum.bytes += type.bytes;
+    }
+    return sum;
+}
+
+void AllocationProfiler::print(std::ostream& out) {
+    std::vector<size_t> order(sites.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+        return total(sites[a].allocated).bytes > total(sites[b].allocated).bytes;
+    });
+
+    out << "allocation profile: ";
+    if (rate == 1) {
+        out << "every allocation recorded";
+    } else {
+        out << "1 in " << rate << " allocations recorded, counts and bytes estimated";
+    }
+    // Retained memory is only measured by major collections.
+    bool measured = majorCollections > 0;
+    if (measured) {
+        out << "; retained memory as of the last of " << majorCollections << " major collections" << std::endl;
+    } else {
+        out << "; no major collection has run, so retained memory is unknown" << std::endl;
+    }
+
+    char line[160];
+    const char* columns = measured ? "       objects        bytes   retained  retained bytes" : "       objects        bytes";
+    out << "allocations by site           " << columns << std::endl;
+    for (size_t index : order) {
+        Site& site = sites[index];
+        std::string name = site.line > 0 ? "[line " + std::to_string(site.line) + "] in " + site.function : site.function;
+        TypeCensus allocated = total(site.allocated);
+        TypeCensus retained = total(site.retained);
+        std::snprintf(line, sizeof(line), "  %-30s %12zu %12zu", name.c_str(), allocated.count, allocated.bytes);
+        out << line;
+        if (measured) {
+            std::snprintf(line, sizeof(line), " %10zu %15zu", retained.count, retained.bytes);
+            out << line;
+        }
+        out << std::endl;
+    }
+
+    out << "allocations by type           " << columns << std::endl;
+    for (size_t i = 0; i < OBJECT_TYPES; i++) {
+        TypeCensus allocated, retained;
+        for (Site& site : sites) {
+            allocated.count += site.allocated[i].count;
+            allocated.bytes += site.allocated[i].bytes;
+            retained.count += site.retained[i].count;
+            retained.bytes += site.retained[i].bytes;
+        }
+        if (allocated.count == 0) continue;
+        std::snprintf(line, sizeof(line), "  %-30s %12zu %12zu", stringifyObjectType((ObjectType)i).c_str(), allocated.count, allocated.bytes);
+        out << line;
+        if (measured) {
+            std::snprintf(line, sizeof(line), " %10zu %15zu", retained.count, retained.bytes);
+            out << line;
+        }
+        out << std::endl;
+    }
+}
+
+// Retained counts are null until a major collection has measured them.
+static void writeCounts(std::ostream& out, const TypeCensus& allocated, const TypeCensus& retained, bool measured) {
+    out << "\"objects\": " << allocated.count << ", \"bytes\": " << allocated.bytes;
+    if (measured) {
+        out << ", \"retainedObjects\": " << retained.count << ", \"retainedBytes\": " << retained.bytes;
+    } else {
+        out << ", \"retainedObjects\": null, \"retainedBytes\": null";
+    }
+}
+
+// One object per site with its totals and those of each type it allocated,
+// then the totals of each type.
+void AllocationProfiler::writeJson(std::ostream& out) {
+    out << "{\"rate\": " << rate << ", \"majorCollections\": " << majorCollections << ",\n\"sites\": [\n";
+    for (size_t i = 0; i < sites.size(); i++) {
+        Site& site = sites[i];
+        out << "{\"function\": ";
+        writeJsonString(out, site.function);
+        out << ", \"line\": ";
+        if (site.line > 0) {
+            out << site.line;
+        } else {
+            out << "null";
+        }
+        out << ", ";
+        writeCounts(out, total(site.allocated), total(site.retained), majorCollections > 0);
+        out << ", \"types\": {";
+        bool first = true;
+        for (size_t type = 0; type < OBJECT_TYPES; type++) {
+            if (site.allocated[type].count == 0) continue;
+            if (!first) out << ", ";
+            first = false;
+            writeJsonString(out, stringifyObjectType((ObjectType)type));
+            out << ": {";
+            writeCounts(out, site.allocated[type], site.retained[type], majorCollections > 0);
+            out << "}";
+        }
+        out << "}}" << (i + 1 < sites.size() ? ",\n" : "\n");
+    }
+
+    out << "],\n\"types\": {";
+    for (size_t type = 0; type < OBJECT_TYPES; type++) {
+        TypeCensus allocated, retained;
+        for (Site& site : sites) {
+            allocated.count += site.allocated[type].count;
+            allocated.bytes += site.allocated[type].bytes;
+            retained.count += site.retained[type].count;
+            retained.bytes += site.retained[type].bytes;
+        }
+        if (type > 0) out << ", ";
+        writeJsonString(out, stringifyObjectType((ObjectType)type));
+        out << ": {";
+        writeCounts(out, allocated, retained, majorCollections > 0);
+        out << "}";
+    }
+    out << "}}" << std::endl;
+}
+
+void AllocationProfiler::writeReports() {
+    if (printReport) print(std::cerr);
+    if (jsonPath.empty()) return;
+
+    std::ofstream out(jsonPath);
+    if (!out) {
+        std::cerr << "Could not open file \"" << jsonPath << "\"." << std::endl;
+        return;
+    }
+    writeJson(out);
+}
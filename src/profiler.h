@@ -0,0 +1,77 @@
+#ifndef profiler_h
+#define profiler_h
+
+#include <ostream>
+#include <map>
+#include "memory.h"
+
+// Attributes allocations to the line of the script that made them. Every
+// GC::new* call is passed to sample; one in rate of them, picked at random so
+// that no allocation pattern is always skipped, is recorded with the function
+// and line of the frame running at the time. Recorded objects are tracked
+// until they are freed, so after each major collection the profiler knows
+// which sites the surviving memory came from. Counts and bytes are scaled by
+// rate, so they estimate the totals.
+class AllocationProfiler {
+public:
+    // Print a text report to stderr when the program ends.
+    bool printReport = false;
+    // Write a JSON report here when the program ends, unless empty.
+    std::string jsonPath;
+
+    AllocationProfiler(GC* garbageCollector, size_t rate);
+
+    void setRate(size_t rate);
+
+    void sample(Object* object) {
+        if (--countdown == 0) record(object);
+    }
+
+    // Called by the collector before it frees any object.
+    void freed(Object* object) {
+        if (object->isSampled || object->type == ObjectType::Function) forget(object);
+    }
+
+    // Rekeys the recorded objects after compaction has moved some of them.
+    void forwardObjects(Object* (*forwarded)(Object*));
+    // Counts the recorded objects that have survived a collection towards
+    // their sites' retained memory. Called at the end of a major collection.
+    void measureRetained();
+
+    void print(std::ostream& out);
+    void writeJson(std::ostream& out);
+    void writeReports();
+
+private:
+    struct Site {
+        // "script", "name()" or where there was no frame, "<compiler>" or
+        // "<vm>" for the VM itself, such as the closure it wraps the script in.
+        std::string function;
+        int line;
+        TypeCensus allocated[OBJECT_TYPES];
+        TypeCensus retained[OBJECT_TYPES];
+    };
+
+    GC* garbageCollector;
+    size_t rate;
+    size_t countdown;
+    uint64_t random = 0x9e3779b97f4a7c15;
+    size_t majorCollections = 0;
+
+    std::vector<Site> sites;
+    // Sites by the function running and its line. A function that is freed
+    // is dropped, as another one may be allocated at its address.
+    std::map<std::pair<Function*, int>, size_t> siteIndex;
+    // Sites by their description, shared by functions compiled from the same
+    // source, such as those of a REPL line run twice.
+    std::map<std::pair<std::string, int>, size_t> siteByName;
+    // Recorded objects that are still alive and the site of each.
+    std::unordered_map<Object*, size_t> sampled;
+
+    void record(Object* object);
+    void forget(Object* object);
+    size_t nextCountdown();
+    size_t currentSite();
+};
+
+#endif
@@ -2,134 +2,118 @@
 #include <sstream>
 #include <map>
 
-Value::Value() {
-    type = ValueType::nil;
-}
-
-Value::Value(bool boolean) {
-    type = ValueType::boolean;
-    as.boolean = boolean;
-}
-
-Value::Value(double number) {
-    type = ValueType::number;
-    as.number = number;
-}
-
-Value::Value(Object* object) {
-    type = ValueType::object;
-    as.object = object;
-}
-
-Value::Value(String* string) {
-    type = ValueType::object;
-    as.object = (Object*)string;
-}
-
-Value::Value(Function* function) {
-    type = ValueType::object;
-    as.object = (Object*)function;
-}
-
-Value::Value(Native* native) {
-    type = ValueType::object;
-    as.object = (Object*)native;
-}
-
-Value::Value(Closure* closure) {
-    type = ValueType::object;
-    as.object = (Object*)closure;
-}
-
-Value::Value(Upvalue* upvalue) {
-    type = ValueType::object;
-    as.object = (Object*)upvalue;
-}
-
-Value::Value(Class* klass) {
-    type = ValueType::object;
-    as.object = (Object*)klass;
-}
-
-Value::Value(Instance* instance) {
-    type = ValueType::object;
-    as.object = (Object*)instance;
-}
-
-Value::Value(BoundMethod* boundMethod) {
-    type = ValueType::object;
-    as.object = (Object*)boundMethod;
+uint32_t hashString(const std::string& chars) {
+    uint32_t hash = 2166136261u;
+    for (char c : chars) {
+        hash ^= (uint8_t)c;
+        hash *= 16777619;
+    }
+    return hash;
 }
 
-String* Value::getString() { return (String*)as.object; }
-Function* Value::getFunction() { return (Function*)as.object; }
-Native* Value::getNative() { return (Native*)as.object; }
-Closure* Value::getClosure() { return (Closure*)as.object; }
-Class* Value::getClass() { return (Class*)as.object; }
-Instance* Value::getInstance() { return (Instance*)as.object; }
-BoundMethod* Value::getBoundMethod() { return (BoundMethod*)as.object; }
-
 std::string Value::stringify() {
-    switch (type) {
-    case ValueType::nil: return "nil";
-    case ValueType::boolean: return (as.boolean ? "true" : "false");
-    case ValueType::number: {
+    if (isNil()) return "nil";
+    if (isBoolean()) return (getBoolean() ? "true" : "false");
+    if (isNumber()) {
         std::stringstream string;
         string.precision(15);
-        string << as.number;
+        string << getNumber();
         return string.str();
     }
-    case ValueType::object: {
-        switch (as.object->type) {
-        case ObjectType::String: return this->getString()->chars;
-        case ObjectType::Native: return "<native fn>";
-        case ObjectType::Closure: {
-            Function* fn = this->getClosure()->function;
-            if (fn->name == "") return "<script>";
-            else return "<fn " + fn->name + ">";
-        }
-        case ObjectType::Function: {
-            Function* fn = this->getFunction();
-            if (fn->name == "") return "[script]";
-            else return "[fn " + fn->name + "]";
-        }
-        case ObjectType::Upvalue: return "upvalue";
-        case ObjectType::Class: return this->getClass()->name;
-        case ObjectType::BoundMethod: {
-            Function* fn = this->getBoundMethod()->method->function;
-            if (fn->name == "") return "<script>";
-            else return "<fn " + fn->name + ">";
+
+    switch (getObject()->type) {
+    case ObjectType::String: return this->getString()->chars;
+    case ObjectType::Native: return "<native fn>";
+    case ObjectType::Closure: {
+        Function* fn = this->getClosure()->function;
+        if (fn->name == "") return "<script>";
+        else return "<fn " + fn->name + ">";
+    }
+    case ObjectType::Function: {
+        Function* fn = this->getFunction();
+        if (fn->name == "") return "[script]";
+        else return "[fn " + fn->name + "]";
+    }
+    case ObjectType::Upvalue: return "upvalue";
+    case ObjectType::Class: return this->getClass()->name;
+    case ObjectType::BoundMethod: {
+        Function* fn = this->getBoundMethod()->method->function;
+        if (fn->name == "") return "<script>";
+        else return "<fn " + fn->name + ">";
+    }
+    case ObjectType::Instance: {
+        Instance* instance = this->getInstance();
+        std::map<std::string, Value> ordered;
+        if (instance->dictionary != nullptr) {
+            for (auto& field : *instance->dictionary) {
+                ordered.insert({ field.first->chars, field.second });
+            }
+        } else {
+            for (auto& slot : instance->shape->slots) {
+                ordered.insert({ slot.first->chars, instance->fields[slot.second] });
+            }
         }
-        case ObjectType::Instance: {
-            Instance* instance = this->getInstance();
-            std::map<std::string, Value> ordered(instance->fields.begin(), instance->fields.end());
-            if (instance->klass != nullptr) {
-                ordered.insert(instance->klass->methods.begin(), instance->klass->methods.end());
+        if (instance->klass != nullptr) {
+            for (auto& method : instance->klass->methods) {
+                ordered.insert({ method.first->chars, method.second });
             }
+        }
 
-            std::stringstream ss;
-            ss << "{";
-            for (auto it = ordered.begin(); it != ordered.end(); ++it) {
-                if (it != ordered.begin()) {
-                    ss << ", ";
-                }
-                Value value = it->second;
-                std::string string = value.stringify();
-                if (value.type == ValueType::object && value.as.object->type == ObjectType::String) {
-                    string = "\"" + string + "\"";
-                };
-                ss << it->first << ": " << string;
+        std::stringstream ss;
+        ss << "{";
+        for (auto it = ordered.begin(); it != ordered.end(); ++it) {
+            if (it != ordered.begin()) {
+                ss << ", ";
             }
-            ss << "}";
-            return ss.str();
+            Value value = it->second;
+            std::string string = value.stringify();
+            if (value.isObjectType(ObjectType::String)) {
+                string = "\"" + string + "\"";
+            };
+            ss << it->first << ": " << string;
         }
+        ss << "}";
+        return ss.str();
+    }
+    case ObjectType::Array: {
+        Array* array = this->getArray();
+
+        std::stringstream ss;
+        ss << "[";
+        for (size_t i = 0; i < array->values.size(); i++) {
+            if (i != 0) {
+                ss << ", ";
+            }
+            Value value = array->values[i];
+            std::string string = value.stringify();
+            if (value.isObjectType(ObjectType::String)) {
+                string = "\"" + string + "\"";
+            };
+            ss << string;
         }
+        ss << "]";
+        return ss.str();
     }
     }
 
     return "unexpected type";
 }
 
+std::string stringifyObjectType(ObjectType type) {
+    switch (type) {
+    case ObjectType::String: return "String";
+    case ObjectType::Function: return "Function";
+    case ObjectType::Native: return "Native";
+    case ObjectType::Upvalue: return "Upvalue";
+    case ObjectType::Closure: return "Closure";
+    case ObjectType::Class: return "Class";
+    case ObjectType::Instance: return "Instance";
+    case ObjectType::BoundMethod: return "BoundMethod";
+    case ObjectType::Array: return "Array";
+    }
+    return "unexpected type";
+}
+
 std::string stringifyOpCode(OpCode opCode) {
     switch (opCode) {
     case OP_CONSTANT: return "CONSTANT";
@@ -173,6 +157,71 @@ std::string stringifyOpCode(OpCode opCode) {
     case OP_ARRAY: return "ARRAY";
     case OP_MAP: return "MAP";
     case OP_KEY: return "KEY";
+    case OP_EQUAL_NUM: return "EQUAL_NUM";
+    case OP_ADD_NUM: return "ADD_NUM";
+    case OP_ADD_STR: return "ADD_STR";
+    case OP_NOT_EQUAL: return "NOT_EQUAL";
+    case OP_GREATER_EQUAL: return "GREATER_EQUAL";
+    case OP_LESS_EQUAL: return "LESS_EQUAL";
+    case OP_POP_JUMP_IF_FALSE: return "POP_JUMP_IF_FALSE";
+    case OP_JUMP_IF_EQUAL: return "JUMP_IF_EQUAL";
+    case OP_JUMP_IF_NOT_EQUAL: return "JUMP_IF_NOT_EQUAL";
+    case OP_JUMP_IF_LESS: return "JUMP_IF_LESS";
+    case OP_JUMP_IF_NOT_LESS: return "JUMP_IF_NOT_LESS";
+    case OP_JUMP_IF_GREATER: return "JUMP_IF_GREATER";
+    case OP_JUMP_IF_NOT_GREATER: return "JUMP_IF_NOT_GREATER";
+    case OP_ADD_LOCAL_CONSTANT: return "ADD_LOCAL_CONSTANT";
+    case OP_SUBTRACT_LOCAL_CONSTANT: return "SUBTRACT_LOCAL_CONSTANT";
+    case OP_SET_LOCAL_POP: return "SET_LOCAL_POP";
+    case OP_SET_GLOBAL_POP: return "SET_GLOBAL_POP";
+    case OP_TAIL_CALL: return "TAIL_CALL";
     default: return "Unexpected code: " + std::to_string(opCode);
     }
+}
+
+size_t instructionLength(const Chunk& chunk, size_t offset) {
+    switch (chunk.code[offset]) {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_INVOKE_BY_KEY:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_ARRAY:
+    case OP_KEY:
+    case OP_SET_LOCAL_POP:
+        return 2;
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_GREATER:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_SUBTRACT_LOCAL_CONSTANT:
+    case OP_SET_GLOBAL_POP:
+        return 3;
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+        return 4;
+    case OP_INVOKE:
+        return 5;
+    case OP_CLOSURE: {
+        Function* function = chunk.constants[chunk.code[offset + 1]].getFunction();
+        return 2 + 2 * function->upvalueCount;
+    }
+    default:
+        return 1;
+    }
 }
\ No newline at end of file
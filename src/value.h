@@ -4,6 +4,9 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <cstdint>
+#include <cstring>
+#include <memory>
 
 typedef struct VM VM;
 typedef struct String String;
@@ -14,8 +17,10 @@ typedef struct Upvalue Upvalue;
 typedef struct Class Class;
 typedef struct Instance Instance;
 typedef struct BoundMethod BoundMethod;
+typedef struct Array Array;
+typedef struct CallFrame CallFrame;
 
-enum class ObjectType {
+enum class ObjectType : uint8_t {
     String,
     Function,
     Native,
@@ -24,19 +29,85 @@ enum class ObjectType {
     Class,
     Instance,
     BoundMethod,
+    Array,
 };
 
+const size_t OBJECT_TYPES = (size_t)ObjectType::Array + 1;
+
+std::string stringifyObjectType(ObjectType type);
+
+// The header every object starts with. Marks live in the page the object was
+// allocated from, so this is all the collector needs in the object itself.
 struct Object {
     ObjectType type;
-    bool isMarked = false;
-    Object* next;
+    // Set once the object has survived a collection.
+    bool isOld = false;
+    // Set while the object is in the GC's remembered set.
+    bool isRemembered = false;
+    // Set when the allocation profiler has recorded the object.
+    bool isSampled = false;
 };
 
+#ifndef TAGGED_VALUES
+#define NAN_BOXING
+#endif
+
+#ifdef NAN_BOXING
+
+// A Value is a single 64-bit word: doubles are stored as is, everything else
+// lives inside the quiet NaN space (pointers use the sign bit, the rest are tags).
+const uint64_t SIGN_BIT = 0x8000000000000000;
+const uint64_t QNAN = 0x7ffc000000000000;
+const uint64_t TAG_NIL = 1;
+const uint64_t TAG_FALSE = 2;
+const uint64_t TAG_TRUE = 3;
+const uint64_t TAG_UNDEFINED = 4;
+
+struct Value {
+    uint64_t bits;
+
+    Value() : bits(QNAN | TAG_NIL) {}
+    Value(bool boolean) : bits(boolean ? (QNAN | TAG_TRUE) : (QNAN | TAG_FALSE)) {}
+    Value(double number) { std::memcpy(&bits, &number, sizeof(double)); }
+    Value(Object* object) : bits(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)object) {}
+    Value(String* string) : Value((Object*)string) {}
+    Value(Function* function) : Value((Object*)function) {}
+    Value(Native* native) : Value((Object*)native) {}
+    Value(Closure* closure) : Value((Object*)closure) {}
+    Value(Upvalue* upvalue) : Value((Object*)upvalue) {}
+    Value(Class* klass) : Value((Object*)klass) {}
+    Value(Instance* instance) : Value((Object*)instance) {}
+    Value(BoundMethod* boundMethod) : Value((Object*)boundMethod) {}
+    Value(Array* array) : Value((Object*)array) {}
+
+    static Value undefined() {
+        Value value;
+        value.bits = QNAN | TAG_UNDEFINED;
+        return value;
+    }
+
+    bool isNil() const { return bits == (QNAN | TAG_NIL); }
+    bool isUndefined() const { return bits == (QNAN | TAG_UNDEFINED); }
+    bool isBoolean() const { return (bits | 1) == (QNAN | TAG_TRUE); }
+    bool isNumber() const { return (bits & QNAN) != QNAN; }
+    bool isObject() const { return (bits & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT); }
+
+    bool getBoolean() const { return bits == (QNAN | TAG_TRUE); }
+    double getNumber() const {
+        double number;
+        std::memcpy(&number, &bits, sizeof(double));
+        return number;
+    }
+    Object* getObject() const { return (Object*)(uintptr_t)(bits & ~(SIGN_BIT | QNAN)); }
+
+#else
+
 enum class ValueType {
     nil,
     boolean,
     number,
     object,
+    undefined,
 };
 
 struct Value {
@@ -47,35 +118,106 @@ struct Value {
         Object* object;
     } as;
 
-    Value();
-    Value(bool boolean);
-    Value(double number);
-    Value(Object* object);
-    Value(String* string);
-    Value(Function* function);
-    Value(Native* native);
-    Value(Closure* closure);
-    Value(Upvalue* upvalue);
-    Value(Class* klass);
-    Value(Instance* instance);
-    Value(BoundMethod* instance);
-
-    String* getString();
-    Function* getFunction();
-    Native* getNative();
-    Closure* getClosure();
-    Class* getClass();
-    Instance* getInstance();
-    BoundMethod* getBoundMethod();
+    Value() : type(ValueType::nil) {}
+    Value(bool boolean) : type(ValueType::boolean) { as.boolean = boolean; }
+    Value(double number) : type(ValueType::number) { as.number = number; }
+    Value(Object* object) : type(ValueType::object) { as.object = object; }
+    Value(String* string) : Value((Object*)string) {}
+    Value(Function* function) : Value((Object*)function) {}
+    Value(Native* native) : Value((Object*)native) {}
+    Value(Closure* closure) : Value((Object*)closure) {}
+    Value(Upvalue* upvalue) : Value((Object*)upvalue) {}
+    Value(Class* klass) : Value((Object*)klass) {}
+    Value(Instance* instance) : Value((Object*)instance) {}
+    Value(BoundMethod* boundMethod) : Value((Object*)boundMethod) {}
+    Value(Array* array) : Value((Object*)array) {}
+
+    static Value undefined() {
+        Value value;
+        value.type = ValueType::undefined;
+        return value;
+    }
+
+    bool isNil() const { return type == ValueType::nil; }
+    bool isUndefined() const { return type == ValueType::undefined; }
+    bool isBoolean() const { return type == ValueType::boolean; }
+    bool isNumber() const { return type == ValueType::number; }
+    bool isObject() const { return type == ValueType::object; }
+
+    bool getBoolean() const { return as.boolean; }
+    double getNumber() const { return as.number; }
+    Object* getObject() const { return as.object; }
+
+#endif
+
+    bool isObjectType(ObjectType objectType) const { return isObject() && getObject()->type == objectType; }
+
+    String* getString() const { return (String*)getObject(); }
+    Function* getFunction() const { return (Function*)getObject(); }
+    Native* getNative() const { return (Native*)getObject(); }
+    Closure* getClosure() const { return (Closure*)getObject(); }
+    Class* getClass() const { return (Class*)getObject(); }
+    Instance* getInstance() const { return (Instance*)getObject(); }
+    BoundMethod* getBoundMethod() const { return (BoundMethod*)getObject(); }
+    Array* getArray() const { return (Array*)getObject(); }
 
     std::string stringify();
 };
 
-typedef std::unordered_map<std::string, Value> Table;
+// Containers inside heap objects allocate their buffers through HeapAllocator,
+// which counts them towards the collector's heap size.
+void heapBufferAllocated(size_t size);
+void heapBufferFreed(size_t size);
+
+template <typename T>
+struct HeapAllocator {
+    typedef T value_type;
+
+    HeapAllocator() = default;
+    template <typename U>
+    HeapAllocator(const HeapAllocator<U>&) {}
+
+    T* allocate(size_t count) {
+        heapBufferAllocated(count * sizeof(T));
+        return std::allocator<T>().allocate(count);
+    }
+
+    void deallocate(T* buffer, size_t count) {
+        heapBufferFreed(count * sizeof(T));
+        std::allocator<T>().deallocate(buffer, count);
+    }
+
+    template <typename U>
+    bool operator==(const HeapAllocator<U>&) const { return true; }
+    template <typename U>
+    bool operator!=(const HeapAllocator<U>&) const { return false; }
+};
+
+template <typename T>
+using HeapVector = std::vector<T, HeapAllocator<T>>;
 
 struct String {
     Object object;
     std::string chars;
+    uint32_t hash;
+};
+
+uint32_t hashString(const std::string& chars);
+
+struct StringHash {
+    size_t operator()(String* string) const { return string->hash; }
+};
+
+typedef std::unordered_map<String*, Value, StringHash, std::equal_to<String*>, HeapAllocator<std::pair<String* const, Value>>> Table;
+
+const size_t MAX_SHAPE_FIELDS = 32;
+const size_t MAX_SHAPE_TRANSITIONS = 32;
+
+struct Shape {
+    Shape* parent;
+    String* name;
+    std::unordered_map<String*, uint32_t, StringHash> slots;
+    std::unordered_map<String*, Shape*, StringHash> transitions;
 };
 
 enum OpCode {
@@ -121,22 +263,143 @@ enum OpCode {
     OP_ARRAY,
     OP_MAP,
     OP_KEY,
+    OP_EQUAL_NUM,
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_NOT_EQUAL,
+    OP_GREATER_EQUAL,
+    OP_LESS_EQUAL,
+    OP_POP_JUMP_IF_FALSE,
+    OP_JUMP_IF_EQUAL,
+    OP_JUMP_IF_NOT_EQUAL,
+    OP_JUMP_IF_LESS,
+    OP_JUMP_IF_NOT_LESS,
+    OP_JUMP_IF_GREATER,
+    OP_JUMP_IF_NOT_GREATER,
+    OP_ADD_LOCAL_CONSTANT,
+    OP_SUBTRACT_LOCAL_CONSTANT,
+    OP_SET_LOCAL_POP,
+    OP_SET_GLOBAL_POP,
+    OP_TAIL_CALL,
 };
 
 std::string stringifyOpCode(OpCode opCode);
 
+const int INLINE_CACHE_ENTRIES = 4;
+
+struct InlineCacheEntry {
+    Shape* shape;
+    Class* klass;
+    Shape* transition;
+    Closure* method;
+    uint32_t slot;
+};
+
+struct InlineCache {
+    uint8_t count = 0;
+    bool megamorphic = false;
+    InlineCacheEntry entries[INLINE_CACHE_ENTRIES];
+};
+
 struct Chunk {
-    std::vector<uint8_t> code;
-    std::vector<Value> constants;
-    std::vector<int> lines;
+    HeapVector<uint8_t> code;
+    HeapVector<Value> constants;
+    HeapVector<int> lines;
+    HeapVector<InlineCache> caches;
 };
 
+size_t instructionLength(const Chunk& chunk, size_t offset);
+
+enum RegisterOpCode {
+    R_MOVE,
+    R_GET_GLOBAL,
+    R_SET_GLOBAL,
+    R_DEFINE_GLOBAL,
+    R_GET_UPVALUE,
+    R_SET_UPVALUE,
+    R_GET_PROPERTY,
+    R_SET_PROPERTY,
+    R_EQUAL,
+    R_NOT_EQUAL,
+    R_GREATER,
+    R_GREATER_EQUAL,
+    R_LESS,
+    R_LESS_EQUAL,
+    R_ADD,
+    R_SUBTRACT,
+    R_MULTIPLY,
+    R_DIVIDE,
+    R_REMAIN,
+    R_NOT,
+    R_NEGATE,
+    R_PRINT,
+    R_PRINTL,
+    R_JUMP,
+    R_JUMP_IF_FALSE,
+    R_JUMP_IF_EQUAL,
+    R_JUMP_IF_NOT_EQUAL,
+    R_JUMP_IF_LESS,
+    R_JUMP_IF_NOT_LESS,
+    R_JUMP_IF_GREATER,
+    R_JUMP_IF_NOT_GREATER,
+    R_CALL,
+    R_TAIL_CALL,
+    R_INVOKE,
+    R_CLOSURE,
+    R_CAPTURE,
+    R_CLOSE_UPVALUE,
+    R_RETURN,
+    R_CLASS,
+    R_METHOD,
+    R_ARRAY,
+    R_MAP,
+    R_KEY,
+};
+
+// Operands name frame slots; an operand with REGISTER_CONSTANT set names a
+// chunk constant instead.
+const uint16_t REGISTER_CONSTANT = 0x8000;
+
+struct RegisterInstruction {
+    uint8_t op;
+    uint8_t n;
+    uint16_t a;
+    uint16_t b;
+    uint16_t c;
+    uint16_t d;
+};
+
+// Back-edge count and compiled trace of the loop starting at an offset.
+struct LoopTrace {
+    int hotness = 0;
+    int aborts = 0;
+    uint8_t* code = nullptr;
+    Value* globals = nullptr;
+};
+
+enum class AotStatus;
+// The C++ translation of a function in a program built with --emit-cpp.
+typedef AotStatus (*AotBody)(VM* vm, CallFrame* frame);
+
 struct Function {
     Object object;
     std::string name;
     int arity;
     int upvalueCount;
     Chunk chunk;
+
+    bool registersCompiled = false;
+    int registerCount = 0;
+    HeapVector<RegisterInstruction> registerCode;
+    HeapVector<int> registerLines;
+
+    int hotness = 0;
+    bool jitCompiled = false;
+    Value* jitGlobals = nullptr;
+    std::vector<uint8_t*> jitEntries;
+    std::vector<LoopTrace> loops;
+
+    AotBody aotBody = nullptr;
 };
 
 typedef bool (VM::* NativeFn)(int argCount, Value* args);
@@ -162,13 +425,28 @@ struct Class {
 struct Instance {
     Object object;
     Class* klass;
-    Table fields;
+    Shape* shape;
+    HeapVector<Value> fields;
+    Table* dictionary = nullptr;
+
+    Instance() = default;
+
+    // Compaction moves instances to another cell.
+    Instance(Instance&& other) noexcept
+        : object(other.object), klass(other.klass), shape(other.shape), fields(std::move(other.fields)), dictionary(other.dictionary) {
+        other.dictionary = nullptr;
+    }
+
+    ~Instance() {
+        if (dictionary != nullptr) heapBufferFreed(sizeof(Table));
+        delete dictionary;
+    }
 };
 
 struct Closure {
     Object object;
     Function* function;
-    std::vector<Upvalue*> upvalues;
+    HeapVector<Upvalue*> upvalues;
 };
 
 struct BoundMethod {
@@ -177,4 +455,9 @@ struct BoundMethod {
     Closure* method;
 };
 
+struct Array {
+    Object object;
+    HeapVector<Value> values;
+};
+
 #endif
\ No newline at end of file
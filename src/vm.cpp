@@ -1,36 +1,176 @@
 #include <iostream>
 #include <time.h>
 #include <cmath>
+#include <cstdlib>
+#include <algorithm>
 #include "vm.h"
 #include "compiler.h"
+#include "jit.h"
+#include "aot.h"
+#include "profiler.h"
 
-VM global;
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
 
-CallFrame::CallFrame(Closure* closure1, int slots1) {
-    closure = closure1;
-    ip = closure->function->chunk.code.begin();
-    slots = slots1;
-}
+const bool profileOpcodes = false;
+const bool countInstructions = false;
+
+VM global;
 
 InterpretResult interpret(std::string& source) {
     return global.interpret(source);
 }
 
+InterpretResult interpretAot(std::string& source, const AotProgram& program) {
+    return global.interpret(source, &program);
+}
+
+bool emitCpp(std::string& source, std::ostream& out) {
+    return global.emitCpp(source, out);
+}
+
+void useRegisterTier(bool enabled) {
+    global.setRegisterTier(enabled);
+}
+
+void useJit(bool enabled) {
+    global.setJit(enabled);
+}
+
+void useGCPauseTarget(double ms) {
+    global.setGCPauseTarget(ms);
+}
+
+void useGCStats(bool enabled) {
+    global.setGCStats(enabled);
+}
+
+void useCacheStats(bool enabled) {
+    global.setCacheStats(enabled);
+}
+
+void useConcurrentGC(bool enabled) {
+    global.setConcurrentGC(enabled);
+}
+
+void useGCThreshold(size_t bytes) {
+    global.setGCThreshold(bytes);
+}
+
+void useGCGrowth(double factor) {
+    global.setGCGrowth(factor);
+}
+
+void useHeapMax(size_t bytes) {
+    global.setHeapMax(bytes);
+}
+
+void useGCCompact(double fraction) {
+    global.setGCCompact(fraction);
+}
+
+void useHeapSnapshot(const std::string& path) {
+    global.setHeapSnapshot(path);
+}
+
+void useAllocationProfile(size_t rate) {
+    global.setAllocationProfile(rate);
+}
+
+void useAllocationProfileJson(const std::string& path) {
+    global.setAllocationProfileJson(path);
+}
+
+// Parses a byte count such as 4096, 512K, 64M or 2G.
+static bool parseSize(const char* text, size_t& bytes) {
+    char* end;
+    double value = std::strtod(text, &end);
+    if (end == text || value < 0) return false;
+
+    switch (*end) {
+    case 'K': case 'k': value *= 1024; end++; break;
+    case 'M': case 'm': value *= 1024 * 1024; end++; break;
+    case 'G': case 'g': value *= 1024.0 * 1024 * 1024; end++; break;
+    }
+    if (*end != '\0') return false;
+
+    bytes = (size_t)value;
+    return true;
+}
+
+// Applies --gc-pause, --gc-threshold, --gc-growth, --heap-max or --gc-compact.
+bool useHeapOption(const std::string& name, const char* value) {
+    size_t bytes;
+    if (name == "gc-pause") {
+        char* end;
+        double ms = std::strtod(value, &end);
+        if (end == value || *end != '\0' || !std::isfinite(ms) || ms < 0) return false;
+        useGCPauseTarget(ms);
+    } else if (name == "gc-threshold") {
+        if (!parseSize(value, bytes) || bytes == 0) return false;
+        useGCThreshold(bytes);
+    } else if (name == "gc-growth") {
+        char* end;
+        double factor = std::strtod(value, &end);
+        if (end == value || *end != '\0' || factor <= 1) return false;
+        useGCGrowth(factor);
+    } else if (name == "heap-max") {
+        if (!parseSize(value, bytes)) return false;
+        useHeapMax(bytes);
+    } else if (name == "gc-compact") {
+        char* end;
+        double fraction = std::strtod(value, &end);
+        if (end == value || *end != '\0' || fraction < 0 || fraction > 1) return false;
+        useGCCompact(fraction);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Applies PPLUS_GC_THRESHOLD, PPLUS_GC_GROWTH, PPLUS_HEAP_MAX and
+// PPLUS_GC_COMPACT.
+bool useHeapEnvironment() {
+    const char* variables[][2] = {
+        {"PPLUS_GC_THRESHOLD", "gc-threshold"},
+        {"PPLUS_GC_GROWTH", "gc-growth"},
+        {"PPLUS_HEAP_MAX", "heap-max"},
+        {"PPLUS_GC_COMPACT", "gc-compact"},
+    };
+    for (auto& variable : variables) {
+        const char* value = std::getenv(variable[0]);
+        if (value != nullptr && !useHeapOption(variable[1], value)) {
+            std::cerr << "Invalid value for " << variable[0] << ": " << value << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
 VM::VM() {
-    garbageCollector.stack = &stack;
+    stackTop = stack;
+    garbageCollector.stack = stack;
+    garbageCollector.stackTop = &stackTop;
     garbageCollector.globals = &globals;
-    garbageCollector.frames = &frames;
+    garbageCollector.frames = frames;
+    garbageCollector.frameCount = &frameCount;
     garbageCollector.openUpvalues = &openUpvalues;
     garbageCollector.initString = &initString;
 
     std::string init = "init";
     initString = garbageCollector.newString(init);
+    garbageCollector.emptyShape = garbageCollector.newShape(nullptr, nullptr);
 
-    stack.reserve(256);
     defineNative("clock", clockNative);
     defineNative("readNumber", readNumberNative);
     defineNative("stringify", stringifyNative);
     defineNative("round", roundNative);
+    defineNative("length", lengthNative);
+    defineNative("append", appendNative);
+    defineNative("pop", popNative);
+    defineNative("gcStats", gcStatsNative);
+    defineNative("collect", collectNative);
 }
 
 bool VM::clockNative(int argCount, Value* args) {
@@ -84,56 +224,256 @@ bool VM::roundNative(int argCount, Value* args) {
     Value number = args[0];
     Value precision = args[1];
 
-    if (number.type != ValueType::number || precision.type != ValueType::number) {
+    if (!number.isNumber() || !precision.isNumber()) {
         runtimeError("Arguments should be numbers.");
         return false;
     }
 
-    double result = std::round(number.as.number / precision.as.number) * precision.as.number;
+    double result = std::round(number.getNumber() / precision.getNumber()) * precision.getNumber();
     push(Value(result));
     return true;
 }
 
+bool VM::lengthNative(int argCount, Value* args) {
+    if (argCount != 1) {
+        runtimeError("Expected 1 arguments but got " + std::to_string(argCount) + ".");
+        return false;
+    }
+
+    if (args[0].isObjectType(ObjectType::Array)) {
+        push(Value((double)args[0].getArray()->values.size()));
+    } else if (args[0].isObjectType(ObjectType::String)) {
+        push(Value((double)args[0].getString()->chars.size()));
+    } else {
+        runtimeError("Argument should be an array or a string.");
+        return false;
+    }
+    return true;
+}
+
+bool VM::appendNative(int argCount, Value* args) {
+    if (argCount != 2) {
+        runtimeError("Expected 2 arguments but got " + std::to_string(argCount) + ".");
+        return false;
+    }
+
+    if (!args[0].isObjectType(ObjectType::Array)) {
+        runtimeError("First argument should be an array.");
+        return false;
+    }
+
+    garbageCollector.beforeWrite(args[0].getObject());
+    args[0].getArray()->values.push_back(args[1]);
+    garbageCollector.writeBarrier(args[0].getObject(), args[1]);
+    push(Value());
+    return true;
+}
+
+bool VM::popNative(int argCount, Value* args) {
+    if (argCount != 1) {
+        runtimeError("Expected 1 arguments but got " + std::to_string(argCount) + ".");
+        return false;
+    }
+
+    if (!args[0].isObjectType(ObjectType::Array)) {
+        runtimeError("Argument should be an array.");
+        return false;
+    }
+
+    Array* array = args[0].getArray();
+    if (array->values.empty()) {
+        runtimeError("Can't pop from an empty array.");
+        return false;
+    }
+
+    Value value = array->values.back();
+    garbageCollector.beforeWrite(&array->object);
+    array->values.pop_back();
+    push(value);
+    return true;
+}
+
+// Returns a map with the collector's statistics, the same --gc-stats prints.
+bool VM::gcStatsNative(int argCount, Value* /* args */) {
+    if (argCount > 0) {
+        runtimeError("Expected 0 arguments but got " + std::to_string(argCount) + ".");
+        return false;
+    }
+
+    TypeCensus types[OBJECT_TYPES];
+    {
+        HeapGraph graph;
+        garbageCollector.walkHeap(graph);
+        graph.census(types);
+    }
+
+    push(Value(garbageCollector.newInstance(nullptr)));
+    push(Value((double)GC::bytesAllocated));
+    setMapField("heapSize");
+    push(Value((double)garbageCollector.nextGC));
+    setMapField("nextMajor");
+
+    const char* triggers[GC_TRIGGERS] = { "nursery", "threshold", "heapMax", "collect" };
+    push(Value(garbageCollector.newInstance(nullptr)));
+    for (size_t i = 0; i < GC_TRIGGERS; i++) {
+        push(Value((double)garbageCollector.collections[i]));
+        setMapField(triggers[i]);
+    }
+    setMapField("collections");
+
+    push(Value(garbageCollector.newInstance(nullptr)));
+    push(Value((double)garbageCollector.youngBytesReclaimed));
+    setMapField("nursery");
+    push(Value((double)garbageCollector.oldBytesReclaimed));
+    setMapField("old");
+    setMapField("reclaimed");
+
+    struct {
+        const char* name;
+        PauseStats* stats;
+    } kinds[] = {
+        {"minor", &garbageCollector.minorPauses},
+        {"mark", &garbageCollector.markPauses},
+        {"remark", &garbageCollector.remarkPauses},
+        {"sweep", &garbageCollector.sweepPauses},
+        {"full", &garbageCollector.fullPauses},
+        {"compact", &garbageCollector.compactPauses},
+    };
+    push(Value(garbageCollector.newInstance(nullptr)));
+    for (auto& kind : kinds) {
+        push(Value(garbageCollector.newInstance(nullptr)));
+        push(Value((double)kind.stats->count));
+        setMapField("count");
+        push(Value(kind.stats->total));
+        setMapField("total");
+        push(Value(kind.stats->max));
+        setMapField("max");
+        Array* histogram = garbageCollector.newArray();
+        push(Value(histogram));
+        for (size_t count : kind.stats->buckets) {
+            histogram->values.push_back(Value((double)count));
+        }
+        setMapField("histogram");
+        setMapField(kind.name);
+    }
+    setMapField("pauses");
+
+    Array* limits = garbageCollector.newArray();
+    limits->values.assign(PAUSE_BUCKET_LIMITS, PAUSE_BUCKET_LIMITS + PAUSE_BUCKETS - 1);
+    push(Value(limits));
+    setMapField("pauseLimits");
+
+    push(Value(garbageCollector.newInstance(nullptr)));
+    for (size_t i = 0; i < OBJECT_TYPES; i++) {
+        push(Value(garbageCollector.newInstance(nullptr)));
+        push(Value((double)types[i].count));
+        setMapField("count");
+        push(Value((double)types[i].bytes));
+        setMapField("bytes");
+        setMapField(stringifyObjectType((ObjectType)i));
+    }
+    setMapField("live");
+    return true;
+}
+
+// Runs a full collection and returns the number of bytes it freed.
+bool VM::collectNative(int argCount, Value* /* args */) {
+    if (argCount > 0) {
+        runtimeError("Expected 0 arguments but got " + std::to_string(argCount) + ".");
+        return false;
+    }
+
+    size_t before = GC::bytesAllocated;
+    garbageCollector.count(GCTrigger::collectCall);
+    garbageCollector.collectAll();
+    // Clamped at 0 in case the heap has grown in the meantime.
+    size_t after = GC::bytesAllocated;
+    push(Value(before > after ? (double)(before - after) : 0.0));
+    return true;
+}
+
+// Pops a value and stores it under key in the map below it.
+void VM::setMapField(const std::string& key) {
+    String* name = garbageCollector.newString(key);
+    setField(peek(1).getInstance(), name, peek(0));
+    pop();
+}
+
 void VM::runtimeError(const std::string& message) {
     std::cerr << message << std::endl;
+    // Unwinding the stack frees whatever filled the heap.
+    garbageCollector.outOfMemory = false;
+
+    if (recorder != nullptr) {
+        abortTrace(recorder);
+        recorder = nullptr;
+    }
 
-    for (int i = frames.size() - 1; i >= 0; i--) {
+    for (int i = frameCount - 1; i >= 0; i--) {
         CallFrame* frame = &frames[i];
         Function& function = *frame->closure->function;
 
-        size_t instruction = frame->ip - function.chunk.code.begin() - 1;
-        std::cerr << "[line " << function.chunk.lines[instruction] << "] in ";
+        int line;
+        if (frame->pc != nullptr) {
+            line = function.registerLines[frame->pc - function.registerCode.data() - 1];
+        } else {
+            line = function.chunk.lines[frame->ip - function.chunk.code.data() - 1];
+        }
+        std::cerr << "[line " << line << "] in ";
         if (function.name == "") {
             std::cerr << "script" << std::endl;
         } else {
             std::cerr << function.name << "()" << std::endl;
         }
-        frames.pop_back();
     }
 
-    stack.clear();
+    resetStack();
+}
+
+void VM::countOpcode(uint8_t opcode) {
+    if (opcodePairs.empty()) opcodePairs.resize(256 * 256);
+    opcodePairs[previousOpcode * 256 + opcode]++;
+    previousOpcode = opcode;
+}
+
+void VM::printOpcodePairs() {
+    std::vector<std::pair<size_t, int>> pairs;
+    for (size_t i = 0; i < opcodePairs.size(); i++) {
+        if (opcodePairs[i] > 0) pairs.push_back({ opcodePairs[i], (int)i });
+    }
+    std::sort(pairs.begin(), pairs.end(), std::greater<std::pair<size_t, int>>());
+
+    std::cout << "-- opcode pairs" << std::endl;
+    for (size_t i = 0; i < pairs.size() && i < 40; i++) {
+        std::cout << "   " << stringifyOpCode((OpCode)(pairs[i].second / 256)) << " " << stringifyOpCode((OpCode)(pairs[i].second % 256)) << " " << pairs[i].first << std::endl;
+    }
+}
+
+void VM::resetStack() {
+    stackTop = stack;
+    frameCount = 0;
+    openUpvalues = nullptr;
 }
 
 void VM::defineNative(std::string name, NativeFn function) {
-    Native* native = garbageCollector.newNative(function);
-    push(Value(native));
+    push(Value(garbageCollector.newString(name)));
+    push(Value(garbageCollector.newNative(function)));
 
-    globals.insert({ name, stack[0] });
+    globals.values[globals.resolve(peek(1).getString())] = peek(0);
+    pop();
     pop();
 }
 
 void VM::push(Value value) {
-    stack.push_back(value);
+    *stackTop++ = value;
 }
 
 Value VM::pop() {
-    Value x = stack[stack.size() - 1];
-    stack.pop_back();
-    return x;
+    return *--stackTop;
 }
 
 Value VM::peek(int distance) {
-    return stack[stack.size() - 1 - distance];
+    return stackTop[-1 - distance];
 }
 
 bool VM::call(Closure* closure, int argCount) {
@@ -142,24 +482,44 @@ bool VM::call(Closure* closure, int argCount) {
         return false;
     }
 
-    frames.push_back(CallFrame(closure, stack.size() - argCount - 1));
+    if (frameCount == FRAMES_MAX || stackTop + FRAME_SLOTS > stack + STACK_MAX) {
+        runtimeError("Stack overflow.");
+        return false;
+    }
+
+    if (garbageCollector.outOfMemory) {
+        runtimeError("Out of memory.");
+        return false;
+    }
+
+    CallFrame* frame = &frames[frameCount++];
+    frame->closure = closure;
+    frame->ip = closure->function->chunk.code.data();
+    frame->slots = stackTop - argCount - 1;
+    frame->pc = nullptr;
+    warmUp(closure->function);
     return true;
 }
 
 bool VM::callValue(Value callee, int argCount) {
-    if (callee.type != ValueType::object) {
+    if (!callee.isObject()) {
         runtimeError("Can only call functions and classes.");
         return false;
     }
 
-    switch (callee.as.object->type) {
+    if (garbageCollector.outOfMemory) {
+        runtimeError("Out of memory.");
+        return false;
+    }
+
+    switch (callee.getObject()->type) {
     case ObjectType::Native: {
         NativeFn native = callee.getNative()->function;
-        if (!(this->*native)(argCount, &stack[stack.size() - argCount])) {
+        if (!(this->*native)(argCount, stackTop - argCount)) {
             return false;
         }
         Value result = pop();
-        stack.resize(stack.size() - argCount - 1);
+        stackTop -= argCount + 1;
         push(result);
         return true;
     }
@@ -167,8 +527,8 @@ bool VM::callValue(Value callee, int argCount) {
         return call(callee.getClosure(), argCount);
     case ObjectType::Class: {
         Class* klass = callee.getClass();
-        stack[stack.size() - argCount - 1] = Value(garbageCollector.newInstance(klass));
-        auto x = initString == nullptr ? klass->methods.end() : klass->methods.find(initString->chars);
+        stackTop[-argCount - 1] = Value(garbageCollector.newInstance(klass));
+        auto x = initString == nullptr ? klass->methods.end() : klass->methods.find(initString);
         if (x != klass->methods.end()) {
             return call(x->second.getClosure(), argCount);
         } else if (argCount != 0) {
@@ -179,7 +539,7 @@ bool VM::callValue(Value callee, int argCount) {
     }
     case ObjectType::BoundMethod: {
         BoundMethod* bound = callee.getBoundMethod();
-        stack[stack.size() - argCount - 1] = bound->receiver;
+        stackTop[-argCount - 1] = bound->receiver;
         return call(bound->method, argCount);
     }
     }
@@ -187,47 +547,133 @@ bool VM::callValue(Value callee, int argCount) {
     return false;
 }
 
-bool VM::invokeFromClass(Class* klass, std::string name, int argCount) {
+bool VM::invokeFromClass(Class* klass, String* name, int argCount) {
     Value method;
     if (klass == nullptr) {
-        runtimeError("Undefined property '" + name + "'.");
+        runtimeError("Undefined property '" + name->chars + "'.");
         return false;
     }
 
     auto x = klass->methods.find(name);
     if (x == klass->methods.end()) {
-        runtimeError("Undefined property '" + name + "'.");
+        runtimeError("Undefined property '" + name->chars + "'.");
         return false;
     }
     return call(x->second.getClosure(), argCount);
 }
 
-bool VM::invoke(Value receiver, std::string name, int argCount) {
-    if (receiver.type != ValueType::object || receiver.as.object->type != ObjectType::Instance) {
+bool VM::invoke(Value receiver, String* name, int argCount) {
+    if (!receiver.isObjectType(ObjectType::Instance)) {
         runtimeError("Only instances have methods.");
         return false;
     }
 
     Instance* instance = receiver.getInstance();
 
-    auto x = instance->fields.find(name);
-    if (x != instance->fields.end()) {
-        stack[stack.size() - argCount - 1] = x->second;
-        return callValue(x->second, argCount);
+    Value value;
+    if (getField(instance, name, value)) {
+        stackTop[-argCount - 1] = value;
+        return callValue(value, argCount);
     }
 
     return invokeFromClass(instance->klass, name, argCount);
 }
 
-bool VM::bindMethod(Class* klass, std::string name) {
+void VM::updateCache(InlineCache* cache, const InlineCacheEntry& entry) {
+    if (cache->megamorphic) return;
+
+    // Caches belong to the running function's chunk.
+    Object* function = &frames[frameCount - 1].closure->function->object;
+    garbageCollector.beforeWrite(function);
+
+    if (cache->count == INLINE_CACHE_ENTRIES) {
+        cache->megamorphic = true;
+        cache->count = 0;
+        return;
+    }
+
+    cache->entries[cache->count++] = entry;
+    garbageCollector.writeBarrier(function, (Object*)entry.klass);
+    garbageCollector.writeBarrier(function, (Object*)entry.method);
+}
+
+void VM::cacheLookup(InlineCache* cache, Instance* instance, String* name) {
+    if (instance->shape == nullptr) return;
+
+    auto slot = instance->shape->slots.find(name);
+    if (slot != instance->shape->slots.end()) {
+        updateCache(cache, { instance->shape, instance->klass, nullptr, nullptr, slot->second });
+        return;
+    }
+
+    if (instance->klass == nullptr) return;
+
+    auto method = instance->klass->methods.find(name);
+    if (method == instance->klass->methods.end()) return;
+    updateCache(cache, { instance->shape, instance->klass, nullptr, method->second.getClosure(), 0 });
+}
+
+bool VM::getField(Instance* instance, String* name, Value& value) {
+    if (instance->dictionary != nullptr) {
+        auto x = instance->dictionary->find(name);
+        if (x == instance->dictionary->end()) return false;
+        value = x->second;
+        return true;
+    }
+
+    auto slot = instance->shape->slots.find(name);
+    if (slot == instance->shape->slots.end()) return false;
+    value = instance->fields[slot->second];
+    return true;
+}
+
+void VM::setField(Instance* instance, String* name, Value value) {
+    garbageCollector.beforeWrite(&instance->object);
+    garbageCollector.writeBarrier(&instance->object, value);
+    garbageCollector.writeBarrier(&instance->object, (Object*)name);
+    if (instance->dictionary != nullptr) {
+        (*instance->dictionary)[name] = value;
+        return;
+    }
+
+    auto slot = instance->shape->slots.find(name);
+    if (slot != instance->shape->slots.end()) {
+        instance->fields[slot->second] = value;
+        return;
+    }
+
+    Shape* shape = garbageCollector.transition(instance->shape, name);
+    if (shape == nullptr) {
+        makeDictionary(instance);
+        (*instance->dictionary)[name] = value;
+        return;
+    }
+
+    instance->shape = shape;
+    instance->fields.push_back(value);
+}
+
+void VM::makeDictionary(Instance* instance) {
+    garbageCollector.beforeWrite(&instance->object);
+    instance->dictionary = new Table();
+    heapBufferAllocated(sizeof(Table));
+    for (auto& slot : instance->shape->slots) {
+        instance->dictionary->insert({ slot.first, instance->fields[slot.second] });
+    }
+    instance->shape = nullptr;
+    instance->fields.clear();
+    instance->fields.shrink_to_fit();
+}
+
+bool VM::bindMethod(Class* klass, String* name) {
     if (klass == nullptr) {
-        runtimeError("Undefined property '" + name + "'.");
+        runtimeError("Undefined property '" + name->chars + "'.");
         return false;
     }
 
     auto x = klass->methods.find(name);
     if (x == klass->methods.end()) {
-        runtimeError("Undefined property '" + name + "'.");
+        runtimeError("Undefined property '" + name->chars + "'.");
         return false;
     }
 
@@ -237,6 +683,56 @@ bool VM::bindMethod(Class* klass, std::string name) {
     return true;
 }
 
+// Resolves a key to an index into the array: a number or a string of decimal
+// digits such as "0". A store may also use the index one past the end, which
+// appends to the array.
+bool VM::arrayIndex(Array* array, Value key, size_t& index, bool store) {
+    size_t size = array->values.size();
+
+    if (key.isNumber()) {
+        double number = key.getNumber();
+        if (!std::isfinite(number) || number != std::floor(number)) {
+            runtimeError("Array index must be an integer.");
+            return false;
+        }
+        if (number < 0 || (store ? number > size : number >= size)) {
+            runtimeError("Array index out of range.");
+            return false;
+        }
+        index = (size_t)number;
+        return true;
+    }
+
+    if (!key.isObjectType(ObjectType::String)) {
+        runtimeError("A key must be a number or a string.");
+        return false;
+    }
+
+    // Elements used to be fields named by std::to_string(i), so "01" or " 1"
+    // name no element.
+    const std::string& chars = key.getString()->chars;
+    bool digits = !chars.empty() && (chars[0] != '0' || chars.size() == 1);
+    for (char c : chars) {
+        digits = digits && c >= '0' && c <= '9';
+    }
+    if (!digits) {
+        runtimeError(store ? "Only instances have fields." : "Undefined property '" + chars + "'.");
+        return false;
+    }
+
+    size_t number = 0;
+    for (char c : chars) {
+        number = number * 10 + (c - '0');
+        if (number > size) break;
+    }
+    if (store ? number > size : number >= size) {
+        runtimeError("Array index out of range.");
+        return false;
+    }
+    index = number;
+    return true;
+}
+
 Upvalue* VM::captureUpvalue(Value* local) {
     Upvalue* prevUpvalue = nullptr;
     Upvalue* upvalue = openUpvalues;
@@ -263,8 +759,10 @@ Upvalue* VM::captureUpvalue(Value* local) {
 void VM::closeUpvalues(Value* last) {
     while (openUpvalues != nullptr && openUpvalues->location >= last) {
         Upvalue* upvalue = openUpvalues;
+        garbageCollector.beforeWrite(&upvalue->object);
         upvalue->closed = *upvalue->location;
         upvalue->location = &upvalue->closed;
+        garbageCollector.writeBarrier(&upvalue->object, upvalue->closed);
         openUpvalues = upvalue->next;
     }
 }
@@ -272,469 +770,1850 @@ void VM::closeUpvalues(Value* last) {
 void VM::defineMethod(String* name) {
     Value method = peek(0);
     Class* klass = peek(1).getClass();
-    Table::iterator value = klass->methods.find(name->chars);
-
-    if (value != klass->methods.end()) {
-        value->second = method;
-    } else {
-        klass->methods.insert({ name->chars, method });
-    }
+    garbageCollector.beforeWrite(&klass->object);
+    klass->methods[name] = method;
+    garbageCollector.writeBarrier(&klass->object, method);
+    garbageCollector.writeBarrier(&klass->object, (Object*)name);
 
     pop();
 }
 
-uint8_t VM::readByte() {
-    CallFrame& frame = frames.back();
-    frame.ip++;
-    return frame.ip[-1];
-}
-
-uint16_t VM::readShort() {
-    CallFrame& frame = frames.back();
-    frame.ip += 2;
-    return (uint16_t)((frame.ip[-2] << 8) | frame.ip[-1]);
-}
-
-Value VM::readConstant() {
-    CallFrame& frame = frames.back();
-    return frame.closure->function->chunk.constants[readByte()];
-}
-
 bool valuesEqual(Value a, Value b) {
-    if (a.type != b.type) return false;
-    switch (a.type) {
-    case ValueType::boolean: return a.as.boolean == b.as.boolean;
-    case ValueType::nil: return true;
-    case ValueType::number: return a.as.number == b.as.number;
-    case ValueType::object: {
-        switch (a.as.object->type) {
-        case ObjectType::String: return a.getString()->chars == b.getString()->chars;
+    if (a.isNumber() && b.isNumber()) return a.getNumber() == b.getNumber();
+    if (a.isObject() && b.isObject()) {
+        if (a.getObject()->type != b.getObject()->type) return false;
+        switch (a.getObject()->type) {
+        case ObjectType::String: return a.getString() == b.getString();
         case ObjectType::Function: return a.getFunction()->name == b.getFunction()->name;
         default: return false;
         }
     }
-    default: return false;
-    }
+    if (a.isBoolean() && b.isBoolean()) return a.getBoolean() == b.getBoolean();
+    return a.isNil() && b.isNil();
 }
 
 bool isFalsey(Value value) {
-    return value.type == ValueType::nil || (value.type == ValueType::boolean && !value.as.boolean);
+    return value.isNil() || (value.isBoolean() && !value.getBoolean());
 }
 
-InterpretResult VM::run() {
-    CallFrame* frame = &frames[frames.size() - 1];
+InterpretResult VM::run(int baseFrame) {
+    CallFrame* frame;
+    uint8_t* ip;
+    Value* constants;
+    Value* slots;
+    Value* sp;
+
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_CACHE() (&frame->closure->function->chunk.caches[READ_SHORT()])
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+#define PEEK(distance) (sp[-1 - (distance)])
+#define STORE_FRAME() \
+    frame->ip = ip; \
+    stackTop = sp
+#define LOAD_FRAME() \
+    frame = &frames[frameCount - 1]; \
+    ip = frame->ip; \
+    constants = frame->closure->function->chunk.constants.data(); \
+    slots = frame->slots; \
+    sp = stackTop
+#define RUNTIME_ERROR(message) \
+    STORE_FRAME(); \
+    runtimeError(message); \
+    return InterpretResult::runtimeError
+#define ENTER_JIT() \
+    if (jitEnabled) { \
+        if (!runJit()) return InterpretResult::runtimeError; \
+        if (frameCount == baseFrame) return InterpretResult::ok; \
+    }
 
+#ifdef COMPUTED_GOTO
+    static void* dispatchTable[] = {
+        [OP_CONSTANT] = &&label_OP_CONSTANT,
+        [OP_NIL] = &&label_OP_NIL,
+        [OP_TRUE] = &&label_OP_TRUE,
+        [OP_FALSE] = &&label_OP_FALSE,
+        [OP_POP] = &&label_OP_POP,
+        [OP_GET_LOCAL] = &&label_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&label_OP_SET_LOCAL,
+        [OP_GET_GLOBAL] = &&label_OP_GET_GLOBAL,
+        [OP_DEFINE_GLOBAL] = &&label_OP_DEFINE_GLOBAL,
+        [OP_SET_GLOBAL] = &&label_OP_SET_GLOBAL,
+        [OP_GET_UPVALUE] = &&label_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE] = &&label_OP_SET_UPVALUE,
+        [OP_GET_PROPERTY] = &&label_OP_GET_PROPERTY,
+        [OP_SET_PROPERTY] = &&label_OP_SET_PROPERTY,
+        [OP_GET_PROPERTY_BY_KEY] = &&label_OP_GET_PROPERTY_BY_KEY,
+        [OP_SET_PROPERTY_BY_KEY] = &&label_OP_SET_PROPERTY_BY_KEY,
+        [OP_EQUAL] = &&label_OP_EQUAL,
+        [OP_GREATER] = &&label_OP_GREATER,
+        [OP_LESS] = &&label_OP_LESS,
+        [OP_ADD] = &&label_OP_ADD,
+        [OP_SUBTRACT] = &&label_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&label_OP_MULTIPLY,
+        [OP_DIVIDE] = &&label_OP_DIVIDE,
+        [OP_REMAIN] = &&label_OP_REMAIN,
+        [OP_NOT] = &&label_OP_NOT,
+        [OP_NEGATE] = &&label_OP_NEGATE,
+        [OP_PRINT] = &&label_OP_PRINT,
+        [OP_PRINTL] = &&label_OP_PRINTL,
+        [OP_JUMP] = &&label_OP_JUMP,
+        [OP_JUMP_IF_FALSE] = &&label_OP_JUMP_IF_FALSE,
+        [OP_LOOP] = &&label_OP_LOOP,
+        [OP_CALL] = &&label_OP_CALL,
+        [OP_INVOKE] = &&label_OP_INVOKE,
+        [OP_INVOKE_BY_KEY] = &&label_OP_INVOKE_BY_KEY,
+        [OP_CLOSURE] = &&label_OP_CLOSURE,
+        [OP_CLOSE_UPVALUE] = &&label_OP_CLOSE_UPVALUE,
+        [OP_RETURN] = &&label_OP_RETURN,
+        [OP_CLASS] = &&label_OP_CLASS,
+        [OP_METHOD] = &&label_OP_METHOD,
+        [OP_ARRAY] = &&label_OP_ARRAY,
+        [OP_MAP] = &&label_OP_MAP,
+        [OP_KEY] = &&label_OP_KEY,
+        [OP_EQUAL_NUM] = &&label_OP_EQUAL_NUM,
+        [OP_ADD_NUM] = &&label_OP_ADD_NUM,
+        [OP_ADD_STR] = &&label_OP_ADD_STR,
+        [OP_NOT_EQUAL] = &&label_OP_NOT_EQUAL,
+        [OP_GREATER_EQUAL] = &&label_OP_GREATER_EQUAL,
+        [OP_LESS_EQUAL] = &&label_OP_LESS_EQUAL,
+        [OP_POP_JUMP_IF_FALSE] = &&label_OP_POP_JUMP_IF_FALSE,
+        [OP_JUMP_IF_EQUAL] = &&label_OP_JUMP_IF_EQUAL,
+        [OP_JUMP_IF_NOT_EQUAL] = &&label_OP_JUMP_IF_NOT_EQUAL,
+        [OP_JUMP_IF_LESS] = &&label_OP_JUMP_IF_LESS,
+        [OP_JUMP_IF_NOT_LESS] = &&label_OP_JUMP_IF_NOT_LESS,
+        [OP_JUMP_IF_GREATER] = &&label_OP_JUMP_IF_GREATER,
+        [OP_JUMP_IF_NOT_GREATER] = &&label_OP_JUMP_IF_NOT_GREATER,
+        [OP_ADD_LOCAL_CONSTANT] = &&label_OP_ADD_LOCAL_CONSTANT,
+        [OP_SUBTRACT_LOCAL_CONSTANT] = &&label_OP_SUBTRACT_LOCAL_CONSTANT,
+        [OP_SET_LOCAL_POP] = &&label_OP_SET_LOCAL_POP,
+        [OP_SET_GLOBAL_POP] = &&label_OP_SET_GLOBAL_POP,
+        [OP_TAIL_CALL] = &&label_OP_TAIL_CALL,
+    };
+
+    // While a trace is being recorded every opcode goes through record_instruction.
+    static void* recordTable[sizeof(dispatchTable) / sizeof(dispatchTable[0])];
+    if (recordTable[0] == nullptr) {
+        std::fill_n(recordTable, sizeof(dispatchTable) / sizeof(dispatchTable[0]), &&record_instruction);
+    }
+    void** dispatch = recorder != nullptr ? recordTable : dispatchTable;
+
+#define CASE(code) label_##code
+#define DISPATCH() \
+    do { \
+        if (countInstructions) instructionCount++; \
+        if (profileOpcodes) countOpcode(*ip); \
+        goto *dispatch[READ_BYTE()]; \
+    } while (false)
+#else
+#define CASE(code) case code
+#define DISPATCH() continue
+#endif
+
+    LOAD_FRAME();
+
+#ifdef COMPUTED_GOTO
+    DISPATCH();
+    {
+#else
     for (;;) {
-        uint8_t instruction = readByte();
-        //std::cout << stringifyOpCode(OpCode(instruction)) << std::endl;
-        switch (instruction) {
-        case OP_CALL: {
-            int argCount = readByte();
-            if (!callValue(peek(argCount), argCount)) {
+        if (countInstructions) instructionCount++;
+        if (profileOpcodes) countOpcode(*ip);
+        if (recorder != nullptr && !recordTrace(recorder, frame, ip, sp)) recorder = nullptr;
+        switch (READ_BYTE()) {
+#endif
+        CASE(OP_CALL): {
+            int argCount = READ_BYTE();
+            STORE_FRAME();
+            if (!callValue(PEEK(argCount), argCount)) {
                 return InterpretResult::runtimeError;
             }
 
-            frame = &frames[frames.size() - 1];
-            break;
+            ENTER_JIT();
+            LOAD_FRAME();
+            DISPATCH();
         }
-        case OP_INVOKE: {
-            String* method = readConstant().getString();
-            int argCount = readByte();
-            Value receiver = peek(argCount);
-            if (!invoke(receiver, method->chars, argCount)) {
+        CASE(OP_TAIL_CALL): {
+            int argCount = READ_BYTE();
+            Value callee = PEEK(argCount);
+
+            // Anything but a closure is called normally; the OP_RETURN that
+            // follows returns its result.
+            if (callee.isObjectType(ObjectType::Closure) && callee.getClosure()->function->arity == argCount) {
+                if (garbageCollector.outOfMemory) {
+                    RUNTIME_ERROR("Out of memory.");
+                }
+                closeUpvalues(slots);
+                std::copy(sp - argCount - 1, sp, slots);
+                sp = slots + argCount + 1;
+
+                frame->closure = callee.getClosure();
+                frame->ip = frame->closure->function->chunk.code.data();
+                stackTop = sp;
+                warmUp(frame->closure->function);
+                ENTER_JIT();
+                LOAD_FRAME();
+                DISPATCH();
+            }
+
+            STORE_FRAME();
+            if (!callValue(callee, argCount)) {
                 return InterpretResult::runtimeError;
             }
-            frame = &frames[frames.size() - 1];
-            break;
+
+            ENTER_JIT();
+            LOAD_FRAME();
+            DISPATCH();
         }
-        case OP_INVOKE_BY_KEY: {
-            int argCount = readByte();
-            Value method = peek(argCount);
-            std::string name;
+        CASE(OP_INVOKE): {
+            String* method = READ_CONSTANT().getString();
+            int argCount = READ_BYTE();
+            InlineCache* cache = READ_CACHE();
+            Value receiver = PEEK(argCount);
+            STORE_FRAME();
+
+            if (receiver.isObjectType(ObjectType::Instance)) {
+                Instance* instance = receiver.getInstance();
+                InlineCacheEntry* hit = nullptr;
+                for (int i = 0; i < cache->count; i++) {
+                    InlineCacheEntry& entry = cache->entries[i];
+                    if (entry.shape == instance->shape && entry.klass == instance->klass) {
+                        hit = &entry;
+                        break;
+                    }
+                }
 
-            if (method.type == ValueType::number) {
-                name = method.stringify();
-            } else if (method.type == ValueType::object && method.as.object->type == ObjectType::String) {
-                name = method.stringify();
-            } else {
-                runtimeError("A key must be a number or a string.");
-                return InterpretResult::runtimeError;
+                if (hit != nullptr) {
+                    if (cacheStats) cacheHits++;
+                    bool called;
+                    if (hit->method != nullptr) {
+                        called = call(hit->method, argCount);
+                    } else {
+                        Value value = instance->fields[hit->slot];
+                        PEEK(argCount) = value;
+                        called = callValue(value, argCount);
+                    }
+                    if (!called) {
+                        return InterpretResult::runtimeError;
+                    }
+                    ENTER_JIT();
+                    LOAD_FRAME();
+                    DISPATCH();
+                }
+                if (cacheStats) cacheMisses++;
+                cacheLookup(cache, instance, method);
             }
 
-            Value receiver = peek(argCount + 1);
-            if (!invoke(receiver, name, argCount)) {
+            if (!invoke(receiver, method, argCount)) {
                 return InterpretResult::runtimeError;
             }
+            ENTER_JIT();
+            LOAD_FRAME();
+            DISPATCH();
+        }
+        CASE(OP_INVOKE_BY_KEY): {
+            int argCount = READ_BYTE();
+            Value receiver = PEEK(argCount + 1);
+            Value key = PEEK(argCount);
+
+            if (receiver.isObjectType(ObjectType::Array)) {
+                size_t index;
+                STORE_FRAME();
+                if (!arrayIndex(receiver.getArray(), key, index)) {
+                    return InterpretResult::runtimeError;
+                }
 
-            Value value = pop();
-            pop();
-            push(value);
+                Value element = receiver.getArray()->values[index];
+                std::copy(sp - argCount, sp, sp - argCount - 1);
+                sp--;
+                PEEK(argCount) = element;
+                STORE_FRAME();
+                if (!callValue(element, argCount)) {
+                    return InterpretResult::runtimeError;
+                }
+                ENTER_JIT();
+                LOAD_FRAME();
+                DISPATCH();
+            }
 
-            frame = &frames[frames.size() - 1];
-            break;
+            String* name;
+            if (key.isNumber()) {
+                STORE_FRAME();
+                name = garbageCollector.newString(key.stringify());
+            } else if (key.isObjectType(ObjectType::String)) {
+                name = key.getString();
+            } else {
+                RUNTIME_ERROR("A key must be a number or a string.");
+            }
+
+            std::copy(sp - argCount, sp, sp - argCount - 1);
+            sp--;
+            STORE_FRAME();
+            if (!invoke(receiver, name, argCount)) {
+                return InterpretResult::runtimeError;
+            }
+            ENTER_JIT();
+            LOAD_FRAME();
+            DISPATCH();
         }
-        case OP_CLOSURE: {
-            Function* function = readConstant().getFunction();
+        CASE(OP_CLOSURE): {
+            Function* function = READ_CONSTANT().getFunction();
+            STORE_FRAME();
             Closure* closure = garbageCollector.newClosure(function);
-            push(Value(closure));
+            PUSH(Value(closure));
+            stackTop = sp;
             for (int i = 0; i < function->upvalueCount; i++) {
-                uint8_t isLocal = readByte();
-                uint8_t index = readByte();
-                if (isLocal) {
-                    closure->upvalues.push_back(captureUpvalue(&stack[frame->slots + index]));
-                } else {
-                    closure->upvalues.push_back(frame->closure->upvalues[index]);
-                }
+                uint8_t isLocal = READ_BYTE();
+                uint8_t index = READ_BYTE();
+                Upvalue* upvalue = isLocal ? captureUpvalue(&slots[index]) : frame->closure->upvalues[index];
+                garbageCollector.beforeWrite(&closure->object);
+                closure->upvalues.push_back(upvalue);
+                garbageCollector.writeBarrier(&closure->object, (Object*)upvalue);
             }
-            break;
+            DISPATCH();
         }
-        case OP_CLOSE_UPVALUE:
-            closeUpvalues(&stack[stack.size() - 1]);
-            pop();
-            break;
-        case OP_RETURN: {
-            Value result = pop();
-            int slots = frame->slots;
-            closeUpvalues(&stack[slots]);
-
-            frames.pop_back();
-            if (frames.size() == 0) {
-                pop();
+        CASE(OP_CLOSE_UPVALUE):
+            closeUpvalues(sp - 1);
+            sp--;
+            DISPATCH();
+        CASE(OP_RETURN): {
+            Value result = POP();
+            closeUpvalues(slots);
+
+            frameCount--;
+            if (frameCount == baseFrame) {
+                stackTop = slots;
+                if (baseFrame > 0) push(result);
                 return InterpretResult::ok;
             }
 
-            stack.resize(slots);
-            push(result);
-            frame = &frames[frames.size() - 1];
-            break;
+            sp = slots;
+            PUSH(result);
+            stackTop = sp;
+            LOAD_FRAME();
+            DISPATCH();
         }
-        case OP_CONSTANT: {
-            Value constant = readConstant();
-            push(constant);
-            break;
+        CASE(OP_CONSTANT): {
+            Value constant = READ_CONSTANT();
+            PUSH(constant);
+            DISPATCH();
         }
-        case OP_NIL: push(Value()); break;
-        case OP_TRUE: push(true); break;
-        case OP_FALSE: push(false); break;
-        case OP_GET_PROPERTY: {
-            if (peek(0).type != ValueType::object || peek(0).as.object->type != ObjectType::Instance) {
-                runtimeError("Only instances have properties.");
-                return InterpretResult::runtimeError;
+        CASE(OP_NIL): PUSH(Value()); DISPATCH();
+        CASE(OP_TRUE): PUSH(true); DISPATCH();
+        CASE(OP_FALSE): PUSH(false); DISPATCH();
+        CASE(OP_GET_PROPERTY): {
+            if (!PEEK(0).isObjectType(ObjectType::Instance)) {
+                RUNTIME_ERROR("Only instances have properties.");
+            }
+
+            Instance* instance = PEEK(0).getInstance();
+            String* name = READ_CONSTANT().getString();
+            InlineCache* cache = READ_CACHE();
+
+            InlineCacheEntry* hit = nullptr;
+            for (int i = 0; i < cache->count; i++) {
+                InlineCacheEntry& entry = cache->entries[i];
+                if (entry.shape == instance->shape && entry.klass == instance->klass) {
+                    hit = &entry;
+                    break;
+                }
             }
 
-            Instance* instance = peek(0).getInstance();
-            String* name = readConstant().getString();
+            if (hit != nullptr) {
+                if (cacheStats) cacheHits++;
+                if (hit->method == nullptr) {
+                    PEEK(0) = instance->fields[hit->slot];
+                    DISPATCH();
+                }
 
-            auto x = instance->fields.find(name->chars);
-            if (x != instance->fields.end()) {
-                pop();
-                push(x->second);
-                break;
+                STORE_FRAME();
+                BoundMethod* bound = garbageCollector.newBoundMethod(PEEK(0), hit->method);
+                PEEK(0) = Value(bound);
+                DISPATCH();
+            }
+            if (cacheStats) cacheMisses++;
+            cacheLookup(cache, instance, name);
+
+            Value value;
+            if (getField(instance, name, value)) {
+                sp--;
+                PUSH(value);
+                DISPATCH();
             }
 
-            if (!bindMethod(instance->klass, name->chars)) {
+            STORE_FRAME();
+            if (!bindMethod(instance->klass, name)) {
                 return InterpretResult::runtimeError;
             }
-            break;
+            sp = stackTop;
+            DISPATCH();
         }
-        case OP_SET_PROPERTY: {
-            if (peek(1).type != ValueType::object || peek(1).as.object->type != ObjectType::Instance) {
-                runtimeError("Only instances have fields.");
-                return InterpretResult::runtimeError;
+        CASE(OP_SET_PROPERTY): {
+            if (!PEEK(1).isObjectType(ObjectType::Instance)) {
+                RUNTIME_ERROR("Only instances have fields.");
             }
 
-            Instance* instance = peek(1).getInstance();
-
-            std::string name = readConstant().getString()->chars;
-            std::unordered_map<std::string, Value>::iterator x = instance->fields.find(name);
+            Instance* instance = PEEK(1).getInstance();
+            String* name = READ_CONSTANT().getString();
+            InlineCache* cache = READ_CACHE();
+            Value value = POP();
+            sp--;
+            PUSH(value);
+            garbageCollector.beforeWrite(&instance->object);
+            garbageCollector.writeBarrier(&instance->object, value);
+
+            InlineCacheEntry* hit = nullptr;
+            for (int i = 0; i < cache->count; i++) {
+                InlineCacheEntry& entry = cache->entries[i];
+                if (entry.shape == instance->shape && entry.klass == instance->klass) {
+                    hit = &entry;
+                    break;
+                }
+            }
 
-            if (x != globals.end()) {
-                x->second = peek(0);
-            } else {
-                instance->fields.insert({ name, peek(0) });
+            if (hit != nullptr) {
+                if (cacheStats) cacheHits++;
+                if (hit->transition == nullptr) {
+                    instance->fields[hit->slot] = value;
+                } else {
+                    instance->shape = hit->transition;
+                    instance->fields.push_back(value);
+                }
+                DISPATCH();
             }
+            if (cacheStats) cacheMisses++;
 
-            Value value = pop();
-            pop();
-            push(value);
-            break;
+            Shape* shape = instance->shape;
+            setField(instance, name, value);
+            if (shape != nullptr && instance->shape != nullptr) {
+                if (shape == instance->shape) {
+                    updateCache(cache, { shape, instance->klass, nullptr, nullptr, shape->slots[name] });
+                } else {
+                    updateCache(cache, { shape, instance->klass, instance->shape, nullptr, (uint32_t)instance->fields.size() - 1 });
+                }
+            }
+            DISPATCH();
         }
-        case OP_GET_PROPERTY_BY_KEY: {
-            if (peek(1).type != ValueType::object || peek(1).as.object->type != ObjectType::Instance) {
-                runtimeError("Only instances have properties.");
-                return InterpretResult::runtimeError;
+        CASE(OP_GET_PROPERTY_BY_KEY): {
+            if (PEEK(1).isObjectType(ObjectType::Array)) {
+                Array* array = PEEK(1).getArray();
+                Value key = PEEK(0);
+                size_t index;
+
+                if (key.isNumber() && key.getNumber() >= 0 && key.getNumber() < array->values.size()) {
+                    index = (size_t)key.getNumber();
+                    if (index != key.getNumber()) {
+                        RUNTIME_ERROR("Array index must be an integer.");
+                    }
+                } else {
+                    STORE_FRAME();
+                    if (!arrayIndex(array, key, index)) {
+                        return InterpretResult::runtimeError;
+                    }
+                }
+
+                sp -= 2;
+                PUSH(array->values[index]);
+                DISPATCH();
+            }
+
+            if (!PEEK(1).isObjectType(ObjectType::Instance)) {
+                RUNTIME_ERROR("Only instances have properties.");
             }
 
-            Instance* instance = peek(1).getInstance();
-            std::string name;
+            Instance* instance = PEEK(1).getInstance();
+            String* name;
 
-            if (peek(0).type == ValueType::number) {
-                name = peek(0).stringify();
-            } else if (peek(0).type == ValueType::object && peek(0).as.object->type == ObjectType::String) {
-                name = peek(0).stringify();
+            if (PEEK(0).isNumber()) {
+                STORE_FRAME();
+                name = garbageCollector.newString(PEEK(0).stringify());
+            } else if (PEEK(0).isObjectType(ObjectType::String)) {
+                name = PEEK(0).getString();
             } else {
-                runtimeError("A key must be a number or a string.");
-                return InterpretResult::runtimeError;
+                RUNTIME_ERROR("A key must be a number or a string.");
             }
-            pop();
+            sp--;
 
-            auto x = instance->fields.find(name);
-            if (x != instance->fields.end()) {
-                pop();
-                push(x->second);
-                break;
+            Value value;
+            if (getField(instance, name, value)) {
+                sp--;
+                PUSH(value);
+                DISPATCH();
             }
 
+            STORE_FRAME();
             if (!bindMethod(instance->klass, name)) {
                 return InterpretResult::runtimeError;
             }
-            break;
+            sp = stackTop;
+            DISPATCH();
         }
-        case OP_SET_PROPERTY_BY_KEY: {
-            if (peek(2).type != ValueType::object || peek(2).as.object->type != ObjectType::Instance) {
-                runtimeError("Only instances have fields.");
-                return InterpretResult::runtimeError;
-            }
+        CASE(OP_SET_PROPERTY_BY_KEY): {
+            if (PEEK(2).isObjectType(ObjectType::Array)) {
+                Array* array = PEEK(2).getArray();
+                Value key = PEEK(1);
+                size_t index;
+
+                if (key.isNumber() && key.getNumber() >= 0 && key.getNumber() < array->values.size()) {
+                    index = (size_t)key.getNumber();
+                    if (index != key.getNumber()) {
+                        RUNTIME_ERROR("Array index must be an integer.");
+                    }
+                } else {
+                    STORE_FRAME();
+                    if (!arrayIndex(array, key, index, true)) {
+                        return InterpretResult::runtimeError;
+                    }
+                }
 
-            Instance* instance = peek(2).getInstance();
-            std::string name;
+                Value value = POP();
+                garbageCollector.beforeWrite(&array->object);
+                if (index == array->values.size()) {
+                    array->values.push_back(value);
+                } else {
+                    array->values[index] = value;
+                }
+                garbageCollector.writeBarrier(&array->object, value);
+                sp -= 2;
+                PUSH(value);
+                DISPATCH();
+            }
 
-            if (peek(1).type == ValueType::number) {
-                name = peek(1).stringify();
-            } else if (peek(1).type == ValueType::object && peek(1).as.object->type == ObjectType::String) {
-                name = peek(1).stringify();
-            } else {
-                runtimeError("A key must be a number or a string.");
-                return InterpretResult::runtimeError;
+            if (!PEEK(2).isObjectType(ObjectType::Instance)) {
+                RUNTIME_ERROR("Only instances have fields.");
             }
 
-            std::unordered_map<std::string, Value>::iterator x = instance->fields.find(name);
+            Instance* instance = PEEK(2).getInstance();
+            String* name;
 
-            if (x != globals.end()) {
-                x->second = peek(0);
+            if (PEEK(1).isNumber()) {
+                STORE_FRAME();
+                name = garbageCollector.newString(PEEK(1).stringify());
+                if (instance->klass == nullptr && instance->dictionary == nullptr) {
+                    makeDictionary(instance);
+                }
+            } else if (PEEK(1).isObjectType(ObjectType::String)) {
+                name = PEEK(1).getString();
             } else {
-                instance->fields.insert({ name, peek(0) });
+                RUNTIME_ERROR("A key must be a number or a string.");
             }
 
-            Value value = pop();
-            pop();
-            pop();
-            push(value);
-            break;
+            setField(instance, name, PEEK(0));
+
+            Value value = POP();
+            sp--;
+            sp--;
+            PUSH(value);
+            DISPATCH();
         }
-        case OP_EQUAL: push(valuesEqual(pop(), pop())); break;
-        case OP_GREATER: {
-            if (peek(0).type != ValueType::number || peek(1).type != ValueType::number) {
-                runtimeError("Operands must be numbers.");
-                return InterpretResult::runtimeError;
+        CASE(OP_EQUAL): {
+            Value b = POP();
+            Value a = POP();
+            if (a.isNumber() && b.isNumber()) ip[-1] = OP_EQUAL_NUM;
+            PUSH(valuesEqual(a, b));
+            DISPATCH();
+        }
+        CASE(OP_EQUAL_NUM): {
+            if (!PEEK(0).isNumber() || !PEEK(1).isNumber()) {
+                ip[-1] = OP_EQUAL;
+                ip--;
+                DISPATCH();
             }
 
-            push(pop().as.number < pop().as.number);
-            break;
+            double b = POP().getNumber();
+            double a = POP().getNumber();
+            PUSH(a == b);
+            DISPATCH();
         }
-        case OP_LESS: {
-            if (peek(0).type != ValueType::number || peek(1).type != ValueType::number) {
-                runtimeError("Operands must be numbers.");
-                return InterpretResult::runtimeError;
+        CASE(OP_GREATER): {
+            if (!PEEK(0).isNumber() || !PEEK(1).isNumber()) {
+                RUNTIME_ERROR("Operands must be numbers.");
             }
 
-            push(pop().as.number > pop().as.number);
-            break;
+            double b = POP().getNumber();
+            double a = POP().getNumber();
+            PUSH(a > b);
+            DISPATCH();
         }
-        case OP_NEGATE:
-            if (peek(0).type != ValueType::number) {
-                runtimeError("Operand must be a number.");
-                return InterpretResult::runtimeError;
+        CASE(OP_LESS): {
+            if (!PEEK(0).isNumber() || !PEEK(1).isNumber()) {
+                RUNTIME_ERROR("Operands must be numbers.");
             }
-            push(-pop().as.number);
-            break;
-        case OP_ADD:
-            if (peek(0).type == ValueType::object && peek(0).as.object->type == ObjectType::String &&
-                peek(1).type == ValueType::object && peek(1).as.object->type == ObjectType::String) {
-                std::string& b = pop().getString()->chars;
-                std::string& a = pop().getString()->chars;
+
+            double b = POP().getNumber();
+            double a = POP().getNumber();
+            PUSH(a < b);
+            DISPATCH();
+        }
+        CASE(OP_NEGATE): {
+            if (!PEEK(0).isNumber()) {
+                RUNTIME_ERROR("Operand must be a number.");
+            }
+            double a = POP().getNumber();
+            PUSH(-a);
+            DISPATCH();
+        }
+        CASE(OP_ADD):
+            if (PEEK(0).isObjectType(ObjectType::String) && PEEK(1).isObjectType(ObjectType::String)) {
+                std::string& b = POP().getString()->chars;
+                std::string& a = POP().getString()->chars;
                 std::string c = a + b;
+                STORE_FRAME();
                 String* result = garbageCollector.newString(c);
-                push(Value(result));
-            } else if (peek(0).type == ValueType::number && peek(1).type == ValueType::number) {
-                push(pop().as.number + pop().as.number);
+                PUSH(Value(result));
+                ip[-1] = OP_ADD_STR;
+                if (garbageCollector.outOfMemory) {
+                    RUNTIME_ERROR("Out of memory.");
+                }
+            } else if (PEEK(0).isNumber() && PEEK(1).isNumber()) {
+                double b = POP().getNumber();
+                double a = POP().getNumber();
+                PUSH(a + b);
+                ip[-1] = OP_ADD_NUM;
             } else {
-                runtimeError("Operands must be two numbers or two strings.");
-                return InterpretResult::runtimeError;
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
             }
-            break;
-        case OP_SUBTRACT: {
-            if (peek(0).type != ValueType::number || peek(1).type != ValueType::number) {
-                runtimeError("Operands must be numbers.");
-                return InterpretResult::runtimeError;
+            DISPATCH();
+        CASE(OP_ADD_NUM): {
+            if (!PEEK(0).isNumber() || !PEEK(1).isNumber()) {
+                ip[-1] = OP_ADD;
+                ip--;
+                DISPATCH();
             }
 
-            push((pop().as.number - pop().as.number) * -1);
-            break;
+            double b = POP().getNumber();
+            double a = POP().getNumber();
+            PUSH(a + b);
+            DISPATCH();
         }
-        case OP_MULTIPLY: {
-            if (peek(0).type != ValueType::number || peek(1).type != ValueType::number) {
-                runtimeError("Operands must be numbers.");
-                return InterpretResult::runtimeError;
+        CASE(OP_ADD_STR): {
+            if (!PEEK(0).isObjectType(ObjectType::String) || !PEEK(1).isObjectType(ObjectType::String)) {
+                ip[-1] = OP_ADD;
+                ip--;
+                DISPATCH();
             }
 
-            push(pop().as.number * pop().as.number);
-            break;
+            std::string& b = POP().getString()->chars;
+            std::string& a = POP().getString()->chars;
+            STORE_FRAME();
+            String* result = garbageCollector.newString(a + b);
+            PUSH(Value(result));
+            if (garbageCollector.outOfMemory) {
+                RUNTIME_ERROR("Out of memory.");
+            }
+            DISPATCH();
         }
-        case OP_DIVIDE: {
-            if (peek(0).type != ValueType::number || peek(1).type != ValueType::number) {
-                runtimeError("Operands must be numbers.");
-                return InterpretResult::runtimeError;
+        CASE(OP_NOT_EQUAL): {
+            Value b = POP();
+            Value a = POP();
+            PUSH(!valuesEqual(a, b));
+            DISPATCH();
+        }
+        CASE(OP_GREATER_EQUAL): {
+            if (!PEEK(0).isNumber() || !PEEK(1).isNumber()) {
+                RUNTIME_ERROR("Operands must be numbers.");
             }
 
-            push(1 / pop().as.number * pop().as.number);
-            break;
+            double b = POP().getNumber();
+            double a = POP().getNumber();
+            PUSH(!(a < b));
+            DISPATCH();
         }
-        case OP_REMAIN: {
-            if (peek(0).type != ValueType::number || peek(1).type != ValueType::number) {
-                runtimeError("Operands must be numbers.");
-                return InterpretResult::runtimeError;
+        CASE(OP_LESS_EQUAL): {
+            if (!PEEK(0).isNumber() || !PEEK(1).isNumber()) {
+                RUNTIME_ERROR("Operands must be numbers.");
+            }
+
+            double b = POP().getNumber();
+            double a = POP().getNumber();
+            PUSH(!(a > b));
+            DISPATCH();
+        }
+        CASE(OP_POP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(POP())) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_EQUAL): {
+            uint16_t offset = READ_SHORT();
+            Value b = POP();
+            Value a = POP();
+            if (valuesEqual(a, b)) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_NOT_EQUAL): {
+            uint16_t offset = READ_SHORT();
+            Value b = POP();
+            Value a = POP();
+            if (!valuesEqual(a, b)) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_LESS): {
+            uint16_t offset = READ_SHORT();
+            if (!PEEK(0).isNumber() || !PEEK(1).isNumber()) {
+                RUNTIME_ERROR("Operands must be numbers.");
             }
 
-            Value b = pop();
-            Value a = pop();
-            double result = std::fmod(a.as.number, b.as.number);
+            double b = POP().getNumber();
+            double a = POP().getNumber();
+            if (a < b) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_NOT_LESS): {
+            uint16_t offset = READ_SHORT();
+            if (!PEEK(0).isNumber() || !PEEK(1).isNumber()) {
+                RUNTIME_ERROR("Operands must be numbers.");
+            }
 
-            push(Value(result));
-            break;
+            double b = POP().getNumber();
+            double a = POP().getNumber();
+            if (!(a < b)) ip += offset;
+            DISPATCH();
         }
-        case OP_NOT: {
-            Value value = pop();
-            push(isFalsey(value));
-            break;
+        CASE(OP_JUMP_IF_GREATER): {
+            uint16_t offset = READ_SHORT();
+            if (!PEEK(0).isNumber() || !PEEK(1).isNumber()) {
+                RUNTIME_ERROR("Operands must be numbers.");
+            }
+
+            double b = POP().getNumber();
+            double a = POP().getNumber();
+            if (a > b) ip += offset;
+            DISPATCH();
         }
-        case OP_PRINT: {
-            std::cout << pop().stringify();
-            break;
+        CASE(OP_JUMP_IF_NOT_GREATER): {
+            uint16_t offset = READ_SHORT();
+            if (!PEEK(0).isNumber() || !PEEK(1).isNumber()) {
+                RUNTIME_ERROR("Operands must be numbers.");
+            }
+
+            double b = POP().getNumber();
+            double a = POP().getNumber();
+            if (!(a > b)) ip += offset;
+            DISPATCH();
         }
-        case OP_PRINTL: {
-            std::cout << pop().stringify() << std::endl;
-            break;
+        CASE(OP_ADD_LOCAL_CONSTANT): {
+            Value a = slots[READ_BYTE()];
+            Value b = READ_CONSTANT();
+            if (!a.isNumber()) {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
+            }
+
+            PUSH(a.getNumber() + b.getNumber());
+            DISPATCH();
         }
-        case OP_JUMP: {
-            uint16_t offset = readShort();
-            frame->ip += offset;
-            break;
+        CASE(OP_SUBTRACT_LOCAL_CONSTANT): {
+            Value a = slots[READ_BYTE()];
+            Value b = READ_CONSTANT();
+            if (!a.isNumber()) {
+                RUNTIME_ERROR("Operands must be numbers.");
+            }
+
+            PUSH(a.getNumber() - b.getNumber());
+            DISPATCH();
         }
-        case OP_JUMP_IF_FALSE: {
-            uint16_t offset = readShort();
-            if (isFalsey(peek(0))) frame->ip += offset;
-            break;
+        CASE(OP_SUBTRACT): {
+            if (!PEEK(0).isNumber() || !PEEK(1).isNumber()) {
+                RUNTIME_ERROR("Operands must be numbers.");
+            }
+
+            double b = POP().getNumber();
+            double a = POP().getNumber();
+            PUSH(a - b);
+            DISPATCH();
         }
-        case OP_LOOP: {
-            frame->ip -= readShort();
-            break;
+        CASE(OP_MULTIPLY): {
+            if (!PEEK(0).isNumber() || !PEEK(1).isNumber()) {
+                RUNTIME_ERROR("Operands must be numbers.");
+            }
+
+            double b = POP().getNumber();
+            double a = POP().getNumber();
+            PUSH(a * b);
+            DISPATCH();
         }
-        case OP_POP: pop(); break;
-        case OP_DEFINE_GLOBAL: {
-            std::string& name = readConstant().getString()->chars;
-            std::unordered_map<std::string, Value>::iterator value = globals.find(name);
+        CASE(OP_DIVIDE): {
+            if (!PEEK(0).isNumber() || !PEEK(1).isNumber()) {
+                RUNTIME_ERROR("Operands must be numbers.");
+            }
 
-            if (value != globals.end()) {
-                value->second = peek(0);
-            } else {
-                globals.insert({ name, peek(0) });
+            double b = POP().getNumber();
+            double a = POP().getNumber();
+            PUSH(a / b);
+            DISPATCH();
+        }
+        CASE(OP_REMAIN): {
+            if (!PEEK(0).isNumber() || !PEEK(1).isNumber()) {
+                RUNTIME_ERROR("Operands must be numbers.");
             }
 
-            pop();
-            break;
+            Value b = POP();
+            Value a = POP();
+            double result = std::fmod(a.getNumber(), b.getNumber());
+
+            PUSH(Value(result));
+            DISPATCH();
         }
-        case OP_GET_LOCAL:
-            push(stack[frame->slots + readByte()]);
-            break;
-        case OP_SET_LOCAL: {
-            uint8_t slot = readByte();
-            stack[frame->slots + slot] = peek(0);
+        CASE(OP_NOT): {
+            Value value = POP();
+            PUSH(isFalsey(value));
+            DISPATCH();
+        }
+        CASE(OP_PRINT): {
+            std::cout << POP().stringify();
+            DISPATCH();
+        }
+        CASE(OP_PRINTL): {
+            std::cout << POP().stringify() << std::endl;
+            DISPATCH();
+        }
+        CASE(OP_JUMP): {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(PEEK(0))) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_LOOP): {
+            ip -= READ_SHORT();
+            if (garbageCollector.outOfMemory) {
+                RUNTIME_ERROR("Out of memory.");
+            }
+            if (jitEnabled && recorder == nullptr) {
+                STORE_FRAME();
+                if (loopBackEdge(frame)) {
+                    ENTER_JIT();
+                    LOAD_FRAME();
+                }
+#ifdef COMPUTED_GOTO
+                if (recorder != nullptr) dispatch = recordTable;
+#endif
+            }
+            DISPATCH();
+        }
+        CASE(OP_POP): sp--; DISPATCH();
+        CASE(OP_DEFINE_GLOBAL): {
+            globals.values[READ_SHORT()] = PEEK(0);
+
+            sp--;
+            DISPATCH();
+        }
+        CASE(OP_GET_LOCAL):
+            PUSH(slots[READ_BYTE()]);
+            DISPATCH();
+        CASE(OP_SET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            slots[slot] = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL_POP):
+            slots[READ_BYTE()] = POP();
+            DISPATCH();
+        CASE(OP_GET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            Value value = globals.values[slot];
+
+            if (value.isUndefined()) {
+                RUNTIME_ERROR("Undefined variable '" + globals.names[slot]->chars + "'.");
+            }
+
+            PUSH(value);
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            Value& value = globals.values[slot];
+
+            if (value.isUndefined()) {
+                RUNTIME_ERROR("Undefined variable '" + globals.names[slot]->chars + "'.");
+            }
+
+            value = PEEK(0);
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL_POP): {
+            uint16_t slot = READ_SHORT();
+            Value& value = globals.values[slot];
+
+            if (value.isUndefined()) {
+                RUNTIME_ERROR("Undefined variable '" + globals.names[slot]->chars + "'.");
+            }
+
+            value = POP();
+            DISPATCH();
+        }
+        CASE(OP_GET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            PUSH(*frame->closure->upvalues[slot]->location);
+            DISPATCH();
+        }
+        CASE(OP_SET_UPVALUE): {
+            uint8_t slot = READ_BYTE();
+            Upvalue* upvalue = frame->closure->upvalues[slot];
+            garbageCollector.beforeWrite(&upvalue->object);
+            *upvalue->location = PEEK(0);
+            garbageCollector.writeBarrier(&upvalue->object, PEEK(0));
+            DISPATCH();
+        }
+        CASE(OP_CLASS):
+            STORE_FRAME();
+            PUSH(Value(garbageCollector.newClass(READ_CONSTANT().getString()->chars)));
+            DISPATCH();
+        CASE(OP_METHOD):
+            STORE_FRAME();
+            defineMethod(READ_CONSTANT().getString());
+            sp = stackTop;
+            DISPATCH();
+        CASE(OP_ARRAY): {
+            int itemCount = READ_BYTE();
+            STORE_FRAME();
+            Array* array = garbageCollector.newArray();
+            array->values.assign(sp - itemCount, sp);
+            sp -= itemCount;
+            PUSH(Value(array));
+            DISPATCH();
+        }
+        CASE(OP_MAP): {
+            STORE_FRAME();
+            Instance* instance = garbageCollector.newInstance(nullptr);
+            PUSH(Value(instance));
+            DISPATCH();
+        }
+        CASE(OP_KEY): {
+            Value value = POP();
+            Value instance = POP();
+            setField(instance.getInstance(), READ_CONSTANT().getString(), value);
+            PUSH(instance);
+            DISPATCH();
+        }
+#ifdef COMPUTED_GOTO
+        record_instruction:
+            if (recorder == nullptr || !recordTrace(recorder, frame, ip - 1, sp)) {
+                recorder = nullptr;
+                dispatch = dispatchTable;
+            }
+            goto *dispatchTable[ip[-1]];
+#endif
+        }
+#ifndef COMPUTED_GOTO
+    }
+#endif
+
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_CONSTANT
+#undef READ_CACHE
+#undef ENTER_JIT
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef RUNTIME_ERROR
+#undef CASE
+#undef DISPATCH
+}
+
+void VM::warmUp(Function* function) {
+    if (!jitEnabled || function->hotness >= JIT_THRESHOLD) return;
+    if (++function->hotness == JIT_THRESHOLD) {
+        compileJit(function, globals.values.data());
+    }
+}
+
+// Counts a back-edge to the loop header at frame->ip, which may start a trace
+// recording. Returns true when native code can take over from the header.
+bool VM::loopBackEdge(CallFrame* frame) {
+    Function* function = frame->closure->function;
+    warmUp(function);
+    recorder = countLoop(frame, globals.values.data());
+    if (recorder != nullptr) return false;
+    return !function->jitEntries.empty() || traceAt(frame, globals.values.data()) != nullptr;
+}
+
+// Runs the top frame in native code while it has an entry at the frame's ip.
+// A loop's trace runs until one of its guards fails; the baseline code then
+// finishes the iteration and hands back to the trace at the loop header.
+// Code is rebuilt when the globals it addresses have moved.
+bool VM::runJit() {
+    bool traced = false;
+    for (;;) {
+        CallFrame* frame = &frames[frameCount - 1];
+        Function* function = frame->closure->function;
+
+        if (!traced) {
+            uint8_t* trace = traceAt(frame, globals.values.data());
+            if (trace != nullptr) {
+                traced = true;
+                enterJit(this, frame, &stackTop, trace);
+                continue;
+            }
+        }
+
+        if (function->jitEntries.empty()) return true;
+
+        if (function->jitGlobals != globals.values.data()) {
+            if (!compileJit(function, globals.values.data())) return true;
+        }
+
+        uint8_t* entry = function->jitEntries[frame->ip - function->chunk.code.data()];
+        if (entry == nullptr) return true;
+
+        switch (enterJit(this, frame, &stackTop, entry)) {
+        case JitStatus::error: return false;
+        case JitStatus::tailCall: break;
+        case JitStatus::exit:
+            if (traceAt(&frames[frameCount - 1], globals.values.data()) == nullptr) return true;
             break;
+        default: return true;
+        }
+        traced = false;
+    }
+}
+
+// Runs the frame a call just pushed until it returns its result.
+bool VM::finishCall() {
+    int baseFrame = frameCount - 1;
+    if (!runJit()) return false;
+    return frameCount == baseFrame || run(baseFrame) == InterpretResult::ok;
+}
+
+Value* VM::jitCall(VM* vm, Value* sp, int argCount) {
+    vm->stackTop = sp;
+    int frameCount = vm->frameCount;
+
+    // Compiled closures are entered directly, without going through run().
+    Value callee = sp[-argCount - 1];
+    if (callee.isObjectType(ObjectType::Closure)) {
+        Function* function = callee.getClosure()->function;
+        if (function->arity == argCount && !function->jitEntries.empty() && function->jitEntries[0] != nullptr &&
+            function->jitGlobals == vm->globals.values.data() && frameCount < FRAMES_MAX && sp + FRAME_SLOTS <= vm->stack + STACK_MAX) {
+            CallFrame* frame = &vm->frames[vm->frameCount++];
+            frame->closure = callee.getClosure();
+            frame->ip = function->chunk.code.data();
+            frame->slots = sp - argCount - 1;
+            frame->pc = nullptr;
+            JitStatus status = enterJit(vm, frame, &vm->stackTop, function->jitEntries[0]);
+            if (status == JitStatus::error) return nullptr;
+            if (vm->frameCount > frameCount && !vm->finishCall()) return nullptr;
+            return vm->stackTop;
+        }
+    }
+
+    if (!vm->callValue(sp[-argCount - 1], argCount)) return nullptr;
+    if (vm->frameCount > frameCount && !vm->finishCall()) return nullptr;
+    return vm->stackTop;
+}
+
+Value* VM::jitTailCall(VM* vm, Value* sp, int argCount) {
+    Value callee = sp[-argCount - 1];
+    if (!callee.isObjectType(ObjectType::Closure) || callee.getClosure()->function->arity != argCount) {
+        return jitCall(vm, sp, argCount);
+    }
+
+    if (vm->garbageCollector.outOfMemory) {
+        vm->runtimeError("Out of memory.");
+        return nullptr;
+    }
+
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
+    vm->closeUpvalues(frame->slots);
+    std::copy(sp - argCount - 1, sp, frame->slots);
+    frame->closure = callee.getClosure();
+    frame->ip = frame->closure->function->chunk.code.data();
+    vm->stackTop = frame->slots + argCount + 1;
+    vm->warmUp(frame->closure->function);
+    return vm->stackTop;
+}
+
+Value* VM::jitInvoke(VM* vm, Value* sp, String* name, int argCount) {
+    vm->stackTop = sp;
+    int frameCount = vm->frameCount;
+    if (!vm->invoke(sp[-argCount - 1], name, argCount)) return nullptr;
+    if (vm->frameCount > frameCount && !vm->finishCall()) return nullptr;
+    return vm->stackTop;
+}
+
+Value* VM::jitReturn(VM* vm, Value* sp) {
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
+    Value result = sp[-1];
+    vm->closeUpvalues(frame->slots);
+
+    vm->frameCount--;
+    vm->stackTop = frame->slots;
+    if (vm->frameCount > 0) vm->push(result);
+    return vm->stackTop;
+}
+
+Value* VM::jitAdd(VM* vm, Value* sp) {
+    vm->stackTop = sp;
+    Value a = sp[-2];
+    Value b = sp[-1];
+    if (!a.isObjectType(ObjectType::String) || !b.isObjectType(ObjectType::String)) {
+        vm->runtimeError("Operands must be two numbers or two strings.");
+        return nullptr;
+    }
+
+    String* result = vm->garbageCollector.newString(a.getString()->chars + b.getString()->chars);
+    if (vm->garbageCollector.outOfMemory) {
+        vm->runtimeError("Out of memory.");
+        return nullptr;
+    }
+    sp[-2] = Value(result);
+    vm->stackTop = sp - 1;
+    return vm->stackTop;
+}
+
+Value* VM::jitGetUpvalue(VM* vm, Value* sp, int index) {
+    *sp = *vm->frames[vm->frameCount - 1].closure->upvalues[index]->location;
+    return sp + 1;
+}
+
+Value* VM::jitSetUpvalue(VM* vm, Value* sp, int index) {
+    Upvalue* upvalue = vm->frames[vm->frameCount - 1].closure->upvalues[index];
+    vm->garbageCollector.beforeWrite(&upvalue->object);
+    *upvalue->location = sp[-1];
+    vm->garbageCollector.writeBarrier(&upvalue->object, sp[-1]);
+    return sp;
+}
+
+Value* VM::jitCloseUpvalue(VM* vm, Value* sp) {
+    vm->closeUpvalues(sp - 1);
+    return sp - 1;
+}
+
+bool VM::jitEqual(Value* sp) {
+    return valuesEqual(sp[-2], sp[-1]);
+}
+
+double VM::jitRemain(double a, double b) {
+    return std::fmod(a, b);
+}
+
+void VM::jitPrint(Value* sp, bool newline) {
+    std::cout << sp[-1].stringify();
+    if (newline) std::cout << std::endl;
+}
+
+bool VM::enterRegisterFrame() {
+    CallFrame* frame = &frames[frameCount - 1];
+    Function* function = frame->closure->function;
+    Value* callerTop = frameCount > 1 ? frames[frameCount - 2].top : stack;
+
+    if (!compileRegisters(function, &garbageCollector)) {
+        if (run(frameCount - 1) != InterpretResult::ok) {
+            return false;
+        }
+        std::fill(stackTop, callerTop, Value());
+        stackTop = callerTop;
+        return true;
+    }
+
+    Value* top = std::max(callerTop, frame->slots + function->registerCount);
+    if (top > stack + STACK_MAX) {
+        frameCount--;
+        runtimeError("Stack overflow.");
+        return false;
+    }
+
+    std::fill(stackTop, top, Value());
+    frame->pc = function->registerCode.data();
+    frame->top = top;
+    stackTop = top;
+    return true;
+}
+
+bool VM::returnToRegisters(int callerFrameCount) {
+    if (frameCount > callerFrameCount) {
+        return enterRegisterFrame();
+    }
+
+    Value* top = frames[callerFrameCount - 1].top;
+    std::fill(stackTop, top, Value());
+    stackTop = top;
+    return true;
+}
+
+InterpretResult VM::runRegisters() {
+    CallFrame* frame;
+    RegisterInstruction* code;
+    RegisterInstruction* pc;
+    RegisterInstruction* instruction;
+    Value* constants;
+    Value* slots;
+
+#define RK(operand) ((operand) & REGISTER_CONSTANT ? constants[(operand) & ~REGISTER_CONSTANT] : slots[operand])
+#define READ_CACHE(index) (&frame->closure->function->chunk.caches[index])
+#define STORE_FRAME() frame->pc = pc
+#define LOAD_FRAME() \
+    frame = &frames[frameCount - 1]; \
+    code = frame->closure->function->registerCode.data(); \
+    pc = frame->pc; \
+    constants = frame->closure->function->chunk.constants.data(); \
+    slots = frame->slots
+#define RUNTIME_ERROR(message) \
+    STORE_FRAME(); \
+    runtimeError(message); \
+    return InterpretResult::runtimeError
+#define NUMBER_OPERANDS() \
+    Value a = RK(instruction->b); \
+    Value b = RK(instruction->c); \
+    if (!a.isNumber() || !b.isNumber()) { \
+        RUNTIME_ERROR("Operands must be numbers."); \
+    }
+
+#ifdef COMPUTED_GOTO
+    static void* dispatchTable[] = {
+        [R_MOVE] = &&label_R_MOVE,
+        [R_GET_GLOBAL] = &&label_R_GET_GLOBAL,
+        [R_SET_GLOBAL] = &&label_R_SET_GLOBAL,
+        [R_DEFINE_GLOBAL] = &&label_R_DEFINE_GLOBAL,
+        [R_GET_UPVALUE] = &&label_R_GET_UPVALUE,
+        [R_SET_UPVALUE] = &&label_R_SET_UPVALUE,
+        [R_GET_PROPERTY] = &&label_R_GET_PROPERTY,
+        [R_SET_PROPERTY] = &&label_R_SET_PROPERTY,
+        [R_EQUAL] = &&label_R_EQUAL,
+        [R_NOT_EQUAL] = &&label_R_NOT_EQUAL,
+        [R_GREATER] = &&label_R_GREATER,
+        [R_GREATER_EQUAL] = &&label_R_GREATER_EQUAL,
+        [R_LESS] = &&label_R_LESS,
+        [R_LESS_EQUAL] = &&label_R_LESS_EQUAL,
+        [R_ADD] = &&label_R_ADD,
+        [R_SUBTRACT] = &&label_R_SUBTRACT,
+        [R_MULTIPLY] = &&label_R_MULTIPLY,
+        [R_DIVIDE] = &&label_R_DIVIDE,
+        [R_REMAIN] = &&label_R_REMAIN,
+        [R_NOT] = &&label_R_NOT,
+        [R_NEGATE] = &&label_R_NEGATE,
+        [R_PRINT] = &&label_R_PRINT,
+        [R_PRINTL] = &&label_R_PRINTL,
+        [R_JUMP] = &&label_R_JUMP,
+        [R_JUMP_IF_FALSE] = &&label_R_JUMP_IF_FALSE,
+        [R_JUMP_IF_EQUAL] = &&label_R_JUMP_IF_EQUAL,
+        [R_JUMP_IF_NOT_EQUAL] = &&label_R_JUMP_IF_NOT_EQUAL,
+        [R_JUMP_IF_LESS] = &&label_R_JUMP_IF_LESS,
+        [R_JUMP_IF_NOT_LESS] = &&label_R_JUMP_IF_NOT_LESS,
+        [R_JUMP_IF_GREATER] = &&label_R_JUMP_IF_GREATER,
+        [R_JUMP_IF_NOT_GREATER] = &&label_R_JUMP_IF_NOT_GREATER,
+        [R_CALL] = &&label_R_CALL,
+        [R_TAIL_CALL] = &&label_R_TAIL_CALL,
+        [R_INVOKE] = &&label_R_INVOKE,
+        [R_CLOSURE] = &&label_R_CLOSURE,
+        [R_CAPTURE] = &&label_R_CAPTURE,
+        [R_CLOSE_UPVALUE] = &&label_R_CLOSE_UPVALUE,
+        [R_RETURN] = &&label_R_RETURN,
+        [R_CLASS] = &&label_R_CLASS,
+        [R_METHOD] = &&label_R_METHOD,
+        [R_ARRAY] = &&label_R_ARRAY,
+        [R_MAP] = &&label_R_MAP,
+        [R_KEY] = &&label_R_KEY,
+    };
+
+#define CASE(code) label_##code
+#define DISPATCH() \
+    do { \
+        if (countInstructions) instructionCount++; \
+        instruction = pc++; \
+        goto *dispatchTable[instruction->op]; \
+    } while (false)
+#else
+#define CASE(code) case code
+#define DISPATCH() continue
+#endif
+
+    LOAD_FRAME();
+
+#ifdef COMPUTED_GOTO
+    DISPATCH();
+    {
+#else
+    for (;;) {
+        if (countInstructions) instructionCount++;
+        instruction = pc++;
+        switch (instruction->op) {
+#endif
+        CASE(R_MOVE):
+            slots[instruction->a] = RK(instruction->b);
+            DISPATCH();
+        CASE(R_GET_GLOBAL): {
+            Value value = globals.values[instruction->b];
+
+            if (value.isUndefined()) {
+                RUNTIME_ERROR("Undefined variable '" + globals.names[instruction->b]->chars + "'.");
+            }
+
+            slots[instruction->a] = value;
+            DISPATCH();
+        }
+        CASE(R_SET_GLOBAL): {
+            Value& value = globals.values[instruction->a];
+
+            if (value.isUndefined()) {
+                RUNTIME_ERROR("Undefined variable '" + globals.names[instruction->a]->chars + "'.");
+            }
+
+            value = RK(instruction->b);
+            DISPATCH();
+        }
+        CASE(R_DEFINE_GLOBAL):
+            globals.values[instruction->a] = RK(instruction->b);
+            DISPATCH();
+        CASE(R_GET_UPVALUE):
+            slots[instruction->a] = *frame->closure->upvalues[instruction->b]->location;
+            DISPATCH();
+        CASE(R_SET_UPVALUE): {
+            Upvalue* upvalue = frame->closure->upvalues[instruction->a];
+            garbageCollector.beforeWrite(&upvalue->object);
+            *upvalue->location = RK(instruction->b);
+            garbageCollector.writeBarrier(&upvalue->object, RK(instruction->b));
+            DISPATCH();
+        }
+        CASE(R_GET_PROPERTY): {
+            Value object = RK(instruction->b);
+            if (!object.isObjectType(ObjectType::Instance)) {
+                RUNTIME_ERROR("Only instances have properties.");
+            }
+
+            Instance* instance = object.getInstance();
+            String* name = constants[instruction->n].getString();
+            InlineCache* cache = READ_CACHE(instruction->d);
+
+            InlineCacheEntry* hit = nullptr;
+            for (int i = 0; i < cache->count; i++) {
+                InlineCacheEntry& entry = cache->entries[i];
+                if (entry.shape == instance->shape && entry.klass == instance->klass) {
+                    hit = &entry;
+                    break;
+                }
+            }
+
+            if (hit != nullptr) {
+                if (cacheStats) cacheHits++;
+                if (hit->method == nullptr) {
+                    slots[instruction->a] = instance->fields[hit->slot];
+                    DISPATCH();
+                }
+
+                STORE_FRAME();
+                slots[instruction->a] = Value(garbageCollector.newBoundMethod(object, hit->method));
+                DISPATCH();
+            }
+            if (cacheStats) cacheMisses++;
+            cacheLookup(cache, instance, name);
+
+            Value value;
+            if (getField(instance, name, value)) {
+                slots[instruction->a] = value;
+                DISPATCH();
+            }
+
+            if (instance->klass == nullptr) {
+                RUNTIME_ERROR("Undefined property '" + name->chars + "'.");
+            }
+
+            auto method = instance->klass->methods.find(name);
+            if (method == instance->klass->methods.end()) {
+                RUNTIME_ERROR("Undefined property '" + name->chars + "'.");
+            }
+
+            STORE_FRAME();
+            slots[instruction->a] = Value(garbageCollector.newBoundMethod(object, method->second.getClosure()));
+            DISPATCH();
+        }
+        CASE(R_SET_PROPERTY): {
+            Value object = RK(instruction->b);
+            if (!object.isObjectType(ObjectType::Instance)) {
+                RUNTIME_ERROR("Only instances have fields.");
+            }
+
+            Instance* instance = object.getInstance();
+            String* name = constants[instruction->n].getString();
+            InlineCache* cache = READ_CACHE(instruction->d);
+            Value value = RK(instruction->c);
+            slots[instruction->a] = value;
+            garbageCollector.beforeWrite(&instance->object);
+            garbageCollector.writeBarrier(&instance->object, value);
+
+            InlineCacheEntry* hit = nullptr;
+            for (int i = 0; i < cache->count; i++) {
+                InlineCacheEntry& entry = cache->entries[i];
+                if (entry.shape == instance->shape && entry.klass == instance->klass) {
+                    hit = &entry;
+                    break;
+                }
+            }
+
+            if (hit != nullptr) {
+                if (cacheStats) cacheHits++;
+                if (hit->transition == nullptr) {
+                    instance->fields[hit->slot] = value;
+                } else {
+                    instance->shape = hit->transition;
+                    instance->fields.push_back(value);
+                }
+                DISPATCH();
+            }
+            if (cacheStats) cacheMisses++;
+
+            STORE_FRAME();
+            Shape* shape = instance->shape;
+            setField(instance, name, value);
+            if (shape != nullptr && instance->shape != nullptr) {
+                if (shape == instance->shape) {
+                    updateCache(cache, { shape, instance->klass, nullptr, nullptr, shape->slots[name] });
+                } else {
+                    updateCache(cache, { shape, instance->klass, instance->shape, nullptr, (uint32_t)instance->fields.size() - 1 });
+                }
+            }
+            DISPATCH();
+        }
+        CASE(R_EQUAL):
+            slots[instruction->a] = Value(valuesEqual(RK(instruction->b), RK(instruction->c)));
+            DISPATCH();
+        CASE(R_NOT_EQUAL):
+            slots[instruction->a] = Value(!valuesEqual(RK(instruction->b), RK(instruction->c)));
+            DISPATCH();
+        CASE(R_GREATER): {
+            NUMBER_OPERANDS();
+            slots[instruction->a] = Value(a.getNumber() > b.getNumber());
+            DISPATCH();
+        }
+        CASE(R_GREATER_EQUAL): {
+            NUMBER_OPERANDS();
+            slots[instruction->a] = Value(!(a.getNumber() < b.getNumber()));
+            DISPATCH();
+        }
+        CASE(R_LESS): {
+            NUMBER_OPERANDS();
+            slots[instruction->a] = Value(a.getNumber() < b.getNumber());
+            DISPATCH();
+        }
+        CASE(R_LESS_EQUAL): {
+            NUMBER_OPERANDS();
+            slots[instruction->a] = Value(!(a.getNumber() > b.getNumber()));
+            DISPATCH();
+        }
+        CASE(R_ADD): {
+            Value a = RK(instruction->b);
+            Value b = RK(instruction->c);
+            if (a.isNumber() && b.isNumber()) {
+                slots[instruction->a] = Value(a.getNumber() + b.getNumber());
+            } else if (a.isObjectType(ObjectType::String) && b.isObjectType(ObjectType::String)) {
+                STORE_FRAME();
+                slots[instruction->a] = Value(garbageCollector.newString(a.getString()->chars + b.getString()->chars));
+                if (garbageCollector.outOfMemory) {
+                    RUNTIME_ERROR("Out of memory.");
+                }
+            } else {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
+            }
+            DISPATCH();
+        }
+        CASE(R_SUBTRACT): {
+            NUMBER_OPERANDS();
+            slots[instruction->a] = Value(a.getNumber() - b.getNumber());
+            DISPATCH();
+        }
+        CASE(R_MULTIPLY): {
+            NUMBER_OPERANDS();
+            slots[instruction->a] = Value(a.getNumber() * b.getNumber());
+            DISPATCH();
+        }
+        CASE(R_DIVIDE): {
+            NUMBER_OPERANDS();
+            slots[instruction->a] = Value(a.getNumber() / b.getNumber());
+            DISPATCH();
+        }
+        CASE(R_REMAIN): {
+            NUMBER_OPERANDS();
+            slots[instruction->a] = Value(std::fmod(a.getNumber(), b.getNumber()));
+            DISPATCH();
+        }
+        CASE(R_NOT):
+            slots[instruction->a] = Value(isFalsey(RK(instruction->b)));
+            DISPATCH();
+        CASE(R_NEGATE): {
+            Value value = RK(instruction->b);
+            if (!value.isNumber()) {
+                RUNTIME_ERROR("Operand must be a number.");
+            }
+            slots[instruction->a] = Value(-value.getNumber());
+            DISPATCH();
+        }
+        CASE(R_PRINT):
+            std::cout << RK(instruction->a).stringify();
+            DISPATCH();
+        CASE(R_PRINTL):
+            std::cout << RK(instruction->a).stringify() << std::endl;
+            DISPATCH();
+        CASE(R_JUMP):
+            pc = code + instruction->d;
+            if (garbageCollector.outOfMemory) {
+                RUNTIME_ERROR("Out of memory.");
+            }
+            DISPATCH();
+        CASE(R_JUMP_IF_FALSE):
+            if (isFalsey(RK(instruction->a))) pc = code + instruction->d;
+            DISPATCH();
+        CASE(R_JUMP_IF_EQUAL):
+            if (valuesEqual(RK(instruction->a), RK(instruction->b))) pc = code + instruction->d;
+            DISPATCH();
+        CASE(R_JUMP_IF_NOT_EQUAL):
+            if (!valuesEqual(RK(instruction->a), RK(instruction->b))) pc = code + instruction->d;
+            DISPATCH();
+        CASE(R_JUMP_IF_LESS): {
+            Value a = RK(instruction->a);
+            Value b = RK(instruction->b);
+            if (!a.isNumber() || !b.isNumber()) {
+                RUNTIME_ERROR("Operands must be numbers.");
+            }
+            if (a.getNumber() < b.getNumber()) pc = code + instruction->d;
+            DISPATCH();
+        }
+        CASE(R_JUMP_IF_NOT_LESS): {
+            Value a = RK(instruction->a);
+            Value b = RK(instruction->b);
+            if (!a.isNumber() || !b.isNumber()) {
+                RUNTIME_ERROR("Operands must be numbers.");
+            }
+            if (!(a.getNumber() < b.getNumber())) pc = code + instruction->d;
+            DISPATCH();
+        }
+        CASE(R_JUMP_IF_GREATER): {
+            Value a = RK(instruction->a);
+            Value b = RK(instruction->b);
+            if (!a.isNumber() || !b.isNumber()) {
+                RUNTIME_ERROR("Operands must be numbers.");
+            }
+            if (a.getNumber() > b.getNumber()) pc = code + instruction->d;
+            DISPATCH();
+        }
+        CASE(R_JUMP_IF_NOT_GREATER): {
+            Value a = RK(instruction->a);
+            Value b = RK(instruction->b);
+            if (!a.isNumber() || !b.isNumber()) {
+                RUNTIME_ERROR("Operands must be numbers.");
+            }
+            if (!(a.getNumber() > b.getNumber())) pc = code + instruction->d;
+            DISPATCH();
         }
-        case OP_GET_GLOBAL: {
-            std::string& name = readConstant().getString()->chars;
-            std::unordered_map<std::string, Value>::iterator value = globals.find(name);
+        CASE(R_CALL): {
+            Value* base = slots + instruction->a;
+            int argCount = instruction->n;
+            int callerFrameCount = frameCount;
+            stackTop = base + argCount + 1;
+            STORE_FRAME();
+
+            // Calls between register-compiled closures skip the generic path.
+            if (base->isObjectType(ObjectType::Closure) && compileRegisters(base->getClosure()->function, &garbageCollector)) {
+                Function* function = base->getClosure()->function;
+                Value* top = std::max(frame->top, base + function->registerCount);
+                if (function->arity == argCount && frameCount < FRAMES_MAX && top <= stack + STACK_MAX) {
+                    std::fill(stackTop, top, Value());
+                    CallFrame* callee = &frames[frameCount++];
+                    callee->closure = base->getClosure();
+                    callee->ip = function->chunk.code.data();
+                    callee->slots = base;
+                    callee->pc = function->registerCode.data();
+                    callee->top = top;
+                    stackTop = top;
+
+                    LOAD_FRAME();
+                    DISPATCH();
+                }
+            }
 
-            if (value == globals.end()) {
-                runtimeError("Undefined variable '" + name + "'.");
+            if (!callValue(*base, argCount) || !returnToRegisters(callerFrameCount)) {
                 return InterpretResult::runtimeError;
             }
 
-            push(value->second);
-            break;
+            LOAD_FRAME();
+            DISPATCH();
         }
-        case OP_SET_GLOBAL: {
-            std::string& name = readConstant().getString()->chars;
-            std::unordered_map<std::string, Value>::iterator value = globals.find(name);
+        CASE(R_TAIL_CALL): {
+            Value* base = slots + instruction->a;
+            int argCount = instruction->n;
+            int callerFrameCount = frameCount;
+            stackTop = base + argCount + 1;
+            STORE_FRAME();
+
+            if (base->isObjectType(ObjectType::Closure) && compileRegisters(base->getClosure()->function, &garbageCollector)) {
+                Closure* closure = base->getClosure();
+                Function* function = closure->function;
+                Value* callerTop = frameCount > 1 ? frames[frameCount - 2].top : stack;
+                Value* top = std::max(callerTop, slots + function->registerCount);
+                if (function->arity == argCount && top <= stack + STACK_MAX) {
+                    if (garbageCollector.outOfMemory) {
+                        RUNTIME_ERROR("Out of memory.");
+                    }
+                    closeUpvalues(slots);
+                    std::copy(base, stackTop, slots);
+                    std::fill(slots + argCount + 1, std::max(top, stackTop), Value());
+
+                    frame->closure = closure;
+                    frame->ip = function->chunk.code.data();
+                    frame->pc = function->registerCode.data();
+                    frame->top = top;
+                    stackTop = top;
+
+                    LOAD_FRAME();
+                    DISPATCH();
+                }
+            }
 
-            if (value == globals.end()) {
-                runtimeError("Undefined variable '" + name + "'.");
+            if (!callValue(*base, argCount) || !returnToRegisters(callerFrameCount)) {
                 return InterpretResult::runtimeError;
             }
 
-            value->second = peek(0);
-            break;
+            LOAD_FRAME();
+            DISPATCH();
         }
-        case OP_GET_UPVALUE: {
-            uint8_t slot = readByte();
-            push(*frame->closure->upvalues[slot]->location);
-            break;
+        CASE(R_INVOKE): {
+            Value* base = slots + instruction->a;
+            int argCount = instruction->n;
+            String* method = constants[instruction->c].getString();
+            InlineCache* cache = READ_CACHE(instruction->d);
+            Value receiver = *base;
+            int callerFrameCount = frameCount;
+            stackTop = base + argCount + 1;
+            STORE_FRAME();
+
+            bool called = false;
+            bool cached = false;
+            if (receiver.isObjectType(ObjectType::Instance)) {
+                Instance* instance = receiver.getInstance();
+                for (int i = 0; i < cache->count; i++) {
+                    InlineCacheEntry& entry = cache->entries[i];
+                    if (entry.shape != instance->shape || entry.klass != instance->klass) continue;
+                    if (cacheStats) cacheHits++;
+
+                    cached = true;
+                    if (entry.method != nullptr) {
+                        called = call(entry.method, argCount);
+                    } else {
+                        *base = instance->fields[entry.slot];
+                        called = callValue(*base, argCount);
+                    }
+                    break;
+                }
+
+                if (!cached) {
+                    if (cacheStats) cacheMisses++;
+                    cacheLookup(cache, instance, method);
+                }
+            }
+
+            if (!cached) {
+                called = invoke(receiver, method, argCount);
+            }
+            if (!called || !returnToRegisters(callerFrameCount)) {
+                return InterpretResult::runtimeError;
+            }
+            LOAD_FRAME();
+            DISPATCH();
         }
-        case OP_SET_UPVALUE: {
-            uint8_t slot = readByte();
-            *frame->closure->upvalues[slot]->location = peek(0);
-            break;
+        CASE(R_CLOSURE): {
+            Function* function = constants[instruction->b].getFunction();
+            STORE_FRAME();
+            Closure* closure = garbageCollector.newClosure(function);
+            slots[instruction->a] = Value(closure);
+            for (int i = 0; i < function->upvalueCount; i++) {
+                RegisterInstruction* capture = pc++;
+                Upvalue* upvalue = capture->n ? captureUpvalue(&slots[capture->a]) : frame->closure->upvalues[capture->a];
+                garbageCollector.beforeWrite(&closure->object);
+                closure->upvalues.push_back(upvalue);
+                garbageCollector.writeBarrier(&closure->object, (Object*)upvalue);
+            }
+            DISPATCH();
         }
-        case OP_CLASS:
-            push(Value(garbageCollector.newClass(readConstant().getString()->chars)));
-            break;
-        case OP_METHOD:
-            defineMethod(readConstant().getString());
-            break;
-        case OP_ARRAY: {
-            int itemCount = readByte();
-            Instance* instance = garbageCollector.newInstance(nullptr);
-            for (int i = itemCount - 1; i >= 0; i--) {
-                instance->fields.insert({ std::to_string(i), pop() });
+        CASE(R_CAPTURE):
+            DISPATCH();
+        CASE(R_CLOSE_UPVALUE):
+            closeUpvalues(&slots[instruction->a]);
+            DISPATCH();
+        CASE(R_RETURN): {
+            Value result = RK(instruction->a);
+            closeUpvalues(slots);
+
+            frameCount--;
+            if (frameCount == 0) {
+                stackTop = slots;
+                return InterpretResult::ok;
             }
-            push(Value(instance));
-            break;
+
+            slots[0] = result;
+            stackTop = frames[frameCount - 1].top;
+            LOAD_FRAME();
+            DISPATCH();
         }
-        case OP_MAP: {
-            Instance* instance = garbageCollector.newInstance(nullptr);
-            push(Value(instance));
-            break;
+        CASE(R_CLASS):
+            STORE_FRAME();
+            slots[instruction->a] = Value(garbageCollector.newClass(constants[instruction->n].getString()->chars));
+            DISPATCH();
+        CASE(R_METHOD): {
+            Class* klass = RK(instruction->a).getClass();
+            garbageCollector.beforeWrite(&klass->object);
+            klass->methods[constants[instruction->n].getString()] = RK(instruction->b);
+            garbageCollector.writeBarrier(&klass->object, RK(instruction->b));
+            garbageCollector.writeBarrier(&klass->object, constants[instruction->n]);
+            DISPATCH();
         }
-        case OP_KEY: {
-            Value value = pop();
-            Value instance = pop();
-            std::string key = readConstant().getString()->chars;
-            instance.getInstance()->fields.insert({ key, value });
-            push(instance);
-            break;
+        CASE(R_ARRAY): {
+            STORE_FRAME();
+            Array* array = garbageCollector.newArray();
+            array->values.assign(slots + instruction->a, slots + instruction->a + instruction->n);
+            slots[instruction->a] = Value(array);
+            DISPATCH();
         }
+        CASE(R_MAP):
+            STORE_FRAME();
+            slots[instruction->a] = Value(garbageCollector.newInstance(nullptr));
+            DISPATCH();
+        CASE(R_KEY):
+            STORE_FRAME();
+            setField(RK(instruction->a).getInstance(), constants[instruction->n].getString(), RK(instruction->b));
+            DISPATCH();
         }
+#ifndef COMPUTED_GOTO
     }
+#endif
+
+#undef RK
+#undef READ_CACHE
+#undef STORE_FRAME
+#undef LOAD_FRAME
+#undef RUNTIME_ERROR
+#undef NUMBER_OPERANDS
+#undef CASE
+#undef DISPATCH
 }
 
-InterpretResult VM::interpret(std::string& source) {
+InterpretResult VM::interpret(std::string& source, const AotProgram* program) {
+    garbageCollector.stackBase = __builtin_frame_address(0);
     Function* fn = compile(source, &garbageCollector);
 
     if (fn == nullptr) {
         return InterpretResult::compileError;
     }
 
-    stack.push_back(Value(fn));
+    // Translated code doesn't count calls, so nothing is handed to the JIT.
+    if (program != nullptr) {
+        if (!AotRuntime::install(fn, *program)) return InterpretResult::compileError;
+        jitEnabled = false;
+    }
+
+    push(Value(fn));
     Closure* closure = garbageCollector.newClosure(fn);
     pop();
     push(Value(closure));
     call(closure, 0);
 
-    return run();
+    if (program != nullptr) {
+        return AotRuntime::run(this, 0) ? InterpretResult::ok : InterpretResult::runtimeError;
+    }
+    if (!registerTier || !compileRegisters(fn, &garbageCollector)) {
+        return run();
+    }
+    if (!enterRegisterFrame()) {
+        return InterpretResult::runtimeError;
+    }
+    return runRegisters();
+}
+
+bool VM::emitCpp(std::string& source, std::ostream& out) {
+    Function* fn = compile(source, &garbageCollector);
+    if (fn == nullptr) return false;
+
+    writeCpp(fn, source, out);
+    return true;
+}
+
+void VM::setRegisterTier(bool enabled) {
+    registerTier = enabled;
+}
+
+void VM::setJit(bool enabled) {
+    jitEnabled = enabled;
+}
+
+void VM::setGCPauseTarget(double ms) {
+    garbageCollector.pauseTarget = ms;
+}
+
+void VM::setGCStats(bool enabled) {
+    gcStats = enabled;
+}
+
+void VM::setCacheStats(bool enabled) {
+    cacheStats = enabled;
+}
+
+void VM::setConcurrentGC(bool enabled) {
+    garbageCollector.concurrent = enabled;
+}
+
+void VM::setGCThreshold(size_t bytes) {
+    garbageCollector.nextGC = bytes;
+}
+
+void VM::setGCGrowth(double factor) {
+    garbageCollector.growthFactor = factor;
+}
+
+void VM::setHeapMax(size_t bytes) {
+    garbageCollector.heapMax = bytes;
+}
+
+void VM::setGCCompact(double fraction) {
+    garbageCollector.compactThreshold = fraction;
+}
+
+void VM::setHeapSnapshot(const std::string& path) {
+    garbageCollector.heapSnapshotPath = path;
+}
+
+AllocationProfiler* VM::allocationProfiler() {
+    if (garbageCollector.profiler == nullptr) {
+        garbageCollector.profiler = new AllocationProfiler(&garbageCollector, 1);
+    }
+    return garbageCollector.profiler;
+}
+
+void VM::setAllocationProfile(size_t rate) {
+    allocationProfiler()->setRate(rate);
+    allocationProfiler()->printReport = true;
+}
+
+void VM::setAllocationProfileJson(const std::string& path) {
+    allocationProfiler()->jsonPath = path;
 }
 
 VM::~VM() {
+    if (cacheStats) {
+        std::cerr << "inline caches: " << cacheHits << " hits, " << cacheMisses << " misses" << std::endl;
+    }
+    if (profileOpcodes) {
+        printOpcodePairs();
+    }
+    if (countInstructions) {
+        std::cout << "-- instructions " << instructionCount << std::endl;
+    }
+    if (gcStats) {
+        garbageCollector.printStats(std::cerr);
+    }
+    if (!garbageCollector.heapSnapshotPath.empty() && !garbageCollector.heapSnapshotWritten) {
+        garbageCollector.writeHeapSnapshot();
+    }
+    if (garbageCollector.profiler != nullptr) {
+        garbageCollector.profiler->writeReports();
+        delete garbageCollector.profiler;
+        garbageCollector.profiler = nullptr;
+    }
     initString = nullptr;
     garbageCollector.freeObjects();
 }
\ No newline at end of file
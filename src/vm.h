@@ -2,6 +2,7 @@
 #define vm_h
 
 #include <vector>
+#include <ostream>
 #include <unordered_map>
 #include "value.h"
 #include "memory.h"
@@ -10,45 +11,135 @@ enum class InterpretResult {
     ok, compileError, runtimeError
 };
 
+#ifndef FRAMES_MAX
+#define FRAMES_MAX 4096
+#endif
+#define FRAME_SLOTS 256
+#define STACK_MAX (FRAMES_MAX * FRAME_SLOTS)
+
+class TraceRecorder;
+class AllocationProfiler;
+struct AotProgram;
+
 class VM {
 private:
-    std::vector<CallFrame> frames;
-    std::vector<Value> stack;
-    std::unordered_map<std::string, Value> globals;
+    CallFrame frames[FRAMES_MAX];
+    int frameCount = 0;
+    Value stack[STACK_MAX];
+    Value* stackTop;
+    Globals globals;
     String* initString = nullptr;
     Upvalue* openUpvalues = nullptr;
     GC garbageCollector;
+    bool cacheStats = false;
+    size_t cacheHits = 0;
+    size_t cacheMisses = 0;
+    // Counts of each pair of consecutive opcodes, allocated once profiling.
+    std::vector<size_t> opcodePairs;
+    uint8_t previousOpcode = 0;
+    size_t instructionCount = 0;
+    bool registerTier = false;
+    bool jitEnabled = true;
+    bool gcStats = false;
+    TraceRecorder* recorder = nullptr;
 
     bool clockNative(int argCount, Value* args);
     bool readNumberNative(int argCount, Value* args);
     bool stringifyNative(int argCount, Value* args);
     bool roundNative(int argCount, Value* args);
+    bool lengthNative(int argCount, Value* args);
+    bool appendNative(int argCount, Value* args);
+    bool popNative(int argCount, Value* args);
+    bool gcStatsNative(int argCount, Value* args);
+    bool collectNative(int argCount, Value* args);
+    void setMapField(const std::string& key);
 
+    void countOpcode(uint8_t opcode);
+    void printOpcodePairs();
     void runtimeError(const std::string& format);
+    void resetStack();
     void defineNative(std::string name, NativeFn function);
+    AllocationProfiler* allocationProfiler();
 
     void push(Value value);
     Value pop();
     Value peek(int distance);
     bool call(Closure* closure, int argCount);
     bool callValue(Value callee, int argCount);
-    bool invokeFromClass(Class* klass, std::string name, int argCount);
-    bool invoke(Value receiver, std::string name, int argCount);
-    bool bindMethod(Class* klass, std::string name);
+    bool invokeFromClass(Class* klass, String* name, int argCount);
+    bool invoke(Value receiver, String* name, int argCount);
+    bool getField(Instance* instance, String* name, Value& value);
+    void setField(Instance* instance, String* name, Value value);
+    void makeDictionary(Instance* instance);
+    void updateCache(InlineCache* cache, const InlineCacheEntry& entry);
+    void cacheLookup(InlineCache* cache, Instance* instance, String* name);
+    bool bindMethod(Class* klass, String* name);
+    bool arrayIndex(Array* array, Value key, size_t& index, bool store = false);
     Upvalue* captureUpvalue(Value* local);
     void closeUpvalues(Value* last);
     void defineMethod(String* name);
 
-    uint8_t readByte();
-    uint16_t readShort();
-    Value readConstant();
-    InterpretResult run();
+    bool enterRegisterFrame();
+    bool returnToRegisters(int callerFrameCount);
+
+    void warmUp(Function* function);
+    bool loopBackEdge(CallFrame* frame);
+    bool runJit();
+    bool finishCall();
+
+    static Value* jitCall(VM* vm, Value* sp, int argCount);
+    static Value* jitTailCall(VM* vm, Value* sp, int argCount);
+    static Value* jitInvoke(VM* vm, Value* sp, String* name, int argCount);
+    static Value* jitReturn(VM* vm, Value* sp);
+    static Value* jitAdd(VM* vm, Value* sp);
+    static Value* jitGetUpvalue(VM* vm, Value* sp, int index);
+    static Value* jitSetUpvalue(VM* vm, Value* sp, int index);
+    static Value* jitCloseUpvalue(VM* vm, Value* sp);
+    static bool jitEqual(Value* sp);
+    static double jitRemain(double a, double b);
+    static void jitPrint(Value* sp, bool newline);
+    friend class JitCompiler;
+    friend class AotRuntime;
+
+    InterpretResult run(int baseFrame = 0);
+    InterpretResult runRegisters();
 public:
     VM();
-    InterpretResult interpret(std::string& source);
+    InterpretResult interpret(std::string& source, const AotProgram* program = nullptr);
+    bool emitCpp(std::string& source, std::ostream& out);
+    void setRegisterTier(bool enabled);
+    void setJit(bool enabled);
+    void setGCPauseTarget(double ms);
+    void setGCStats(bool enabled);
+    void setCacheStats(bool enabled);
+    void setConcurrentGC(bool enabled);
+    void setGCThreshold(size_t bytes);
+    void setGCGrowth(double factor);
+    void setHeapMax(size_t bytes);
+    void setGCCompact(double fraction);
+    void setHeapSnapshot(const std::string& path);
+    void setAllocationProfile(size_t rate);
+    void setAllocationProfileJson(const std::string& path);
     ~VM();
 };
 
 InterpretResult interpret(std::string& source);
+InterpretResult interpretAot(std::string& source, const AotProgram& program);
+bool emitCpp(std::string& source, std::ostream& out);
+void useRegisterTier(bool enabled);
+void useJit(bool enabled);
+void useGCPauseTarget(double ms);
+void useGCStats(bool enabled);
+void useCacheStats(bool enabled);
+void useConcurrentGC(bool enabled);
+void useGCThreshold(size_t bytes);
+void useGCGrowth(double factor);
+void useHeapMax(size_t bytes);
+void useGCCompact(double fraction);
+void useHeapSnapshot(const std::string& path);
+void useAllocationProfile(size_t rate);
+void useAllocationProfileJson(const std::string& path);
+bool useHeapOption(const std::string& name, const char* value);
+bool useHeapEnvironment();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,22 @@
+#!/bin/sh
+# Runs every test script on each tier and checks that its output contains the
+# line given by its "// expect:" comment. Usage: tests/run.sh [path to p++]
+PPLUS=${1:-./p++}
+failed=0
+
+for test in "$(dirname "$0")"/*.p; do
+    flags=$(sed -n 's|^// flags: ||p' "$test")
+    expect=$(sed -n 's|^// expect: ||p' "$test")
+    for tier in "" --no-jit --registers; do
+        # Cap the address space so a runaway test fails instead of swapping.
+        output=$( (ulimit -v 2000000; $PPLUS $flags $tier "$test") 2>&1 </dev/null)
+        if ! printf '%s\n' "$output" | grep -qxF "$expect"; then
+            echo "FAIL $test $tier"
+            printf '%s\n' "$output" | head -5
+            failed=1
+        fi
+    done
+done
+
+[ $failed = 0 ] && echo "All tests passed."
+exit $failed
@@ -0,0 +1,6 @@
+// flags: --heap-max=16M
+// expect: Out of memory.
+
+fun g(n, a) { return h(n + 1, [a, n]); }
+fun h(n, a) { return g(n + 1, {x: a}); }
+g(0, nil);
@@ -0,0 +1,6 @@
+// flags: --heap-max=16M
+// expect: Out of memory.
+
+// Every call reuses the frame, so only the heap limit can stop the recursion.
+fun f(n, a) { return f(n + 1, [a, n]); }
+f(0, nil);